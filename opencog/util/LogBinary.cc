@@ -0,0 +1,241 @@
+/*
+ * opencog/util/LogBinary.cc
+ *
+ * Copyright (C) 2008 by OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <opencog/util/LogFormat.h>
+
+#include "LogBinary.h"
+
+using namespace opencog;
+
+void logbin::format_header(std::string& out, uint8_t flags,
+                           Logger::Level level, uint64_t stamp,
+                           std::string_view component, uint64_t thread)
+{
+    char buf[64];
+    if (flags & TIMESTAMP)
+    {
+        struct tm stm;
+        time_t t = stamp / 1000000000;
+        gmtime_r(&t, &stm);
+        size_t n = strftime(buf, sizeof(buf), "[%F %T:", &stm);
+        n += snprintf(buf + n, sizeof(buf) - n, "%03u] ",
+                      (unsigned) (stamp / 1000000 % 1000));
+        out.append(buf, n);
+    }
+
+    if (flags & LEVEL)
+    {
+        out.push_back('[');
+        out.append(Logger::get_level_string(level));
+        out.append("] ");
+    }
+
+    out.append(component);
+
+    if (flags & THREAD)
+    {
+        out.append("[thread-");
+        logfmt::append(out, (unsigned long) thread);
+        out.append("] ");
+    }
+}
+
+namespace {
+
+// Days since 1970-01-01 of a date in the proleptic Gregorian calendar;
+// timegm(), without the time zone lookups.
+int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned) (y - era * 400);
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t) doe - 719468;
+}
+
+// `n` decimal digits at `p`, or -1 if they are not all digits.
+int digits(const char* p, int n)
+{
+    int v = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (p[i] < '0' or '9' < p[i]) return -1;
+        v = v * 10 + (p[i] - '0');
+    }
+    return v;
+}
+
+// A bracketed tag, "[...] ", at `p`; its length, or zero.
+size_t tag(const char* p, const char* end, std::string_view& inside)
+{
+    if (end - p < 3 or '[' != *p) return 0;
+    const char* close = (const char*) memchr(p, ']', end - p);
+    if (nullptr == close or end - close < 2 or ' ' != close[1]) return 0;
+    inside = std::string_view(p + 1, close - p - 1);
+    return close + 2 - p;
+}
+
+} // anonymous namespace
+
+bool logbin::parse_header(const char* line, size_t len, Header& h)
+{
+    h = Header();
+    const char* p = line;
+    const char* end = line + len;
+    bool found = false;
+
+    // [2024-01-31 23:59:59:999]
+    static const char layout[] = "[dddd-dd-dd dd:dd:dd:ddd] ";
+    if ((size_t) (end - p) >= sizeof(layout) - 1 and '[' == p[0] and
+        '-' == p[5] and '-' == p[8] and ' ' == p[11] and ':' == p[14] and
+        ':' == p[17] and ':' == p[20] and ']' == p[24] and ' ' == p[25])
+    {
+        int y = digits(p + 1, 4), mo = digits(p + 6, 2), d = digits(p + 9, 2);
+        int hh = digits(p + 12, 2), mm = digits(p + 15, 2);
+        int ss = digits(p + 18, 2), ms = digits(p + 21, 3);
+        if (0 <= y and 0 < mo and mo <= 12 and 0 < d and 0 <= hh and
+            0 <= mm and 0 <= ss and 0 <= ms)
+        {
+            int64_t secs = days_from_civil(y, mo, d) * 86400 +
+                           hh * 3600 + mm * 60 + ss;
+            h.stamp = secs * 1000000000ULL + ms * 1000000ULL;
+            p += sizeof(layout) - 1;
+            found = true;
+        }
+    }
+
+    std::string_view inside;
+    size_t n = tag(p, end, inside);
+    if (0 < n)
+    {
+        for (int lvl = Logger::NONE; lvl <= Logger::FINE; lvl++)
+            if (inside == Logger::get_level_string((Logger::Level) lvl))
+            {
+                h.level = lvl;
+                p += n;
+                n = tag(p, end, inside);
+                found = true;
+                break;
+            }
+    }
+    if (not found) return false;
+
+    if (0 < n and 0 != inside.compare(0, 7, "thread-"))
+    {
+        h.component = inside;
+        p += n;
+        n = tag(p, end, inside);
+    }
+    if (0 < n and 0 == inside.compare(0, 7, "thread-"))
+    {
+        h.thread = inside.substr(7);
+        p += n;
+    }
+    h.length = p - line;
+    return true;
+}
+
+namespace {
+
+// Take `size` bytes off the front of the argument buffer.
+bool take(void* dst, size_t size, const char*& args, const char* end)
+{
+    if ((size_t) (end - args) < size) return false;
+    memcpy(dst, args, size);
+    args += size;
+    return true;
+}
+
+template<typename T>
+bool one_scalar(std::string& out, const char*& args, const char* end,
+                std::string_view spec)
+{
+    T v;
+    if (not take(&v, sizeof(v), args, end)) return false;
+    logfmt::append(out, v, spec.data(), spec.data() + spec.size());
+    return true;
+}
+
+/// Decode and format one argument, for the placeholder whose contents
+/// are `spec`.
+bool one_arg(std::string& out, char code, const char*& args, const char* end,
+             std::string_view spec)
+{
+    switch (code)
+    {
+        case 's':
+        {
+            size_t len;
+            if (not take(&len, sizeof(len), args, end)) return false;
+            if ((size_t) (end - args) < len) return false;
+            logfmt::append(out, std::string_view(args, len),
+                           spec.data(), spec.data() + spec.size());
+            args += len;
+            return true;
+        }
+        case 'b': return one_scalar<bool>(out, args, end, spec);
+        case 'c': return one_scalar<char>(out, args, end, spec);
+        case 'p': return one_scalar<const void*>(out, args, end, spec);
+        case 'f': return one_scalar<float>(out, args, end, spec);
+        case 'd': return one_scalar<double>(out, args, end, spec);
+        case 'D': return one_scalar<long double>(out, args, end, spec);
+        case 'g': return one_scalar<int8_t>(out, args, end, spec);
+        case 'h': return one_scalar<int16_t>(out, args, end, spec);
+        case 'i': return one_scalar<int32_t>(out, args, end, spec);
+        case 'l': return one_scalar<int64_t>(out, args, end, spec);
+        case 'G': return one_scalar<uint8_t>(out, args, end, spec);
+        case 'H': return one_scalar<uint16_t>(out, args, end, spec);
+        case 'I': return one_scalar<uint32_t>(out, args, end, spec);
+        case 'L': return one_scalar<uint64_t>(out, args, end, spec);
+        default: return false;
+    }
+}
+
+} // anonymous namespace
+
+bool logbin::format_args(std::string& out, const char* fmt, const char* sig,
+                         const char* args, size_t len)
+{
+    const char* end = args + len;
+    for (; *sig; sig++)
+    {
+        logfmt::format_next(out, fmt);
+        if (0 == *fmt) break;
+        const char* spec_end = strchr(fmt, '}');
+        if (not one_arg(out, *sig, args, end,
+                        std::string_view(fmt + 1, spec_end - fmt - 1)))
+            return false;
+        fmt = spec_end + 1;
+    }
+
+    // Unmatched placeholders are printed as they are.
+    while (*fmt)
+    {
+        logfmt::format_next(out, fmt);
+        if (*fmt) out.push_back(*fmt++);
+    }
+    return true;
+}
@@ -0,0 +1,142 @@
+/*
+ * opencog/util/LogBinary.h
+ *
+ * Copyright (C) 2008 by OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _OPENCOG_LOG_BINARY_H
+#define _OPENCOG_LOG_BINARY_H
+
+// Private to the Logger implementation and the log tools; this header
+// is not installed.
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <opencog/util/Logger.h>
+
+namespace opencog
+{
+/** \addtogroup grp_cogutil
+ *  @{
+ */
+
+//! The binary log format, written by the LogWriter when the binary
+//! flag is set, and read back by cogutil-logdecode.
+///
+/// A file is a sequence of sessions; each session starts with the
+/// magic string, and is followed by frames. Frames are not aligned,
+/// and use the byte order of the host that wrote them. A call site
+/// (that is, a format string and a level) is described by a DEF frame
+/// the first time it is seen in a session; after that, a MSG frame
+/// carries only the id, the timestamp, the thread and the packed
+/// arguments. Messages that were formatted in the caller are stored
+/// as TEXT frames.
+namespace logbin
+{
+
+static constexpr char MAGIC[8] = {'O','C','L','O','G','B','I','N'};
+
+enum Frame : uint8_t
+{
+    SESSION = 'O',     // first byte of MAGIC
+    DEF = 'D',
+    COMPONENT = 'C',
+    MSG = 'M',
+    TEXT = 'T',
+};
+
+enum Flags : uint8_t
+{
+    TIMESTAMP = 1,
+    LEVEL = 2,
+    THREAD = 4,
+};
+
+struct __attribute__((packed)) DefFrame
+{
+    uint8_t type;
+    uint8_t level;
+    uint32_t id;
+    uint16_t fmt_len;
+    uint16_t sig_len;
+    // followed by the format string and the signature
+};
+
+struct __attribute__((packed)) ComponentFrame
+{
+    uint8_t type;
+    uint32_t id;
+    uint16_t len;
+    // followed by the "[component] " tag
+};
+
+struct __attribute__((packed)) MsgFrame
+{
+    uint8_t type;
+    uint8_t flags;
+    uint32_t id;
+    uint32_t component;   // zero if there is none
+    uint64_t stamp;       // nanoseconds since the epoch
+    uint64_t thread;
+    uint32_t args_len;
+    // followed by the packed arguments
+};
+
+struct __attribute__((packed)) TextFrame
+{
+    uint8_t type;
+    uint32_t len;
+    // followed by the text, including the trailing newline
+};
+
+/// Append the message header, laid out just as Logger::log() does it.
+void format_header(std::string& out, uint8_t flags, Logger::Level,
+                   uint64_t stamp, std::string_view component,
+                   uint64_t thread);
+
+/// Format packed arguments, given their signature (see
+/// logfmt::signature). Returns false if the arguments are malformed.
+bool format_args(std::string& out, const char* fmt, const char* sig,
+                 const char* args, size_t len);
+
+/// The fields of a message header in the text layout, each of them
+/// optional. The views point into the parsed line.
+struct Header
+{
+    uint64_t stamp = 0;          // nanoseconds since the epoch, or zero
+    int level = -1;              // a Logger::Level, or -1 if none
+    std::string_view component;  // without the brackets
+    std::string_view thread;     // the id, without "[thread-" and "]"
+    size_t length = 0;           // of the whole header
+};
+
+/// Parse the header at the start of a line of a text log. Returns
+/// false if the line has neither a timestamp nor a level, i.e. if it
+/// is not the first line of a message. A message that starts with
+/// something in brackets, and has no component, is taken to have one.
+bool parse_header(const char* line, size_t len, Header&);
+
+} // namespace logbin
+
+/** @}*/
+}  // namespace opencog
+
+#endif // _OPENCOG_LOG_BINARY_H
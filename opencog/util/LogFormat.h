@@ -0,0 +1,490 @@
+/*
+ * opencog/util/LogFormat.h
+ *
+ * Copyright (C) 2008 by OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _OPENCOG_LOG_FORMAT_H
+#define _OPENCOG_LOG_FORMAT_H
+
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+namespace opencog
+{
+/** \addtogroup grp_cogutil
+ *  @{
+ */
+
+//! Support for Logger::logf(), which defers formatting to the writer.
+///
+/// The caller packs the raw argument values into the log ring; the
+/// writer thread unpacks them and does the actual formatting. The
+/// format strings use std::format syntax: `{}` placeholders, in order
+/// (no argument numbers), `{{` and `}}` escapes, and a subset of the
+/// format-spec: `{:[[fill]align][+][#][0][width][.precision][type]}`,
+/// where the type is one of `d x X o b B c` for integers, `f F e E g G`
+/// for floating point, `s` for strings and bools and `p` for pointers.
+/// Widths count bytes. A placeholder with a spec that is not in this
+/// subset, or that does not fit the argument, prints the argument as
+/// if it were plain `{}`, followed by a note about the spec; nothing
+/// is thrown. (std::format itself is not available in all of the
+/// C++20 compilers that we support.)
+///
+/// Arithmetic types, enums, pointers and strings are packed by value.
+/// Anything else is printed with operator<< right away, in the caller,
+/// and is passed along as a string.
+namespace logfmt
+{
+
+template<typename T>
+constexpr bool is_string =
+    std::is_convertible_v<const T&, std::string_view>;
+
+template<typename T>
+constexpr bool is_scalar =
+    not is_string<T> and (std::is_arithmetic_v<T> or
+                          std::is_enum_v<T> or std::is_pointer_v<T>);
+
+/// True if the argument can be packed without formatting it first.
+template<typename T>
+constexpr bool is_packable = is_string<T> or is_scalar<T>;
+
+/// The type that a packed argument is unpacked as.
+template<typename T>
+using unpacked_t = std::conditional_t<is_scalar<T>, T, std::string_view>;
+
+inline std::string_view as_string(const char* s)
+{
+    return s ? std::string_view(s) : std::string_view("(null)");
+}
+template<typename T>
+std::string_view as_string(const T& s) { return std::string_view(s); }
+
+template<typename T>
+size_t packed_size(const T& v)
+{
+    if constexpr (is_scalar<T>) return sizeof(T);
+    else return sizeof(size_t) + as_string(v).size();
+}
+
+template<typename T>
+void pack(char*& p, const T& v)
+{
+    if constexpr (is_scalar<T>)
+    {
+        memcpy(p, &v, sizeof(T));
+        p += sizeof(T);
+    }
+    else
+    {
+        std::string_view s(as_string(v));
+        size_t len = s.size();
+        memcpy(p, &len, sizeof(len));
+        memcpy(p + sizeof(len), s.data(), len);
+        p += sizeof(len) + len;
+    }
+}
+
+template<typename T>
+unpacked_t<T> unpack(const char*& p)
+{
+    if constexpr (is_scalar<T>)
+    {
+        T v;
+        memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return v;
+    }
+    else
+    {
+        size_t len;
+        memcpy(&len, p, sizeof(len));
+        std::string_view s(p + sizeof(len), len);
+        p += sizeof(len) + len;
+        return s;
+    }
+}
+
+// Append a single argument to the output.
+template<typename T>
+void append(std::string& out, const T& v)
+{
+    if constexpr (is_string<T>)
+        out.append(as_string(v));
+    else if constexpr (std::is_same_v<T, bool>)
+        out.append(v ? "true" : "false");
+    else if constexpr (std::is_same_v<T, char>)
+        out.push_back(v);
+    else if constexpr (std::is_enum_v<T>)
+        append(out, static_cast<std::underlying_type_t<T>>(v));
+    else if constexpr (std::is_pointer_v<T>)
+    {
+        char buf[2 + 2 * sizeof(void*)] = {'0', 'x'};
+        auto r = std::to_chars(buf + 2, buf + sizeof(buf),
+                               reinterpret_cast<uintptr_t>(v), 16);
+        out.append(buf, r.ptr);
+    }
+    else if constexpr (std::is_arithmetic_v<T>)
+    {
+        char buf[64];
+        auto r = std::to_chars(buf, buf + sizeof(buf), v);
+        out.append(buf, r.ptr);
+    }
+    else
+    {
+        std::ostringstream oss;
+        oss << v;
+        out.append(oss.str());
+    }
+}
+
+/// A parsed format-spec; see above.
+struct Spec
+{
+    char fill = ' ';
+    char align = 0;     // '<', '>', '^', or 0 for the default
+    bool plus = false;
+    bool alt = false;   // '#': 0x, 0b, 0 prefixes
+    bool zero = false;
+    size_t width = 0;
+    int precision = -1;
+    char type = 0;
+};
+
+/// Parse the placeholder contents between `p`, just past the opening
+/// brace, and `end`, the closing brace. False if they are not valid.
+inline bool parse_spec(Spec& s, const char* p, const char* end)
+{
+    if (p == end) return true;
+    if (':' != *p++) return false;
+
+    auto is_align = [](char c) { return '<' == c or '>' == c or '^' == c; };
+    if (1 < end - p and is_align(p[1]) and '{' != p[0])
+    {
+        s.fill = p[0];
+        s.align = p[1];
+        p += 2;
+    }
+    else if (p < end and is_align(*p))
+        s.align = *p++;
+    if (p < end and '+' == *p) { s.plus = true; p++; }
+    if (p < end and '#' == *p) { s.alt = true; p++; }
+    if (p < end and '0' == *p) { s.zero = true; p++; }
+    while (p < end and isdigit((unsigned char) *p))
+    {
+        s.width = s.width * 10 + (*p++ - '0');
+        if (1000 < s.width) return false;
+    }
+    if (p < end and '.' == *p)
+    {
+        p++;
+        if (p == end or not isdigit((unsigned char) *p)) return false;
+        s.precision = 0;
+        while (p < end and isdigit((unsigned char) *p))
+        {
+            s.precision = s.precision * 10 + (*p++ - '0');
+            if (1000 < s.precision) return false;
+        }
+    }
+    if (p < end and strchr("dxXobBcfFeEgGsp", *p)) s.type = *p++;
+    return p == end;
+}
+
+inline void to_upper(std::string& out, size_t from)
+{
+    for (size_t i = from; i < out.size(); i++)
+        out[i] = toupper((unsigned char) out[i]);
+}
+
+/// Append an integer according to the spec. Returns the length of the
+/// sign and base prefix, which zero padding goes after, or -1 if the
+/// spec does not apply.
+template<typename T>
+int append_int(std::string& out, T v, const Spec& s)
+{
+    int base = 10;
+    switch (s.type)
+    {
+        case 0: case 'd': break;
+        case 'x': case 'X': base = 16; break;
+        case 'o': base = 8; break;
+        case 'b': case 'B': base = 2; break;
+        case 'c':
+            if (s.plus or s.alt or 0 <= s.precision) return -1;
+            out.push_back((char) v);
+            return 0;
+        default: return -1;
+    }
+    if (0 <= s.precision) return -1;
+
+    char buf[2 + 8 * sizeof(T)];
+    auto r = std::to_chars(buf, buf + sizeof(buf), v, base);
+    const char* digits = buf;
+    size_t start = out.size();
+    if ('-' == *digits) out.push_back(*digits++);
+    else if (s.plus) out.push_back('+');
+    if (s.alt and 10 != base)
+    {
+        out.push_back('0');
+        if (8 != base) out.push_back(s.type);
+    }
+    int prefix = out.size() - start;
+    out.append(digits, r.ptr - digits);
+    if ('X' == s.type) to_upper(out, start);
+    return prefix;
+}
+
+template<typename T>
+int append_float(std::string& out, T v, const Spec& s)
+{
+    if (s.alt) return -1;
+    std::chars_format cf;
+    switch (s.type)
+    {
+        case 0: case 'g': case 'G': cf = std::chars_format::general; break;
+        case 'f': case 'F': cf = std::chars_format::fixed; break;
+        case 'e': case 'E': cf = std::chars_format::scientific; break;
+        default: return -1;
+    }
+    size_t start = out.size();
+    if (s.plus and not std::signbit(v)) out.push_back('+');
+    int prec = s.precision;
+    if (s.type and prec < 0) prec = 6;
+
+    // Fixed notation of a huge value can take a lot of digits.
+    char buf[128];
+    std::to_chars_result r = (prec < 0) ?
+        std::to_chars(buf, buf + sizeof(buf), v) :
+        std::to_chars(buf, buf + sizeof(buf), v, cf, prec);
+    if (std::errc() == r.ec) out.append(buf, r.ptr);
+    else
+    {
+        std::string big(5000 + prec, 0);
+        r = std::to_chars(big.data(), big.data() + big.size(), v, cf, prec);
+        out.append(big.data(), r.ptr);
+    }
+    if (isupper((unsigned char) s.type)) to_upper(out, start);
+    return (s.plus or std::signbit(v)) ? 1 : 0;
+}
+
+/// Append a single argument according to the spec, without the
+/// padding. Returns as append_int() does.
+template<typename T>
+int append_spec(std::string& out, const T& v, const Spec& s)
+{
+    bool stringish = 0 == s.type or 's' == s.type;
+    bool plain = not s.plus and not s.alt and not s.zero;
+    if constexpr (is_string<T>)
+    {
+        if (not stringish or not plain) return -1;
+        std::string_view str(as_string(v));
+        if (0 <= s.precision and (size_t) s.precision < str.size())
+            str = str.substr(0, s.precision);
+        out.append(str);
+        return 0;
+    }
+    else if constexpr (std::is_same_v<T, bool>)
+    {
+        if (not stringish) return append_int(out, (unsigned) v, s);
+        if (not plain or 0 <= s.precision) return -1;
+        append(out, v);
+        return 0;
+    }
+    else if constexpr (std::is_same_v<T, char>)
+    {
+        if (0 != s.type and 'c' != s.type) return append_int(out, (int) v, s);
+        if (not plain or 0 <= s.precision) return -1;
+        out.push_back(v);
+        return 0;
+    }
+    else if constexpr (std::is_enum_v<T>)
+        return append_spec(out, static_cast<std::underlying_type_t<T>>(v), s);
+    else if constexpr (std::is_pointer_v<T>)
+    {
+        if ((0 != s.type and 'p' != s.type) or not plain or
+            0 <= s.precision)
+            return -1;
+        append(out, v);
+        return 0;
+    }
+    else if constexpr (std::is_floating_point_v<T>)
+        return append_float(out, v, s);
+    else if constexpr (std::is_arithmetic_v<T>)
+        return append_int(out, v, s);
+    else
+    {
+        std::string str;
+        append(str, v);
+        return append_spec(out, std::string_view(str), s);
+    }
+}
+
+/// Append a single argument for the placeholder whose contents are
+/// between `spec` and `end`; see parse_spec().
+template<typename T>
+void append(std::string& out, const T& v, const char* spec, const char* end)
+{
+    if (spec == end) { append(out, v); return; }
+
+    constexpr bool numeric = std::is_arithmetic_v<T> and
+        not std::is_same_v<T, bool> and not std::is_same_v<T, char>;
+    Spec s;
+    size_t start = out.size();
+    int prefix = parse_spec(s, spec, end) ? append_spec(out, v, s) : -1;
+    if (prefix < 0)
+    {
+        out.resize(start);
+        append(out, v);
+        out.append(" (bad format {");
+        out.append(spec, end);
+        out.append("})");
+        return;
+    }
+
+    size_t len = out.size() - start;
+    if (s.width <= len) return;
+    size_t n = s.width - len;
+    char align = s.align;
+    if (0 == align)
+        align = (s.zero and numeric) ? '=' : numeric ? '>' : '<';
+    switch (align)
+    {
+        case '=': out.insert(start + prefix, n, '0'); break;
+        case '>': out.insert(start, n, s.fill); break;
+        case '<': out.append(n, s.fill); break;
+        case '^':
+            out.insert(start, n / 2, s.fill);
+            out.append(n - n / 2, s.fill);
+            break;
+    }
+}
+
+inline void format_next(std::string& out, const char*& fmt)
+{
+    // Copy literal text up to the next placeholder.
+    while (*fmt)
+    {
+        if ('{' == fmt[0] and '{' == fmt[1]) { out.push_back('{'); fmt += 2; }
+        else if ('}' == fmt[0] and '}' == fmt[1]) { out.push_back('}'); fmt += 2; }
+        else if ('{' == fmt[0] and strchr(fmt, '}')) return;
+        else out.push_back(*fmt++);
+    }
+}
+
+/// Format the arguments according to fmt, appending to out.
+template<typename... Args>
+void format(std::string& out, const char* fmt, const Args&... args)
+{
+    auto one = [&](const auto& v)
+    {
+        format_next(out, fmt);
+        if (0 == *fmt) return;
+        const char* end = strchr(fmt, '}');
+        append(out, v, fmt + 1, end);
+        fmt = end + 1;
+    };
+    (one(args), ...);
+
+    // Unmatched placeholders are printed as they are.
+    while (*fmt)
+    {
+        format_next(out, fmt);
+        if (*fmt) out.push_back(*fmt++);
+    }
+}
+
+/// Unpack arguments that were packed with pack(), and format them.
+/// An instance of this is stored with every deferred message.
+template<typename... Args>
+void format_packed(std::string& out, const char* fmt, const char* buf)
+{
+    // Braced initializers are evaluated in order.
+    std::tuple<unpacked_t<Args>...> args{unpack<Args>(buf)...};
+    std::apply([&](const auto&... a) { format(out, fmt, a...); }, args);
+}
+
+typedef void (*FormatFn)(std::string&, const char*, const char*);
+
+/// Hash of the format string and the argument values; used to spot
+/// repeated messages without formatting them. Never zero.
+template<typename... Args>
+size_t hash_args(const char* fmt, const Args&... args)
+{
+    size_t h = std::hash<const void*>()(fmt);
+    auto one = [&](const auto& v)
+    {
+        using T = std::decay_t<decltype(v)>;
+        size_t hv;
+        if constexpr (is_string<T>)
+            hv = std::hash<std::string_view>()(as_string(v));
+        else
+            hv = std::hash<T>()(v);
+        h ^= hv + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    };
+    (one(args), ...);
+    return h ? h : 1;
+}
+
+/// One-character code for the type of a packed argument. The binary
+/// log format records these, so that the arguments can be decoded
+/// without the formatter that was compiled into the program.
+template<typename T>
+constexpr char type_code()
+{
+    if constexpr (is_string<T>) return 's';
+    else if constexpr (std::is_same_v<T, bool>) return 'b';
+    else if constexpr (std::is_same_v<T, char>) return 'c';
+    else if constexpr (std::is_enum_v<T>)
+        return type_code<std::underlying_type_t<T>>();
+    else if constexpr (std::is_pointer_v<T>) return 'p';
+    else if constexpr (std::is_same_v<T, float>) return 'f';
+    else if constexpr (std::is_same_v<T, double>) return 'd';
+    else if constexpr (std::is_same_v<T, long double>) return 'D';
+    else
+    {
+        static_assert(sizeof(T) <= 8, "unsupported integer type");
+        // Integers by size: 1, 2, 4, 8 bytes.
+        constexpr int idx = (sizeof(T) > 1) + (sizeof(T) > 2) + (sizeof(T) > 4);
+        return std::is_signed_v<T> ? "ghil"[idx] : "GHIL"[idx];
+    }
+}
+
+/// The type codes of all of the arguments, as a string.
+template<typename... Args>
+struct signature
+{
+    static constexpr char value[] = {type_code<Args>()..., 0};
+};
+
+} // namespace logfmt
+
+/** @}*/
+}  // namespace opencog
+
+#endif // _OPENCOG_LOG_FORMAT_H
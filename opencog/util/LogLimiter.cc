@@ -0,0 +1,128 @@
+/*
+ * opencog/util/LogLimiter.cc
+ *
+ * Copyright (C) 2008, 2010 OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <functional>
+
+#include "LogLimiter.h"
+
+using namespace opencog;
+
+Logger::LogLimiter::LogLimiter()
+    : _rate(0), _burst(0), _collapse(false)
+{
+}
+
+namespace {
+
+/// Threads are dealt out to the stripes round-robin, in the order in
+/// which they first look for a repeat.
+std::atomic<unsigned> next_stripe(0);
+thread_local unsigned t_stripe = UINT_MAX;
+
+}  // anonymous namespace
+
+unsigned Logger::LogLimiter::thread_stripe()
+{
+    if (UINT_MAX == t_stripe)
+        t_stripe = next_stripe.fetch_add(1, std::memory_order_relaxed)
+                   % NSTRIPES;
+    return t_stripe;
+}
+
+void Logger::LogLimiter::set_rate(double msgs_per_sec, unsigned burst)
+{
+    _burst.store(std::max(burst, 1u));
+    _rate.store(std::max(msgs_per_sec, 0.0));
+}
+
+void Logger::LogLimiter::set_collapse(bool c)
+{
+    _collapse.store(c);
+}
+
+bool Logger::LogLimiter::take_token(const void* site, unsigned& dropped)
+{
+    dropped = 0;
+    double rate = _rate.load(std::memory_order_relaxed);
+    if (rate <= 0) return true;
+    double burst = _burst.load(std::memory_order_relaxed);
+
+    Stripe& st = _stripes[std::hash<const void*>()(site) % NSTRIPES];
+    clock::time_point now = clock::now();
+
+    std::lock_guard<std::mutex> lock(st.mtx);
+    Bucket& b = st.sites.try_emplace(site, Bucket{burst, now, 0})
+                        .first->second;
+    b.tokens = std::min(burst, b.tokens +
+               rate * std::chrono::duration<double>(now - b.last).count());
+    b.last = now;
+    if (b.tokens < 1)
+    {
+        b.dropped++;
+        return false;
+    }
+    b.tokens -= 1;
+    dropped = b.dropped;
+    b.dropped = 0;
+    return true;
+}
+
+bool Logger::LogLimiter::check_repeat(Level lvl, size_t hash,
+                                      unsigned& repeats, Level& level)
+{
+    repeats = 0;
+    if (not _collapse.load(std::memory_order_relaxed)) return true;
+
+    Last& last = _last[thread_stripe()];
+    std::lock_guard<std::mutex> lock(last.mtx);
+    if (hash == last.hash and lvl == last.level)
+    {
+        last.repeats++;
+        return false;
+    }
+    repeats = last.repeats;
+    level = last.level;
+    last.repeats = 0;
+    last.hash = hash;
+    last.level = lvl;
+    return true;
+}
+
+std::vector<std::pair<unsigned, Logger::Level>>
+Logger::LogLimiter::take_repeats()
+{
+    std::vector<std::pair<unsigned, Level>> pending;
+    for (Last& last : _last)
+    {
+        std::lock_guard<std::mutex> lock(last.mtx);
+        if (0 < last.repeats)
+            pending.push_back({last.repeats, last.level});
+        last.repeats = 0;
+
+        // Whatever comes next is not a repeat of what came before the
+        // report.
+        last.hash = 0;
+    }
+    return pending;
+}
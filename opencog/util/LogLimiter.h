@@ -0,0 +1,113 @@
+/*
+ * opencog/util/LogLimiter.h
+ *
+ * Copyright (C) 2008, 2010 OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _OPENCOG_LOG_LIMITER_H
+#define _OPENCOG_LOG_LIMITER_H
+
+// Private to the Logger implementation; this header is not installed.
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <opencog/util/Logger.h>
+
+namespace opencog
+{
+/** \addtogroup grp_cogutil
+ *  @{
+ */
+
+//! Per-call-site rate limits, and collapsing of repeated messages.
+///
+/// Both checks are made in the calling thread, before the message is
+/// formatted. Call sites are hashed onto a handful of stripes, each
+/// with its own lock, so that threads logging from different places
+/// rarely contend. Repeats are looked for per thread: threads are
+/// dealt out to stripes of their own, each of which remembers the
+/// last message of its threads.
+class Logger::LogLimiter
+{
+    typedef std::chrono::steady_clock clock;
+
+    // Token buckets, keyed by format string.
+    std::atomic<double> _rate;
+    std::atomic<double> _burst;
+
+    struct Bucket
+    {
+        double tokens;
+        clock::time_point last;
+        unsigned dropped;
+    };
+    static constexpr unsigned NSTRIPES = 16;
+    struct Stripe
+    {
+        std::mutex mtx;
+        std::unordered_map<const void*, Bucket> sites;
+    };
+    Stripe _stripes[NSTRIPES];
+
+    // The last message, and how many times it was repeated since,
+    // for each stripe of threads.
+    std::atomic<bool> _collapse;
+    struct alignas(64) Last
+    {
+        std::mutex mtx;
+        size_t hash = 0;
+        Level level = NONE;
+        unsigned repeats = 0;
+    };
+    Last _last[NSTRIPES];
+    static unsigned thread_stripe();
+
+public:
+    LogLimiter();
+
+    void set_rate(double msgs_per_sec, unsigned burst);
+    void set_collapse(bool);
+
+    bool rate_limited() const { return 0 < _rate.load(); }
+    bool collapsing() const { return _collapse.load(); }
+
+    /// Take a token for the call site; false if there is none left.
+    /// On success, `dropped` is the number of messages from this site
+    /// that were dropped since the last one that got through.
+    bool take_token(const void* site, unsigned& dropped);
+
+    /// False if the message is the same as the last one from this
+    /// thread. Otherwise, `repeats` is the number of times the last
+    /// message was repeated, and `level` is its level.
+    bool check_repeat(Level, size_t hash, unsigned& repeats, Level& level);
+
+    /// The number of repeats not yet reported, and their level, for
+    /// each stripe that has any.
+    std::vector<std::pair<unsigned, Level>> take_repeats();
+};
+
+/** @}*/
+}  // namespace opencog
+
+#endif // _OPENCOG_LOG_LIMITER_H
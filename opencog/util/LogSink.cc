@@ -0,0 +1,1240 @@
+/*
+ * opencog/util/LogSink.cc
+ *
+ * Copyright (C) 2008, 2010 OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+#include <opencog/util/concurrent_queue.h>
+#include <opencog/util/platform.h>
+
+#include "LogSink.h"
+
+#ifdef __APPLE__
+#define fdatasync fsync
+#endif
+
+using namespace opencog;
+
+// IOV_MAX is 1024 on Linux.
+#define MAX_IOV 1024
+
+// ***********************************************/
+// Rotated files
+
+namespace {
+
+namespace fs = std::filesystem;
+
+} // anonymous namespace
+
+/// Descriptors of files that were rotated out, still to be synced and
+/// closed. Whoever syncs them holds `sync_mtx` throughout, so that a
+/// caller of FileSink::sync() that finds the list empty knows that
+/// the old files have reached the disk. The writer thread takes only
+/// `list_mtx`, and never waits for a sync.
+struct FileSink::Retired
+{
+    std::mutex sync_mtx;
+    std::mutex list_mtx;
+    std::vector<int> fds;
+
+    void add(int fd)
+    {
+        std::lock_guard<std::mutex> lock(list_mtx);
+        fds.push_back(fd);
+    }
+
+    void sync_all()
+    {
+        std::lock_guard<std::mutex> lock(sync_mtx);
+        std::vector<int> todo;
+        {
+            std::lock_guard<std::mutex> lock(list_mtx);
+            todo.swap(fds);
+        }
+        for (int fd : todo)
+        {
+            fdatasync(fd);
+            close(fd);
+        }
+    }
+};
+
+namespace {
+
+struct ArchiveJob
+{
+    std::string name;
+    LogRotation rotation;
+    std::shared_ptr<FileSink::Retired> retired;
+};
+
+/// True if `file` is `base`, rotated: base.YYYYmmdd-HHMMSS[-NNNN][.gz],
+/// and nothing else; not a temporary file, nor an index or other file
+/// kept next to the log.
+bool is_rotated(const std::string& file, const std::string& base)
+{
+    if (file.size() < base.size() + 16 or
+        file.compare(0, base.size(), base) or
+        '.' != file[base.size()])
+        return false;
+    const char* p = file.c_str() + base.size() + 1;
+    for (int i = 0; i < 15; i++)
+        if ((8 == i) != ('-' == p[i]) or (8 != i and not isdigit(p[i])))
+            return false;
+    p += 15;
+    if ('-' == *p)
+    {
+        if (not isdigit(*++p)) return false;
+        while (isdigit(*p)) p++;
+    }
+    return 0 == strcmp(p, "") or 0 == strcmp(p, ".gz");
+}
+
+#ifdef HAVE_ZLIB
+bool gzip_file(const std::string& path)
+{
+    std::string gzpath(path + ".gz");
+    std::string tmp(gzpath + ".tmp");
+    FILE* in = fopen(path.c_str(), "rb");
+    if (nullptr == in) return false;
+    gzFile out = gzopen(tmp.c_str(), "wb6");
+    if (nullptr == out) { fclose(in); return false; }
+
+    std::vector<char> buf(1 << 16);
+    size_t n;
+    bool ok = true;
+    while (ok and 0 < (n = fread(buf.data(), 1, buf.size(), in)))
+        ok = (int) n == gzwrite(out, buf.data(), n);
+    ok = (Z_OK == gzclose(out)) and ok and not ferror(in);
+    fclose(in);
+
+    // Replace the original only once the compressed copy is complete.
+    if (ok and 0 == rename(tmp.c_str(), gzpath.c_str()))
+        return 0 == unlink(path.c_str());
+    unlink(tmp.c_str());
+    return false;
+}
+#endif
+
+/// Compress rotated files, and delete all but the newest few. This
+/// looks at everything in the directory, so that files left behind
+/// by an earlier run (say, one that exited before compressing them)
+/// get taken care of as well.
+void tidy(const ArchiveJob& job)
+{
+    fs::path live(job.name);
+    fs::path dir(live.parent_path());
+    if (dir.empty()) dir = ".";
+    std::string base(live.filename().string());
+
+    std::vector<std::string> rotated;
+    std::error_code ec;
+    for (const fs::directory_entry& de : fs::directory_iterator(dir, ec))
+    {
+        std::string file(de.path().filename().string());
+        if (not is_rotated(file, base)) continue;
+#ifdef HAVE_ZLIB
+        if (job.rotation.compress and not file.ends_with(".gz") and
+            gzip_file(de.path().string()))
+            file += ".gz";
+#endif
+        rotated.push_back(file);
+    }
+
+    if (0 == job.rotation.keep or rotated.size() <= job.rotation.keep)
+        return;
+
+    // The names sort by the time of rotation, once the ".gz" is off.
+    auto stem = [](const std::string& f)
+        { return std::string_view(f).substr(0, f.size() -
+                                            (f.ends_with(".gz") ? 3 : 0)); };
+    std::sort(rotated.begin(), rotated.end(),
+              [&](const std::string& a, const std::string& b)
+              { return stem(a) < stem(b); });
+    for (size_t i = 0; i < rotated.size() - job.rotation.keep; i++)
+        fs::remove(dir / rotated[i], ec);
+}
+
+/// The background thread that deals with rotated files. There is only
+/// one, shared by all log files. It is never stopped; the Logger may
+/// still be in use while static objects are being destroyed.
+class Archiver
+{
+    concurrent_queue<ArchiveJob> _jobs;
+
+    void loop()
+    {
+        set_thread_name("opencog:logzip");
+        // On Linux, this lowers the priority of this thread only.
+        setpriority(PRIO_PROCESS, 0, 19);
+        while (true)
+        {
+            ArchiveJob job;
+            _jobs.pop(job);
+            if (job.retired) job.retired->sync_all();
+            tidy(job);
+        }
+    }
+
+public:
+    Archiver() { std::thread(&Archiver::loop, this).detach(); }
+    void push(ArchiveJob&& job) { _jobs.push(std::move(job)); }
+};
+
+void archive(const std::string& name, const LogRotation& rotation,
+             const std::shared_ptr<FileSink::Retired>& retired)
+{
+    static Archiver* archiver = new Archiver();
+    archiver->push({name, rotation, retired});
+}
+
+} // anonymous namespace
+
+// ***********************************************/
+// FileSink
+
+FileSink::FileSink(const std::string& name, const LogRotation& rotation)
+    : _name(name), _fd(-1), _failed(false),
+      _retired(std::make_shared<Retired>()),
+      _rotation(rotation), _size(0), _serial(0)
+{
+}
+
+FileSink::~FileSink()
+{
+    if (0 <= _fd) close(_fd);
+}
+
+void FileSink::write(struct iovec* iov, int iovcnt)
+{
+    if (_fd < 0)
+    {
+        // If the file can't be opened, messages are dropped; the
+        // rings must still be drained, else the producers block.
+        if (_failed) return;
+        int fd = open(_name.c_str(),
+                      O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0)
+        {
+            fprintf(stderr, "[ERROR] Unable to open log file \"%s\"\n",
+                    _name.c_str());
+            _failed = true;
+            return;
+        }
+        _fd = fd;
+
+        struct stat st;
+        _size = (0 == fstat(fd, &st)) ? st.st_size : 0;
+        _rotate_at = std::chrono::steady_clock::now() +
+                     std::chrono::seconds(_rotation.max_seconds);
+    }
+
+    for (int i = 0; i < iovcnt; i++) _size += iov[i].iov_len;
+
+    // The data is in the kernel once writev() returns, which is the
+    // same guarantee that fflush() gave, per message, before.
+    while (0 < iovcnt)
+    {
+        ssize_t rc = writev(_fd, iov, std::min(iovcnt, MAX_IOV));
+        if (rc < 0)
+        {
+            int norr = errno;
+            if (EINTR == norr) continue;
+            fprintf(stderr,
+                "[ERROR] failed write to logfile, rc=%zd errno=%d %s\n",
+                rc, norr, strerror(norr));
+            exit(1);
+        }
+
+        // Short write; skip past whatever did get written.
+        size_t done = rc;
+        while (0 < iovcnt and iov->iov_len <= done)
+        {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (0 < iovcnt)
+        {
+            iov->iov_base = (char*) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+bool FileSink::rotate_if_due()
+{
+    if (_fd < 0) return false;
+    if ((0 < _rotation.max_bytes and _rotation.max_bytes <= _size) or
+        (0 < _rotation.max_seconds and
+         _rotate_at <= std::chrono::steady_clock::now()))
+    {
+        rotate();
+        return true;
+    }
+    return false;
+}
+
+/// Move the current file out of the way, and start a new one. Only
+/// the rename happens here; the rest is up to the archiver thread.
+void FileSink::rotate()
+{
+    char stamp[32];
+    struct tm stm;
+    time_t now = time(nullptr);
+    gmtime_r(&now, &stm);
+    strftime(stamp, sizeof(stamp), ".%Y%m%d-%H%M%S", &stm);
+
+    // More than one rotation in a second gets a serial number, padded
+    // so that the names still sort in order. The serial number never
+    // goes back, even if older files were deleted in the meantime.
+    if (_last_stamp != stamp) _serial = 0;
+    _last_stamp = stamp;
+    std::string rotated(_name + stamp);
+    while (0 < _serial or 0 == access(rotated.c_str(), F_OK) or
+           0 == access((rotated + ".gz").c_str(), F_OK))
+    {
+        char serial[16];
+        snprintf(serial, sizeof(serial), "-%04u", ++_serial);
+        rotated = _name + stamp + serial;
+        if (access(rotated.c_str(), F_OK) and
+            access((rotated + ".gz").c_str(), F_OK))
+            break;
+    }
+
+    // The old file is synced (and closed) by the archiver thread, or
+    // by sync(), whichever comes first; flushing a large page cache
+    // could hold up the writer thread for a long time.
+    int fd = _fd.exchange(-1);
+    _retired->add(fd);
+    if (rename(_name.c_str(), rotated.c_str()))
+        fprintf(stderr, "[ERROR] Unable to rotate log file \"%s\": %s\n",
+                _name.c_str(), strerror(errno));
+
+    fd = open(_name.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        fprintf(stderr, "[ERROR] Unable to open log file \"%s\"\n",
+                _name.c_str());
+        _failed = true;
+        return;
+    }
+    _fd = fd;
+    _size = 0;
+    _rotate_at = std::chrono::steady_clock::now() +
+                 std::chrono::seconds(_rotation.max_seconds);
+
+    archive(_name, _rotation, _retired);
+}
+
+void FileSink::sync()
+{
+    // Messages in files rotated out since the last sync go first.
+    _retired->sync_all();
+
+    // Force a write to the disk. Don't need to update metadata, though.
+    int fd = _fd.load();
+    if (0 <= fd) fdatasync(fd);
+}
+
+// ***********************************************/
+// UringSink
+
+#ifdef HAVE_IO_URING
+
+namespace {
+
+// There is no liburing here; the three system calls are all we need.
+int uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+int uring_enter(int ring, unsigned to_submit, unsigned min_complete,
+                unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, ring, to_submit,
+                         min_complete, flags, nullptr, 0);
+}
+
+int uring_register(int ring, unsigned opcode, const void* arg,
+                   unsigned nargs)
+{
+    return (int) syscall(__NR_io_uring_register, ring, opcode, arg, nargs);
+}
+
+// The user_data of an fdatasync; that of a write is the buffer number.
+const uint64_t SYNC_TAG = 1ULL << 63;
+
+} // anonymous namespace
+
+UringSink::UringSink(const std::string& name, unsigned depth,
+                     size_t buf_size)
+    : _name(name),
+      _buf_size((std::max(buf_size, (size_t) 4096) + 4095) & ~(size_t) 4095),
+      _reaping(false), _ring(-1), _fd(-1), _failed(false), _fixed(false),
+      _offset(0), _sq_map(nullptr), _sq_len(0), _cq_map(nullptr),
+      _cq_len(0), _sqes(nullptr), _sqes_len(0), _cur(0), _busy(0),
+      _syncs_sent(0), _syncs_done(0), _sync_busy(false)
+{
+}
+
+std::shared_ptr<LogSink> UringSink::create(const std::string& name,
+                                           unsigned depth, size_t buf_size)
+{
+    std::shared_ptr<UringSink> sink(new UringSink(name, depth, buf_size));
+    if (not sink->setup(std::max(depth, 1u))) return nullptr;
+    return sink;
+}
+
+/// Set up the ring and the buffers; false if the kernel won't have it
+/// (too old, or io_uring turned off, or not allowed by seccomp).
+bool UringSink::setup(unsigned depth)
+{
+    // One entry for each buffer, and one for the fdatasync; so the
+    // submission queue can never fill up.
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    _ring = uring_setup(depth + 1, &p);
+    if (_ring < 0) return false;
+
+    _sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) _sq_len = _cq_len = std::max(_sq_len, _cq_len);
+
+    _sq_map = mmap(nullptr, _sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == _sq_map) { _sq_map = nullptr; return false; }
+    if (single)
+        _cq_map = _sq_map;
+    else
+    {
+        _cq_map = mmap(nullptr, _cq_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == _cq_map) { _cq_map = nullptr; return false; }
+    }
+    _sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, _sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES);
+    if (MAP_FAILED == sqes) return false;
+    _sqes = (io_uring_sqe*) sqes;
+
+    char* sq = (char*) _sq_map;
+    _sq_head = (unsigned*) (sq + p.sq_off.head);
+    _sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    _sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    _sq_array = (unsigned*) (sq + p.sq_off.array);
+    char* cq = (char*) _cq_map;
+    _cq_head = (unsigned*) (cq + p.cq_off.head);
+    _cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    _cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    _cqes = (io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    std::vector<struct iovec> iov(depth);
+    for (unsigned i = 0; i < depth; i++)
+    {
+        char* data = (char*) aligned_alloc(4096, _buf_size);
+        if (nullptr == data) return false;
+        _bufs.push_back(Buffer{data, 0, 0, 0, false});
+        iov[i].iov_base = data;
+        iov[i].iov_len = _buf_size;
+    }
+
+    // Registered buffers spare the kernel from mapping the pages on
+    // every write. They count against RLIMIT_MEMLOCK on older kernels;
+    // if that is too low, plain writes will do.
+    _fixed = 0 == uring_register(_ring, IORING_REGISTER_BUFFERS,
+                                 iov.data(), depth);
+    return true;
+}
+
+UringSink::~UringSink()
+{
+    // Nothing may be in flight when the buffers go away.
+    if (0 <= _fd) drain();
+
+    if (_sqes) munmap(_sqes, _sqes_len);
+    if (_cq_map and _cq_map != _sq_map) munmap(_cq_map, _cq_len);
+    if (_sq_map) munmap(_sq_map, _sq_len);
+    if (0 <= _ring) close(_ring);
+    for (Buffer& b : _bufs) free(b.data);
+    if (0 <= _fd) close(_fd);
+}
+
+// The caller holds _mtx. We are the only ones to submit, and each
+// submission goes to the kernel at once, so the entry at the tail is
+// always free.
+io_uring_sqe* UringSink::next_sqe()
+{
+    unsigned idx = *_sq_tail & *_sq_mask;
+    io_uring_sqe* sqe = &_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    _sq_array[idx] = idx;
+    return sqe;
+}
+
+void UringSink::submit()
+{
+    __atomic_store_n(_sq_tail, *_sq_tail + 1, __ATOMIC_RELEASE);
+    while (uring_enter(_ring, 1, 0, 0) < 0)
+    {
+        int norr = errno;
+        if (EINTR == norr or EAGAIN == norr or EBUSY == norr) continue;
+        fprintf(stderr, "[ERROR] failed write to logfile, errno=%d %s\n",
+                norr, strerror(norr));
+        exit(1);
+    }
+}
+
+/// Write out whatever is left of buffer `b`.
+void UringSink::send(unsigned b)
+{
+    Buffer& buf = _bufs[b];
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = _fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = _fd;
+    sqe->addr = (uint64_t) (buf.data + buf.done);
+    sqe->len = buf.used - buf.done;
+    sqe->off = buf.offset + buf.done;
+    sqe->buf_index = b;
+    sqe->user_data = b;
+    buf.busy = true;
+    submit();
+}
+
+/// fdatasync, once all of the writes before it are done.
+void UringSink::send_sync()
+{
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->fd = _fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = SYNC_TAG | ++_syncs_sent;
+    _sync_busy = true;
+    submit();
+}
+
+/// Take whatever has completed. The caller holds _mtx, and nobody
+/// else is reaping; else the reaper might wait in the kernel for a
+/// completion that was taken away from under it.
+void UringSink::reap()
+{
+    unsigned head = *_cq_head;
+    unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        const io_uring_cqe* cqe = &_cqes[head & *_cq_mask];
+        uint64_t tag = cqe->user_data;
+        int res = cqe->res;
+
+        // As with FileSink, a failed fdatasync is not an error.
+        if (tag & SYNC_TAG)
+        {
+            _syncs_done = tag & ~SYNC_TAG;
+            _sync_busy = false;
+            continue;
+        }
+
+        Buffer& buf = _bufs[tag];
+        if (-EINTR == res or -EAGAIN == res) { send(tag); continue; }
+        if (res <= 0)
+        {
+            int norr = res ? -res : ENOSPC;
+            fprintf(stderr,
+                    "[ERROR] failed write to logfile, errno=%d %s\n",
+                    norr, strerror(norr));
+            exit(1);
+        }
+
+        // Short write; send the rest.
+        buf.done += res;
+        if (buf.done < buf.used) { send(tag); continue; }
+
+        buf.used = buf.done = 0;
+        buf.busy = false;
+        _busy--;
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+}
+
+/// Wait for at least one completion, and reap it; or, if another
+/// thread is reaping already, for that thread to be done. Something
+/// must be in flight.
+void UringSink::wait_one(std::unique_lock<std::mutex>& lk)
+{
+    if (_reaping)
+    {
+        _reaped.wait(lk);
+        return;
+    }
+    _reaping = true;
+    lk.unlock();
+    uring_enter(_ring, 0, 1, IORING_ENTER_GETEVENTS);
+    lk.lock();
+    _reaping = false;
+    reap();
+    _reaped.notify_all();
+}
+
+unsigned UringSink::free_buffer(std::unique_lock<std::mutex>& lk)
+{
+    while (true)
+    {
+        for (unsigned i = 0; i < _bufs.size(); i++)
+            if (not _bufs[i].busy) return i;
+        wait_one(lk);
+    }
+}
+
+void UringSink::write(struct iovec* iov, int iovcnt)
+{
+    std::unique_lock<std::mutex> lk(_mtx);
+    if (_fd < 0)
+    {
+        if (_failed) return;
+
+        // No O_APPEND; the writes go at explicit offsets, and may
+        // complete out of order.
+        int fd = open(_name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0)
+        {
+            fprintf(stderr, "[ERROR] Unable to open log file \"%s\"\n",
+                    _name.c_str());
+            _failed = true;
+            return;
+        }
+        struct stat st;
+        _offset = (0 == fstat(fd, &st)) ? st.st_size : 0;
+        _fd = fd;
+    }
+    if (not _reaping) reap();
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char* p = (const char*) iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (0 < len)
+        {
+            Buffer& buf = _bufs[_cur];
+            size_t n = std::min(len, _buf_size - buf.used);
+            memcpy(buf.data + buf.used, p, n);
+            buf.used += n;
+            p += n;
+            len -= n;
+            if (buf.used < _buf_size) continue;
+
+            buf.offset = _offset;
+            _offset += buf.used;
+            _busy++;
+            send(_cur);
+            _cur = free_buffer(lk);
+        }
+    }
+
+    // Send off the last, partly filled buffer too; the batch is done.
+    Buffer& buf = _bufs[_cur];
+    if (0 < buf.used)
+    {
+        buf.offset = _offset;
+        _offset += buf.used;
+        _busy++;
+        send(_cur);
+        _cur = free_buffer(lk);
+    }
+}
+
+void UringSink::sync()
+{
+    std::unique_lock<std::mutex> lk(_mtx);
+    if (_fd < 0) return;
+
+    // Whatever was submitted before now is covered by the next
+    // fdatasync; that, or a later one, is what we wait for.
+    uint64_t want = _syncs_sent + 1;
+    while (_syncs_done < want)
+    {
+        if (_sync_busy)
+            wait_one(lk);
+        else
+            send_sync();
+    }
+}
+
+void UringSink::drain()
+{
+    std::unique_lock<std::mutex> lk(_mtx);
+    while (0 < _busy or _sync_busy) wait_one(lk);
+}
+
+#else // HAVE_IO_URING
+
+std::shared_ptr<LogSink> UringSink::create(const std::string&,
+                                           unsigned, size_t)
+{
+    return nullptr;
+}
+
+#endif // HAVE_IO_URING
+
+// ***********************************************/
+// MmapSink
+
+/// Marks the trailer of a segment that is still open. The zero bytes
+/// keep it from turning up at the end of a text log by accident.
+static const char SEGMENT_MAGIC[8] = { 0, 'c', 'o', 'g', 's', 'e', 'g', 0 };
+
+MmapSink::MmapSink(const std::string& name, size_t seg_size,
+                   unsigned msync_msec)
+    : _name(name), _seg_size(std::max(seg_size, (size_t) 4096)),
+      _msync_every(msync_msec),
+      _fd(-1), _segno(0), _map(nullptr), _failed(false),
+      _offset(0), _synced(0)
+{
+}
+
+MmapSink::~MmapSink()
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    close_segment();
+}
+
+std::string MmapSink::segment_name(unsigned segno) const
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), ".%06u", segno);
+    return _name + buf;
+}
+
+/// Map segment number `segno`. If `resume` is set, an existing file
+/// is appended to; otherwise the segment starts out empty. Returns
+/// false if the segment could not be set up, or is already full.
+bool MmapSink::open_segment(unsigned segno, bool resume)
+{
+    std::string fname(segment_name(segno));
+    int fd = open(fname.c_str(),
+                  O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0666);
+    if (fd < 0)
+    {
+        fprintf(stderr, "[ERROR] Unable to open log file \"%s\"\n",
+                fname.c_str());
+        _failed = true;
+        return false;
+    }
+
+    struct stat st;
+    size_t size = (0 == fstat(fd, &st)) ? st.st_size : 0;
+    size_t used = size;
+
+    // A segment that was in use during a crash is still padded out to
+    // full size, and says at its end how much of it is used. One
+    // without that, but too big to add to, is left alone.
+    Trailer tr;
+    if (TRAILER <= size and
+        TRAILER == pread(fd, &tr, TRAILER, size - TRAILER) and
+        0 == memcmp(tr.magic, SEGMENT_MAGIC, sizeof(tr.magic)) and
+        tr.used <= size - TRAILER)
+        used = tr.used;
+    if (data_size() <= used)
+    {
+        close(fd);
+        return false;
+    }
+    if (used < size and ftruncate(fd, used)) {}
+
+    // Allocate the disk blocks now, so that a full disk shows up here
+    // and not as a SIGBUS when a page is first touched.
+#ifdef __APPLE__
+    int rc = ftruncate(fd, _seg_size) ? errno : 0;
+#else
+    int rc = posix_fallocate(fd, 0, _seg_size);
+#endif
+    char* map = nullptr;
+    if (0 == rc)
+    {
+        map = (char*) mmap(nullptr, _seg_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+        if (MAP_FAILED == map) { rc = errno; map = nullptr; }
+    }
+    if (nullptr == map)
+    {
+        fprintf(stderr, "[ERROR] Unable to map log file \"%s\": %s\n",
+                fname.c_str(), strerror(rc));
+        // Undo whatever posix_fallocate() did manage to allocate.
+        if (ftruncate(fd, used)) {}
+        close(fd);
+        _failed = true;
+        return false;
+    }
+
+    _fd = fd;
+    _segno = segno;
+    _map = map;
+    memcpy(_map + data_size(), SEGMENT_MAGIC, sizeof(tr.magic));
+    set_used(used);
+    _offset.store(used, std::memory_order_relaxed);
+    _synced = used;
+    _last_sync = std::chrono::steady_clock::now();
+    return true;
+}
+
+/// Record in the trailer how much of the segment is in use. The length
+/// goes in after the data, so that it never counts bytes that are not
+/// there yet.
+void MmapSink::set_used(size_t used)
+{
+    uint64_t u = used;
+    memcpy(_map + data_size() + offsetof(Trailer, used), &u, sizeof(u));
+}
+
+/// Sync and unmap the current segment, and trim off the unused part.
+void MmapSink::close_segment()
+{
+    if (nullptr == _map) return;
+    msync_range();
+
+    size_t used = _offset.load(std::memory_order_relaxed);
+    munmap(_map, _seg_size);
+    if (ftruncate(_fd, used))
+        fprintf(stderr, "[ERROR] Unable to truncate log file \"%s\"\n",
+                segment_name(_segno).c_str());
+    close(_fd);
+    _map = nullptr;
+    _fd = -1;
+}
+
+/// msync whatever was written since the last time. Call with the
+/// lock held.
+void MmapSink::msync_range()
+{
+    if (nullptr == _map) return;
+    size_t used = _offset.load(std::memory_order_acquire);
+    if (_synced < used)
+    {
+        // msync() wants a page-aligned start address. The trailer
+        // goes after the data it counts.
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = _synced & ~(page - 1);
+        msync(_map + start, used - start, MS_SYNC);
+        size_t tail = data_size() & ~(page - 1);
+        msync(_map + tail, _seg_size - tail, MS_SYNC);
+        _synced = used;
+    }
+    _last_sync = std::chrono::steady_clock::now();
+}
+
+void MmapSink::write(struct iovec* iov, int iovcnt)
+{
+    if (nullptr == _map)
+    {
+        if (_failed) return;
+
+        // Carry on from the last segment already on disk, if any.
+        unsigned last = 0;
+        while (0 == access(segment_name(last + 1).c_str(), F_OK)) last++;
+
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (not open_segment(last, true) and
+            (_failed or not open_segment(last + 1, false)))
+            return;
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char* p = (const char*) iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (0 < len)
+        {
+            // Only the writer thread moves the offset.
+            size_t off = _offset.load(std::memory_order_relaxed);
+            size_t room = data_size() - off;
+
+            // Start a new segment, rather than split a message across
+            // two, unless it would not fit into one anyway.
+            if (0 == room or (room < len and 0 < off and len <= data_size()))
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                unsigned segno = _segno;
+                close_segment();
+                if (not open_segment(segno + 1, false)) return;
+                continue;
+            }
+
+            size_t n = std::min(room, len);
+            memcpy(_map + off, p, n);
+            set_used(off + n);
+            _offset.store(off + n, std::memory_order_release);
+            p += n;
+            len -= n;
+        }
+    }
+
+    if (0 < _msync_every.count())
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (_msync_every <= std::chrono::steady_clock::now() - _last_sync)
+            msync_range();
+    }
+}
+
+void MmapSink::sync()
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    msync_range();
+}
+
+// ***********************************************/
+// StreamSink
+
+void StreamSink::write(struct iovec* iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++)
+        fwrite(iov[i].iov_base, 1, iov[i].iov_len, _stream);
+    fflush(_stream);
+}
+
+// ***********************************************/
+// MemorySink
+
+void MemorySink::write(struct iovec* iov, int iovcnt)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        _msgs.emplace_back((const char*) iov[i].iov_base, iov[i].iov_len);
+        _bytes += iov[i].iov_len;
+    }
+    while (_max_bytes < _bytes and not _msgs.empty())
+    {
+        _bytes -= _msgs.front().size();
+        _msgs.pop_front();
+    }
+}
+
+std::string MemorySink::contents()
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    std::string out;
+    out.reserve(_bytes);
+    for (const std::string& msg : _msgs) out += msg;
+    return out;
+}
+
+// ***********************************************/
+// SocketSink
+
+SocketSink::SocketSink(const std::string& path)
+    : _path(path), _fd(-1), _stream(false)
+{
+    connect();
+}
+
+SocketSink::~SocketSink()
+{
+    disconnect();
+}
+
+bool SocketSink::connect()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (sizeof(addr.sun_path) <= _path.size()) return false;
+    memcpy(addr.sun_path, _path.c_str(), _path.size());
+
+    _retry_at = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+    // Whatever the other end is listening with.
+    for (int type : {SOCK_DGRAM, SOCK_STREAM})
+    {
+        int fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        if (0 == ::connect(fd, (struct sockaddr*) &addr, sizeof(addr)))
+        {
+            _fd = fd;
+            _stream = (SOCK_STREAM == type);
+            return true;
+        }
+        int norr = errno;
+        close(fd);
+        if (EPROTOTYPE != norr) return false;
+    }
+    return false;
+}
+
+void SocketSink::disconnect()
+{
+    if (0 <= _fd) close(_fd);
+    _fd = -1;
+}
+
+void SocketSink::write(struct iovec* iov, int iovcnt)
+{
+    if (_fd < 0 and
+        (std::chrono::steady_clock::now() < _retry_at or not connect()))
+        return;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char* p = (const char*) iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (0 < len)
+        {
+            ssize_t rc = send(_fd, p, len, MSG_NOSIGNAL |
+                              (_stream ? 0 : MSG_DONTWAIT));
+            if (rc < 0)
+            {
+                if (EINTR == errno) continue;
+
+                // A full datagram queue just costs this one message.
+                if (not _stream and (EAGAIN == errno or
+                                     EWOULDBLOCK == errno))
+                    break;
+                disconnect();
+                return;
+            }
+            p += rc;
+            len -= rc;
+        }
+    }
+}
+
+// ***********************************************/
+// FlightRecorder
+
+std::atomic<FlightRecorder*>
+FlightRecorder::_recorders[FlightRecorder::MAX_RECORDERS];
+std::atomic<bool> FlightRecorder::_catching(false);
+
+FlightRecorder::FlightRecorder(const std::string& name, size_t size)
+    : _buf(new char[std::max(size, (size_t) 1)]),
+      _size(std::max(size, (size_t) 1)), _head(0), _start(0)
+{
+    snprintf(_name, sizeof(_name), "%s.crash", name.c_str());
+    for (auto& r : _recorders)
+    {
+        FlightRecorder* none = nullptr;
+        if (r.compare_exchange_strong(none, this)) break;
+    }
+}
+
+FlightRecorder::~FlightRecorder()
+{
+    for (auto& r : _recorders)
+    {
+        FlightRecorder* self = this;
+        if (r.compare_exchange_strong(self, nullptr)) break;
+    }
+    delete[] _buf;
+}
+
+void FlightRecorder::write(struct iovec* iov, int iovcnt)
+{
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        // Only the tail end of an oversized message fits.
+        const char* p = (const char*) iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        if (_size < len)
+        {
+            head += len - _size;
+            p += len - _size;
+            len = _size;
+        }
+        size_t pos = head % _size;
+        size_t n = std::min(len, _size - pos);
+        memcpy(_buf + pos, p, n);
+        memcpy(_buf, p + n, len - n);
+        head += len;
+    }
+    _head.store(head, std::memory_order_release);
+}
+
+int FlightRecorder::pieces(struct iovec* iov)
+{
+    uint64_t head = _head.load(std::memory_order_acquire);
+    uint64_t from = _start.load(std::memory_order_relaxed);
+    if (from + _size < head)
+    {
+        // The oldest message has been partly overwritten.
+        from = head - _size;
+        while (from < head and '\n' != _buf[from % _size]) from++;
+        from++;
+    }
+    if (head <= from) return 0;
+
+    size_t pos = from % _size;
+    size_t len = head - from;
+    size_t n = std::min(len, _size - pos);
+    iov[0] = {_buf + pos, n};
+    iov[1] = {_buf, len - n};
+    return (len == n) ? 1 : 2;
+}
+
+void FlightRecorder::dump(std::string& out)
+{
+    struct iovec iov[2];
+    int n = pieces(iov);
+    if (0 == n) return;
+
+    out += "--- Flight recorder: messages that were not logged ---\n";
+    for (int i = 0; i < n; i++)
+        out.append((const char*) iov[i].iov_base, iov[i].iov_len);
+    out += "--- End of flight recorder ---\n";
+    _start.store(_head.load(std::memory_order_relaxed),
+                 std::memory_order_relaxed);
+}
+
+// The signals that end the program, and what was there before us.
+static const int fatal_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static struct sigaction prev_actions[sizeof(fatal_signals) / sizeof(int)];
+
+/// Only async-signal-safe calls from here on.
+void FlightRecorder::on_signal(int sig)
+{
+    static const char head[] =
+        "--- Fatal signal; flight recorder: messages that were not logged ---\n";
+    static const char tail[] = "--- End of flight recorder ---\n";
+
+    for (auto& r : _recorders)
+    {
+        FlightRecorder* fr = r.load();
+        if (nullptr == fr) continue;
+
+        struct iovec iov[4];
+        int n = fr->pieces(iov + 1);
+        if (0 == n) continue;
+        iov[0] = {(void*) head, sizeof(head) - 1};
+        iov[n + 1] = {(void*) tail, sizeof(tail) - 1};
+
+        int fd = open(fr->_name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                      0666);
+        if (fd < 0) continue;
+        if (0 < ::writev(fd, iov, n + 2)) fdatasync(fd);
+        close(fd);
+    }
+
+    // Let whoever was there before handle it; usually that means
+    // the default action, i.e. a core dump.
+    for (size_t i = 0; i < sizeof(fatal_signals) / sizeof(int); i++)
+        if (fatal_signals[i] == sig)
+            sigaction(sig, &prev_actions[i], nullptr);
+    raise(sig);
+}
+
+void FlightRecorder::catch_signals()
+{
+    static std::once_flag once;
+    std::call_once(once, []() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &FlightRecorder::on_signal;
+        sa.sa_flags = SA_ONSTACK;
+        sigemptyset(&sa.sa_mask);
+        for (size_t i = 0; i < sizeof(fatal_signals) / sizeof(int); i++)
+            sigaction(fatal_signals[i], &sa, &prev_actions[i]);
+        _catching.store(true, std::memory_order_relaxed);
+    });
+    alt_stack();
+}
+
+namespace {
+
+/// The signal stack that alt_stack() set up for this thread, if any.
+struct AltStack
+{
+    void* base = nullptr;
+    size_t size = 0;
+    ~AltStack();
+};
+
+AltStack::~AltStack()
+{
+    if (nullptr == base) return;
+    stack_t ss;
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_flags = SS_DISABLE;
+    sigaltstack(&ss, nullptr);
+    munmap(base, size);
+}
+
+thread_local AltStack t_alt_stack;
+
+}  // anonymous namespace
+
+void FlightRecorder::alt_stack()
+{
+    if (t_alt_stack.base) return;
+
+    // Someone else's is as good as ours.
+    stack_t old;
+    if (sigaltstack(nullptr, &old) or not (old.ss_flags & SS_DISABLE))
+        return;
+
+    // SIGSTKSZ is not a constant in newer glibc.
+    size_t size = std::max<size_t>(1 << 16, SIGSTKSZ);
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (MAP_FAILED == base) return;
+
+    stack_t ss;
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_sp = base;
+    ss.ss_size = size;
+    if (sigaltstack(&ss, nullptr))
+    {
+        munmap(base, size);
+        return;
+    }
+    t_alt_stack.base = base;
+    t_alt_stack.size = size;
+}
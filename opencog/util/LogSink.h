@@ -0,0 +1,407 @@
+/*
+ * opencog/util/LogSink.h
+ *
+ * Copyright (C) 2008, 2010 OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _OPENCOG_LOG_SINK_H
+#define _OPENCOG_LOG_SINK_H
+
+// Private to the Logger implementation; this header is not installed.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace opencog
+{
+/** \addtogroup grp_cogutil
+ *  @{
+ */
+
+//! Where a LogWriter puts the messages.
+///
+/// write() is called only by the writer thread. sync() may be called
+/// from any thread, at the same time as write().
+class LogSink
+{
+public:
+    virtual ~LogSink() {}
+
+    /// Write out all of the iovecs, in order. Each iovec holds one
+    /// or more whole messages, except for the file sink in binary
+    /// mode, which gets the frames in pieces.
+    virtual void write(struct iovec*, int iovcnt) = 0;
+
+    /// Push everything written so far out to the disk.
+    virtual void sync() = 0;
+
+    /// Wait until everything written so far has reached the kernel.
+    /// Only a sink that writes asynchronously has anything to do.
+    virtual void drain() {}
+
+    /// Start a new file, if it is time to. Called by the writer thread
+    /// before it puts each batch together, so that a binary log can
+    /// begin the new file with its header. True if a new file was
+    /// started.
+    virtual bool rotate_if_due() { return false; }
+
+    /// True once the file has been opened.
+    virtual bool is_open() const = 0;
+};
+
+//! When to rotate a log file, and what to do with the old ones.
+struct LogRotation
+{
+    size_t max_bytes = 0;      // rotate once the file is this big
+    unsigned max_seconds = 0;  // rotate once the file is this old
+    unsigned keep = 0;         // rotated files to keep; zero keeps all
+    bool compress = true;      // gzip rotated files
+
+    bool enabled() const { return 0 < max_bytes or 0 < max_seconds; }
+};
+
+//! Plain append-only file, written with writev().
+///
+/// The file is opened on the first write, and not before; this allows
+/// us to set the main logger's filename without creating a useless
+/// log file with the default filename.
+///
+/// When rotation is enabled, the file is renamed out of the way once
+/// it gets too big or too old, with the time of the rotation appended
+/// to its name (`opencog.log.20240131-235959`), and a new file is
+/// started. Syncing the old file to disk, compressing rotated files
+/// and deleting old ones are left to a background thread; the writer
+/// thread only renames and reopens.
+class FileSink : public LogSink
+{
+    std::string _name;
+    std::atomic<int> _fd;
+    bool _failed;
+
+public:
+    // Files rotated out but not yet synced; shared with the archiver
+    // thread. Defined in LogSink.cc.
+    struct Retired;
+
+private:
+    std::shared_ptr<Retired> _retired;
+
+    // Rotation state; used only by the writer thread.
+    const LogRotation _rotation;
+    size_t _size;
+    std::chrono::steady_clock::time_point _rotate_at;
+    std::string _last_stamp;
+    unsigned _serial;
+
+    void rotate();
+
+public:
+    FileSink(const std::string& name, const LogRotation& = LogRotation());
+    ~FileSink();
+
+    void write(struct iovec*, int) override;
+    void sync() override;
+    bool rotate_if_due() override;
+    bool is_open() const override { return 0 <= _fd.load(); }
+};
+
+//! Plain append-only file, written through io_uring.
+///
+/// write() copies the messages into one of `depth` buffers, which are
+/// registered with the kernel up front, submits it, and returns at
+/// once; the writer thread goes on to the next batch while the kernel
+/// writes this one. It waits only when all of the buffers are in
+/// flight. sync() submits an fdatasync, ordered after all of the
+/// writes before it, and waits for that alone; the writer thread need
+/// not stop for it. Whoever is waiting reaps the completions for
+/// everyone, one thread at a time.
+///
+/// The writes go at explicit offsets, starting at the end of the file
+/// as it was when opened; so, unlike FileSink, this does not mix well
+/// with other processes appending to the same file.
+class UringSink : public LogSink
+{
+    std::string _name;
+    const size_t _buf_size;
+
+    std::mutex _mtx;
+    std::condition_variable _reaped;
+    bool _reaping;
+
+    int _ring;
+    std::atomic<int> _fd;
+    bool _failed;
+    bool _fixed;        // the buffers are registered
+    uint64_t _offset;   // where the next write goes
+
+    // The mapped submission and completion queues.
+    void* _sq_map;
+    size_t _sq_len;
+    void* _cq_map;
+    size_t _cq_len;
+    io_uring_sqe* _sqes;
+    size_t _sqes_len;
+    unsigned *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+    unsigned *_cq_head, *_cq_tail, *_cq_mask;
+    io_uring_cqe* _cqes;
+
+    struct Buffer
+    {
+        char* data;
+        size_t used;
+        size_t done;      // written so far, after a short write
+        uint64_t offset;
+        bool busy;
+    };
+    std::vector<Buffer> _bufs;
+    unsigned _cur;       // the one being filled
+    unsigned _busy;      // in flight
+
+    // fdatasync requests, numbered; at most one is in flight.
+    uint64_t _syncs_sent;
+    uint64_t _syncs_done;
+    bool _sync_busy;
+
+    UringSink(const std::string& name, unsigned depth, size_t buf_size);
+    bool setup(unsigned depth);
+    io_uring_sqe* next_sqe();
+    void submit();
+    void send(unsigned b);
+    void send_sync();
+    void reap();
+    void wait_one(std::unique_lock<std::mutex>&);
+    unsigned free_buffer(std::unique_lock<std::mutex>&);
+
+public:
+    /// Up to `depth` buffers of `buf_size` bytes in flight. Returns
+    /// null if io_uring is not available, so that the caller can
+    /// fall back to a FileSink.
+    static std::shared_ptr<LogSink> create(const std::string& name,
+                                           unsigned depth, size_t buf_size);
+    ~UringSink();
+
+    void write(struct iovec*, int) override;
+    void sync() override;
+    void drain() override;
+    bool is_open() const override { return 0 <= _fd.load(); }
+};
+
+//! Memory-mapped, preallocated segment files.
+///
+/// The log is written into fixed-size segments, `name.000000`,
+/// `name.000001` and so on, which are allocated on disk up front and
+/// mapped into memory; appending a message is then a memcpy, with no
+/// system call at all. Once a segment fills up, it is truncated to its
+/// used length and the next one is started. The segments, taken in
+/// order, make up the log; `cat name.* > name` puts it back together.
+///
+/// The mapped pages belong to the kernel, so whatever was copied in
+/// survives a crash of the process, even if it was never synced. The
+/// current segment stays at its full size, padded with zero bytes,
+/// until the sink is closed; that is also how it is left by a crash,
+/// or by an exit without closing. Its last few bytes hold the length
+/// written so far, and when the log is re-opened, writing resumes
+/// there. (The log itself may well contain zero bytes, as binary logs
+/// do, so the padding cannot tell where it ends.)
+class MmapSink : public LogSink
+{
+    std::string _name;
+    const size_t _seg_size;
+    const std::chrono::milliseconds _msync_every;
+
+    // Taken by the writer to switch segments, and by sync().
+    std::mutex _mtx;
+    int _fd;
+    unsigned _segno;
+    char* _map;
+    bool _failed;
+
+    // Bytes used in the current segment, and bytes msync'ed.
+    std::atomic<size_t> _offset;
+    size_t _synced;
+    std::chrono::steady_clock::time_point _last_sync;
+
+    // At the very end of an open segment: the bytes used so far.
+    struct Trailer
+    {
+        char magic[8];
+        uint64_t used;
+    };
+    static constexpr size_t TRAILER = sizeof(Trailer);
+    size_t data_size() const { return _seg_size - TRAILER; }
+    void set_used(size_t);
+
+    std::string segment_name(unsigned) const;
+    bool open_segment(unsigned segno, bool resume);
+    void close_segment();
+    void msync_range();
+
+public:
+    /// Segments of `seg_size` bytes; msync every `msync_msec`
+    /// milliseconds, or never, if that is zero.
+    MmapSink(const std::string& name, size_t seg_size, unsigned msync_msec);
+    ~MmapSink();
+
+    void write(struct iovec*, int) override;
+    void sync() override;
+    bool is_open() const override { return nullptr != _map; }
+};
+
+//! Standard output, or standard error.
+///
+/// This goes through stdio, so that the messages are ordered with
+/// whatever else the program prints with printf() or std::cout.
+class StreamSink : public LogSink
+{
+    FILE* _stream;
+
+public:
+    StreamSink(FILE* stream) : _stream(stream) {}
+
+    void write(struct iovec*, int) override;
+    void sync() override { fflush(_stream); }
+    bool is_open() const override { return true; }
+};
+
+//! The most recent messages, kept in memory.
+///
+/// Once the messages add up to more than `max_bytes`, the oldest ones
+/// are discarded. The contents can be read at any time, from any
+/// thread.
+class MemorySink : public LogSink
+{
+    const size_t _max_bytes;
+
+    std::mutex _mtx;
+    std::deque<std::string> _msgs;
+    size_t _bytes;
+
+public:
+    MemorySink(size_t max_bytes) : _max_bytes(max_bytes), _bytes(0) {}
+
+    void write(struct iovec*, int) override;
+    void sync() override {}
+    bool is_open() const override { return true; }
+
+    /// All of the messages held, oldest first.
+    std::string contents();
+};
+
+//! Unix-domain socket, such as that of a log collector.
+///
+/// A datagram socket gets one datagram per message; with a stream
+/// socket, the messages are simply written one after another. If
+/// the other end goes away, messages are dropped, and the sink tries
+/// to reconnect, at most once a second. Sends never block on a
+/// datagram socket, so that a stalled collector can't hold up the
+/// log file.
+class SocketSink : public LogSink
+{
+    std::string _path;
+    int _fd;
+    bool _stream;
+    std::chrono::steady_clock::time_point _retry_at;
+
+    bool connect();
+    void disconnect();
+
+public:
+    SocketSink(const std::string& path);
+    ~SocketSink();
+
+    void write(struct iovec*, int) override;
+    void sync() override {}
+    bool is_open() const override { return 0 <= _fd; }
+};
+
+//! Flight recorder: the messages that were not logged, in memory.
+///
+/// Messages above the log level are kept here, instead of being thrown
+/// away, in a fixed-size circular buffer; the oldest are overwritten.
+/// When something goes wrong, the buffer is dumped into the log file,
+/// which gives the details leading up to it. On a crash, the log file
+/// cannot be trusted to take more (it may be binary, or mapped, and
+/// the writer may be stuck halfway through a record), so the dump goes
+/// to a file of its own, `<name>.crash`, instead. The buffer is
+/// allocated up front, and that dump does nothing but write(2), so
+/// that it can be done from a signal handler.
+class FlightRecorder : public LogSink
+{
+    char* _buf;
+    const size_t _size;
+    char _name[4096];
+
+    // Bytes written so far, and where the current contents start.
+    std::atomic<uint64_t> _head;
+    std::atomic<uint64_t> _start;
+
+    // Registered recorders, for the signal handler.
+    static constexpr unsigned MAX_RECORDERS = 8;
+    static std::atomic<FlightRecorder*> _recorders[MAX_RECORDERS];
+    static std::atomic<bool> _catching;
+    static void on_signal(int);
+
+    /// The current contents, in at most two pieces; messages cut off
+    /// by the wrap-around are skipped.
+    int pieces(struct iovec*);
+
+public:
+    /// Keep up to `size` bytes of messages; on a fatal signal, dump
+    /// them to the file `name` + ".crash".
+    FlightRecorder(const std::string& name, size_t size);
+    ~FlightRecorder();
+
+    void write(struct iovec*, int) override;
+    void sync() override {}
+    bool is_open() const override { return true; }
+    size_t size() const { return _size; }
+
+    /// Append the contents, with a header line, to `out`, and start
+    /// over. Nothing is appended if the recorder is empty.
+    void dump(std::string& out);
+
+    /// Catch fatal signals (SIGSEGV and the like), and dump all
+    /// recorders before passing them on.
+    static void catch_signals();
+    static bool catching()
+    { return _catching.load(std::memory_order_relaxed); }
+
+    /// Give the calling thread a stack to take signals on, unless it
+    /// has one already; a thread that overflows its own stack can not
+    /// run the handler on it. Freed when the thread exits.
+    static void alt_stack();
+};
+
+/** @}*/
+}  // namespace opencog
+
+#endif // _OPENCOG_LOG_SINK_H
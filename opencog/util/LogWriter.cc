@@ -0,0 +1,1546 @@
+/*
+ * opencog/util/LogWriter.cc
+ *
+ * Copyright (C) 2002-2007 Novamente LLC
+ * Copyright (C) 2008, 2010 OpenCog Foundation
+ * Copyright (C) 2009, 2011, 2013 Linas Vepstas
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#if defined(HAVE_GNU_BACKTRACE)
+#include <cxxabi.h>
+#include <limits.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <opencog/util/backtrace-symbols.h>
+#include <opencog/util/platform.h>
+
+#include "LogBinary.h"
+#include "LogWriter.h"
+
+using namespace opencog;
+
+// ***********************************************/
+// LogRing
+
+// Round up to a power of two, and to at least the minimum.
+static size_t ring_capacity(size_t capacity)
+{
+    size_t cap = LogRing::MIN_CAPACITY;
+    while (cap < capacity) cap <<= 1;
+    return cap;
+}
+
+LogRing::LogRing(size_t capacity)
+    : shared(false), dropped(0), msgs_in(0), msgs_out(0), bytes_in(0),
+      full_waits(0), full_wait_nsec(0),
+      _capacity(ring_capacity(capacity)), _mask(_capacity - 1),
+      _buf(new char[_capacity]),
+      _tail(0), _last_seq(0), _cached_head(0), _rec_pos(0),
+      _spill_limit(0), _drop_oldest(false),
+      _nspill(0), _spill_bytes(0), _ndead(0),
+      _head(0), _read(0), _cached_tail(0),
+      _orphaned(false)
+{
+}
+
+LogRing::~LogRing()
+{
+    // Oversized messages live on the heap; don't leak any that
+    // were never written out.
+    LogRecord* rec;
+    while ((rec = peek()))
+    {
+        if (LogRecord::HEAP == rec->kind)
+            delete *reinterpret_cast<std::string**>(rec->payload());
+        consume(rec);
+    }
+    for (Spilled& sp : _spill)
+        if (sp.buf and LogRecord::HEAP == sp.rec()->kind)
+            delete *reinterpret_cast<std::string**>(sp.rec()->payload());
+    delete[] _buf;
+}
+
+/// True if there are `need` free bytes starting at `pos`.
+bool LogRing::has_room(size_t pos, size_t need)
+{
+    if (pos + need - _cached_head <= _capacity) return true;
+    _cached_head = _head.load(std::memory_order_acquire);
+    return pos + need - _cached_head <= _capacity;
+}
+
+/// Reserve space for a record with a payload of `len` bytes, and
+/// return a pointer to the payload. Blocks if the ring is full.
+/// The record does not become visible until commit() is called.
+char* LogRing::reserve(size_t len)
+{
+    char* payload = try_reserve(len);
+    if (payload) return payload;
+
+    auto start = std::chrono::steady_clock::now();
+    do _head.wait(_cached_head, std::memory_order_acquire);
+    while (nullptr == (payload = try_reserve(len)));
+    bump(full_waits, 1);
+    bump(full_wait_nsec, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start).count());
+    return payload;
+}
+
+/// Like reserve(), but return null if the ring is full.
+char* LogRing::try_reserve(size_t len)
+{
+    size_t need = record_size(len);
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    size_t room = _capacity - (pos & _mask);
+
+    // Records never wrap around the end of the buffer; if this one
+    // doesn't fit, the rest of the buffer is skipped.
+    size_t skip = (need <= room) ? 0 : room;
+    if (not has_room(pos, skip + need)) return nullptr;
+
+    // A skipped tail that is large enough to hold a header gets a
+    // PAD record; the consumer skips smaller remnants on its own.
+    if (skip and sizeof(LogRecord) <= skip)
+    {
+        LogRecord* pad = reinterpret_cast<LogRecord*>(_buf + (pos & _mask));
+        pad->kind = LogRecord::PAD;
+        pad->size = skip;
+        pad->len = 0;
+    }
+
+    _rec_pos = pos + skip;
+    return reinterpret_cast<LogRecord*>(_buf + (_rec_pos & _mask))->payload();
+}
+
+/// Publish the record previously obtained with reserve().
+void LogRing::commit(uint64_t seq, LogRecord::Kind kind,
+                     uint8_t level, size_t len, uint8_t flags)
+{
+    LogRecord* rec = reinterpret_cast<LogRecord*>(_buf + (_rec_pos & _mask));
+    rec->seq = seq;
+    rec->size = record_size(len);
+    rec->len = len;
+    rec->kind = kind;
+    rec->level = level;
+    rec->flags = flags;
+    _tail.store(_rec_pos + rec->size, std::memory_order_release);
+}
+
+/// Return the oldest unread record, or null if there is none.
+LogRecord* LogRing::peek()
+{
+    while (true)
+    {
+        if (_read == _cached_tail)
+        {
+            _cached_tail = _tail.load(std::memory_order_acquire);
+            if (_read == _cached_tail) return nullptr;
+        }
+
+        size_t room = _capacity - (_read & _mask);
+        if (room < sizeof(LogRecord))
+        {
+            _read += room;
+            continue;
+        }
+
+        LogRecord* rec = reinterpret_cast<LogRecord*>(_buf + (_read & _mask));
+        if (LogRecord::PAD == rec->kind)
+        {
+            _read += rec->size;
+            continue;
+        }
+        return rec;
+    }
+}
+
+/// Move past the record returned by peek(). The space is not
+/// handed back to the producer until release() is called.
+void LogRing::consume(const LogRecord* rec)
+{
+    _read += rec->size;
+}
+
+void LogRing::release()
+{
+    _head.store(_read, std::memory_order_release);
+    _head.notify_all();
+}
+
+/// Reserve space for a record on the spill list. The record does not
+/// become visible until spill_commit() is called.
+char* LogRing::spill_reserve(size_t len, size_t limit, bool drop_oldest)
+{
+    size_t bytes = sizeof(LogRecord) + len;
+
+    // Unless old records can be dropped, wait for the writer to make
+    // room. A record that is too big to ever fit has to wait only
+    // for the list to empty.
+    size_t cur = _spill_bytes.load(std::memory_order_acquire);
+    if (not drop_oldest and 0 < cur and limit < cur + bytes)
+    {
+        auto start = std::chrono::steady_clock::now();
+        while (0 < cur and limit < cur + bytes)
+        {
+            _spill_bytes.wait(cur, std::memory_order_acquire);
+            cur = _spill_bytes.load(std::memory_order_acquire);
+        }
+        bump(full_waits, 1);
+        bump(full_wait_nsec,
+             std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now() - start).count());
+    }
+
+    _spill_rec.reset(new uint64_t[(bytes + 7) / 8]);
+    _spill_limit = limit;
+    _drop_oldest = drop_oldest;
+    return reinterpret_cast<LogRecord*>(_spill_rec.get())->payload();
+}
+
+void LogRing::spill_commit(uint64_t seq, LogRecord::Kind kind,
+                           uint8_t level, size_t len, uint8_t flags)
+{
+    LogRecord* rec = reinterpret_cast<LogRecord*>(_spill_rec.get());
+    rec->seq = seq;
+    rec->size = sizeof(LogRecord) + len;
+    rec->len = len;
+    rec->kind = kind;
+    rec->level = level;
+    rec->flags = flags;
+
+    std::lock_guard<std::mutex> lock(_spill_mtx);
+    _spill.push_back({seq, std::move(_spill_rec), rec->size});
+    size_t total = _spill_bytes.load(std::memory_order_relaxed) + rec->size;
+
+    // The dropped records stay on the list, with no buffer, so that
+    // the writer still sees their sequence numbers go by. They are
+    // always the oldest ones, so they form a prefix of the list.
+    while (_drop_oldest and _spill_limit < total and
+           _ndead + 1 < _spill.size())
+    {
+        Spilled& sp = _spill[_ndead++];
+        if (LogRecord::HEAP == sp.rec()->kind)
+            delete *reinterpret_cast<std::string**>(sp.rec()->payload());
+        sp.buf.reset();
+        total -= sp.bytes;
+        sp.bytes = 0;
+    }
+
+    _spill_bytes.store(total, std::memory_order_release);
+    _nspill.fetch_add(1, std::memory_order_release);
+}
+
+/// Sequence number of the oldest spilled record, if there is one.
+bool LogRing::spill_front(uint64_t& seq)
+{
+    std::lock_guard<std::mutex> lock(_spill_mtx);
+    if (_spill.empty()) return false;
+    seq = _spill.front().seq;
+    return true;
+}
+
+LogRing::Spilled LogRing::spill_pop()
+{
+    std::lock_guard<std::mutex> lock(_spill_mtx);
+    Spilled sp(std::move(_spill.front()));
+    _spill.pop_front();
+    if (nullptr == sp.buf) _ndead--;
+    _nspill.fetch_sub(1, std::memory_order_release);
+    _spill_bytes.fetch_sub(sp.bytes, std::memory_order_release);
+    _spill_bytes.notify_all();
+    return sp;
+}
+
+// ***********************************************/
+// Per-thread ring cache
+
+namespace {
+
+/// The rings that the current thread writes into, one per LogWriter.
+/// The writer id is used as the key, rather than the pointer, so that
+/// a stale entry can never be confused with a new writer.
+struct ThreadRings
+{
+    static constexpr unsigned NSLOTS = 8;
+    struct Slot
+    {
+        uint64_t id = 0;
+        std::shared_ptr<LogRing> ring;
+    };
+    Slot slots[NSLOTS];
+    unsigned victim = 0;
+
+    ~ThreadRings();
+};
+
+thread_local ThreadRings t_rings;
+
+/// Set once t_rings is destroyed. Trivially destructible, so that it
+/// can still be looked at after that, until the thread is gone.
+thread_local bool t_rings_dead = false;
+
+ThreadRings::~ThreadRings()
+{
+    for (Slot& s : slots)
+        if (s.ring) s.ring->orphan();
+    t_rings_dead = true;
+}
+std::atomic<uint64_t> writer_ids(1);
+
+/// Threads are dealt out to the lanes round-robin, in the order in
+/// which they first log to a writer that has lanes.
+std::atomic<unsigned> next_lane(0);
+thread_local unsigned t_lane = UINT_MAX;
+
+void accumulate(Logger::Stats& st, const Logger::Stats& ls)
+{
+    st.msgs_enqueued += ls.msgs_enqueued;
+    st.bytes_enqueued += ls.bytes_enqueued;
+    st.msgs_written += ls.msgs_written;
+    st.bytes_written += ls.bytes_written;
+    st.queue_depth += ls.queue_depth;
+    st.max_queue_depth = std::max(st.max_queue_depth, ls.max_queue_depth);
+    st.queue_full_waits += ls.queue_full_waits;
+    st.syncs += ls.syncs;
+    st.wait_usec += ls.wait_usec;
+    st.writes += ls.writes;
+    st.write_usec += ls.write_usec;
+    st.max_write_usec = std::max(st.max_write_usec, ls.max_write_usec);
+}
+
+} // anonymous namespace
+
+LogRing* Logger::LogWriter::get_ring()
+{
+    // Too late for a ring of our own; queue behind the other latecomers.
+    // The lock is let go by publish(), or by reserve() if it gives up.
+    if (t_rings_dead)
+    {
+        _shared_mtx.lock();
+        if (nullptr == _shared_ring)
+        {
+            _shared_ring = std::make_shared<LogRing>(LogRing::MIN_CAPACITY);
+            _shared_ring->shared = true;
+            std::lock_guard<std::mutex> lock(_rings_mtx);
+            _rings.push_back(_shared_ring);
+            _rings_gen.fetch_add(1, std::memory_order_release);
+        }
+        return _shared_ring.get();
+    }
+
+    size_t capacity = _capacity.load(std::memory_order_relaxed);
+    ThreadRings::Slot* slot = nullptr;
+    for (ThreadRings::Slot& s : t_rings.slots)
+    {
+        if (s.id != _id) continue;
+        if (s.ring->capacity() == capacity) return s.ring.get();
+
+        // The capacity was changed; start over with a new ring. The
+        // old one is drained and then discarded by the writer.
+        s.ring->orphan();
+        slot = &s;
+        break;
+    }
+
+    // First message from this thread. This is the only place where
+    // a producer allocates or takes a lock.
+    std::shared_ptr<LogRing> ring(std::make_shared<LogRing>(capacity));
+    if (FlightRecorder::catching()) FlightRecorder::alt_stack();
+    {
+        std::lock_guard<std::mutex> lock(_rings_mtx);
+        _rings.push_back(ring);
+        _rings_gen.fetch_add(1, std::memory_order_release);
+    }
+
+    // More writers than slots is unusual; evict round-robin. The
+    // evicted ring is drained and then discarded by its writer.
+    if (nullptr == slot)
+    {
+        slot = &t_rings.slots[t_rings.victim];
+        t_rings.victim = (t_rings.victim + 1) % ThreadRings::NSLOTS;
+        if (slot->ring) slot->ring->orphan();
+    }
+    slot->id = _id;
+    slot->ring = ring;
+    return ring.get();
+}
+
+// ***********************************************/
+// LogWriter
+
+// IOV_MAX is 1024 on Linux.
+#define MAX_BATCH 1024
+
+Logger::LogWriter::LogWriter(void)
+    : _file_level(FINE), _echo(stdout), _main(nullptr),
+      _mmap_seg_size(0), _mmap_msync_msec(0),
+      _uring_depth(0), _uring_buf_size(0),
+      _id(writer_ids.fetch_add(1)), _rings_gen(0),
+      _retired_msgs(0), _retired_bytes(0),
+      _retired_waits(0), _retired_wait_nsec(0),
+      _msgs_written(0), _bytes_written(0), _max_depth(0),
+      _writes(0), _write_nsec(0), _max_write_nsec(0),
+      _syncs(0), _sync_nsec(0), _stats_secs(0),
+      _sleeping(false), _wakeups(0),
+      _durability(SYNC_BATCH), _group_msec(10), _group_bytes(1 << 20),
+      _backpressure(QUEUE_BLOCK), _capacity(ring_capacity(0)),
+      _batch_max(MAX_BATCH), _batch_wait_usec(0),
+      _binary(false), _bin_session(false),
+      _nlanes(1), _lanes_made(0)
+{
+    writingLoopActive = false;
+}
+
+Logger::LogWriter::~LogWriter()
+{
+    // Remove the logfile from the list.
+    {
+        std::lock_guard<std::mutex> lock(_loggers_mtx);
+        auto it = _loggers.find(fileName);
+        if (_loggers.end() != it and this == it->second)
+            _loggers.erase(it);
+    }
+
+    // Wait for the rings to empty. Even with nothing to write to (a
+    // lane that was never used, or a file that failed to open), the
+    // writer thread must still be stopped; a joinable std::thread
+    // left behind would terminate the program.
+    if (_sink and _sink->is_open()) flush();
+    stop_write_loop();
+}
+
+void Logger::LogWriter::start_write_loop()
+{
+    std::unique_lock<std::mutex> lock(the_mutex);
+    if (!writingLoopActive)
+    {
+        writingLoopActive = true;
+        writer_thread = std::thread(&Logger::LogWriter::writing_loop, this);
+    }
+}
+
+void Logger::LogWriter::stop_write_loop()
+{
+    std::unique_lock<std::mutex> lock(the_mutex);
+    if (!writingLoopActive) return;
+    lock.unlock();
+
+    // The stop request travels through the rings like any other
+    // message, so everything queued before it gets written first.
+    LogRing* ring = get_ring();
+    ring->reserve(0);
+    publish(ring, LogRecord::STOP, NONE, 0);
+
+    writer_thread.join();
+}
+
+void Logger::LogWriter::set_batch(size_t max_msgs, unsigned max_wait_usec)
+{
+    if (0 == max_msgs) max_msgs = 1;
+    if (MAX_BATCH < max_msgs) max_msgs = MAX_BATCH;
+    _batch_max.store(max_msgs, std::memory_order_relaxed);
+    _batch_wait_usec.store(max_wait_usec, std::memory_order_relaxed);
+    each_lane([=](LogWriter& lw) { lw.set_batch(max_msgs, max_wait_usec); });
+}
+
+void Logger::LogWriter::set_durability(Durability d, unsigned group_msec,
+                                       size_t group_bytes)
+{
+    _group_msec.store(group_msec, std::memory_order_relaxed);
+    _group_bytes.store(group_bytes, std::memory_order_relaxed);
+    _durability.store(d, std::memory_order_release);
+    each_lane([=](LogWriter& lw)
+        { lw.set_durability(d, group_msec, group_bytes); });
+}
+
+void Logger::LogWriter::set_backpressure(Backpressure bp, size_t capacity)
+{
+    _capacity.store(ring_capacity(capacity), std::memory_order_relaxed);
+    _backpressure.store(bp, std::memory_order_relaxed);
+    each_lane([=](LogWriter& lw) { lw.set_backpressure(bp, capacity); });
+}
+
+uint64_t Logger::LogWriter::publish(LogRing* ring, LogRecord::Kind kind,
+                                    Level level, size_t len, uint8_t flags)
+{
+    uint64_t seq = ring->next_seq();
+    if (LogRecord::TEXT == kind or LogRecord::DEFERRED == kind or
+        LogRecord::BINARY == kind)
+    {
+        LogRing::bump(ring->msgs_in, 1);
+        LogRing::bump(ring->bytes_in, len);
+    }
+    if (ring->spill_pending())
+        ring->spill_commit(seq, kind, level, len, flags);
+    else
+        ring->commit(seq, kind, level, len, flags);
+    if (ring->shared) _shared_mtx.unlock();
+
+    // Either the writer thread sees this record before it goes to
+    // sleep, or this sees that it is asleep; see sleep_writer().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sleeping.load(std::memory_order_relaxed)) wake_writer();
+    return seq;
+}
+
+void Logger::LogWriter::wake_writer()
+{
+    _sleeping.store(false, std::memory_order_relaxed);
+    _wakeups.fetch_add(1, std::memory_order_release);
+    _wakeups.notify_one();
+}
+
+/// Wait for a producer to publish something, unless one already has.
+void Logger::LogWriter::sleep_writer(
+                       std::vector<std::shared_ptr<LogRing>>& rings,
+                       size_t& gen)
+{
+    uint32_t wakeups = _wakeups.load(std::memory_order_acquire);
+    _sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (not pending(rings, gen))
+        _wakeups.wait(wakeups, std::memory_order_acquire);
+    _sleeping.store(false, std::memory_order_relaxed);
+}
+
+uint64_t Logger::LogWriter::qmsg(Level level, const std::string_view* parts,
+                                 size_t nparts, bool wait, uint8_t flags)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < nparts; i++) len += parts[i].size();
+
+    LogRing* ring;
+
+    if (LogRing::MAX_INLINE < len)
+    {
+        char* buf = reserve(ring, sizeof(std::string*), wait);
+        if (nullptr == buf) return UINT64_MAX;
+
+        std::string* str = new std::string();
+        str->reserve(len);
+        for (size_t i = 0; i < nparts; i++) str->append(parts[i]);
+        memcpy(buf, &str, sizeof(str));
+        LogRing::bump(ring->msgs_in, 1);
+        LogRing::bump(ring->bytes_in, len);
+        return publish(ring, LogRecord::HEAP, level, sizeof(str), flags);
+    }
+
+    char* buf = reserve(ring, len, wait);
+    if (nullptr == buf) return UINT64_MAX;
+    for (size_t i = 0; i < nparts; i++)
+    {
+        memcpy(buf, parts[i].data(), parts[i].size());
+        buf += parts[i].size();
+    }
+    return publish(ring, LogRecord::TEXT, level, len, flags);
+}
+
+char* Logger::LogWriter::reserve(LogRing*& ring, size_t len, bool wait)
+{
+    ring = get_ring();
+    Backpressure bp = _backpressure.load(std::memory_order_relaxed);
+    if (wait or QUEUE_BLOCK == bp) return ring->reserve(len);
+
+    char* buf = ring->try_reserve(len);
+    if (buf) return buf;
+
+    if (QUEUE_DROP_NEWEST == bp)
+    {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        if (ring->shared) _shared_mtx.unlock();
+        return nullptr;
+    }
+    return ring->spill_reserve(len, _capacity.load(std::memory_order_relaxed),
+                               QUEUE_DROP_OLDEST == bp);
+}
+
+std::string& Logger::LogWriter::Batch::next_text()
+{
+    if (ntext == text.size()) text.emplace_back();
+    std::string& str = text[ntext++];
+    str.clear();
+    return str;
+}
+
+/// Discard the rings of threads that have exited, once they are empty.
+void Logger::LogWriter::prune_rings()
+{
+    std::lock_guard<std::mutex> lock(_rings_mtx);
+    size_t before = _rings.size();
+    std::erase_if(_rings, [this](const std::shared_ptr<LogRing>& r)
+    {
+        if (not r->is_orphaned() or nullptr != r->peek() or
+            r->has_spill() or 0 != r->dropped.load())
+            return false;
+        _retired_msgs += r->msgs_in.load(std::memory_order_relaxed);
+        _retired_bytes += r->bytes_in.load(std::memory_order_relaxed);
+        _retired_waits += r->full_waits.load(std::memory_order_relaxed);
+        _retired_wait_nsec += r->full_wait_nsec.load(std::memory_order_relaxed);
+        return true;
+    });
+    if (_rings.size() != before)
+        _rings_gen.fetch_add(1, std::memory_order_release);
+}
+
+void Logger::LogWriter::update_rings(
+                       std::vector<std::shared_ptr<LogRing>>& rings,
+                       size_t& gen)
+{
+    if (gen == _rings_gen.load(std::memory_order_acquire) and
+        not rings.empty())
+        return;
+    std::lock_guard<std::mutex> lock(_rings_mtx);
+    rings = _rings;
+    gen = _rings_gen.load(std::memory_order_relaxed);
+}
+
+/// True if any of the rings holds a record.
+bool Logger::LogWriter::pending(std::vector<std::shared_ptr<LogRing>>& rings,
+                                size_t& gen)
+{
+    update_rings(rings, gen);
+    for (const auto& r : rings)
+        if (r->peek() or r->has_spill()) return true;
+    return false;
+}
+
+/// Sequence number of the oldest record of `ring`, be it in the ring
+/// or on its spill list, and which of the two it is in.
+static bool front(LogRing* ring, uint64_t& seq, bool& spilled)
+{
+    LogRecord* rec = ring->peek();
+    uint64_t sseq;
+    spilled = ring->has_spill() and ring->spill_front(sseq) and
+              (nullptr == rec or sseq < rec->seq);
+    if (spilled) seq = sseq;
+    else if (rec) seq = rec->seq;
+    return spilled or rec;
+}
+
+/// Collect messages, in sequence order, into the batch, followed by
+/// a note about any messages that were dropped since the last batch.
+void Logger::LogWriter::gather(Batch& batch,
+                               std::vector<std::shared_ptr<LogRing>>& rings,
+                               size_t& gen)
+{
+    gather_records(batch, rings, gen);
+    add_dropped(batch, rings);
+}
+
+/// Returns when the batch is full, or there is nothing more to
+/// collect, or the linger time has run out.
+///
+/// The rings are merged on their sequence numbers, i.e. on the time
+/// at which each record was published; but only the records published
+/// before `horizon`, the time at which the rings are looked at. If one
+/// message was logged after another, on another thread, then the first
+/// was in its ring before the second got its sequence number. So by
+/// the time that the second is taken, here, the first is visible, and
+/// it comes first, in this batch or an earlier one. (This relies on
+/// the steady clock being the same on all CPUs, as it is on Linux.)
+/// Messages that are not ordered that way, i.e. that were logged at
+/// the same time, may come out either way around. Nobody waits for a
+/// producer that is in the middle of publishing: its record will be
+/// taken next time around.
+void Logger::LogWriter::gather_records(Batch& batch,
+                               std::vector<std::shared_ptr<LogRing>>& rings,
+                               size_t& gen)
+{
+    size_t max_msgs = _batch_max.load(std::memory_order_relaxed);
+    unsigned linger = _batch_wait_usec.load(std::memory_order_relaxed);
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(linger);
+    auto older = std::greater<std::pair<uint64_t, LogRing*>>();
+
+    while (batch.iov.size() < max_msgs and not batch.stop)
+    {
+        update_rings(rings, gen);
+        uint64_t horizon = LogRing::now();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        uint64_t seq;
+        bool spilled;
+        batch.fronts.clear();
+        for (const auto& r : rings)
+            if (front(r.get(), seq, spilled) and seq < horizon)
+                batch.fronts.push_back({seq, r.get()});
+
+        if (batch.fronts.empty())
+        {
+            // Nothing more right now. Wait a little for more, if
+            // so configured; otherwise write what we've got.
+            if (0 == linger or batch.iov.empty() or
+                deadline <= std::chrono::steady_clock::now())
+                return;
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+            continue;
+        }
+        std::make_heap(batch.fronts.begin(), batch.fronts.end(), older);
+
+        while (not batch.fronts.empty() and
+               batch.iov.size() < max_msgs and not batch.stop)
+        {
+            std::pop_heap(batch.fronts.begin(), batch.fronts.end(), older);
+            LogRing* ring = batch.fronts.back().second;
+            batch.fronts.pop_back();
+
+            // Bursts usually come from one thread; keep draining this
+            // ring for as long as it holds the oldest record.
+            uint64_t bound = batch.fronts.empty() ? horizon :
+                std::min(horizon, batch.fronts.front().first);
+            while (front(ring, seq, spilled) and seq < horizon)
+            {
+                if (bound < seq)
+                {
+                    batch.fronts.push_back({seq, ring});
+                    std::push_heap(batch.fronts.begin(), batch.fronts.end(),
+                                   older);
+                    break;
+                }
+                take(batch, ring, spilled);
+                if (max_msgs <= batch.iov.size() or batch.stop) break;
+            }
+        }
+    }
+}
+
+/// Move the oldest record of `ring` into the batch.
+void Logger::LogWriter::take(Batch& batch, LogRing* ring, bool spilled)
+{
+    if (spilled)
+    {
+        // The buffer has to outlive the write.
+        LogRing::Spilled sp(ring->spill_pop());
+        if (sp.buf)
+        {
+            LogRecord::Kind kind = sp.rec()->kind;
+            add_record(batch, sp.rec());
+            batch.spilled.push_back(std::move(sp.buf));
+            if (LogRecord::TEXT <= kind and kind <= LogRecord::BINARY)
+                LogRing::bump(ring->msgs_out, 1);
+        }
+        else
+        {
+            batch.ndropped++;
+            LogRing::bump(ring->msgs_out, 1);
+        }
+        return;
+    }
+
+    if (batch.rings.empty() or batch.rings.back() != ring)
+        batch.rings.push_back(ring);
+    LogRecord* rec = ring->peek();
+    add_record(batch, rec);
+    if (LogRecord::TEXT <= rec->kind and rec->kind <= LogRecord::BINARY)
+        LogRing::bump(ring->msgs_out, 1);
+    ring->consume(rec);
+}
+
+/// Note how many messages were dropped, if any; see set_backpressure().
+void Logger::LogWriter::add_dropped(Batch& batch,
+                       const std::vector<std::shared_ptr<LogRing>>& rings)
+{
+    size_t ndropped = batch.ndropped;
+    for (const auto& r : rings)
+        ndropped += r->dropped.exchange(0, std::memory_order_relaxed);
+    if (0 == ndropped) return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    std::string& str = batch.next_text();
+    logbin::format_header(str, logbin::TIMESTAMP | logbin::LEVEL, WARN,
+                          ts.tv_sec * 1000000000ULL + ts.tv_nsec, "", 0);
+    str += "Log queue full: dropped " + std::to_string(ndropped) +
+           " messages\n";
+
+    LogRecord note{};
+    note.level = WARN;
+    add_text(batch, note, str.data(), str.size());
+}
+
+/// Add one record to the batch, formatting it if need be.
+void Logger::LogWriter::add_record(Batch& batch, LogRecord* rec)
+{
+    if (rec->flags & LogRecord::DUMP_FIRST) dump_recorder(batch);
+
+    switch (rec->kind)
+    {
+        case LogRecord::TEXT:
+            if (rec->flags & LogRecord::TRACE)
+                add_trace(batch, *rec, rec->payload(), rec->len);
+            else
+                add_text(batch, *rec, rec->payload(), rec->len);
+            break;
+        case LogRecord::HEAP:
+        {
+            std::string* str =
+                *reinterpret_cast<std::string**>(rec->payload());
+            batch.heap.push_back(str);
+            if (rec->flags & LogRecord::TRACE)
+                add_trace(batch, *rec, str->data(), str->size());
+            else
+                add_text(batch, *rec, str->data(), str->size());
+            break;
+        }
+        case LogRecord::DEFERRED:
+        {
+            DeferredMsg* dm = reinterpret_cast<DeferredMsg*>(rec->payload());
+            std::string& str = batch.next_text();
+            str.append(dm->prefix(), dm->prefix_len);
+            dm->format(str, dm->fmt, dm->args());
+            str.push_back('\n');
+            add_text(batch, *rec, str.data(), str.size());
+            break;
+        }
+        case LogRecord::BINARY:
+            add_binary(batch, rec, reinterpret_cast<BinaryMsg*>(rec->payload()));
+            break;
+        case LogRecord::STOP:
+            batch.stop = true;
+            break;
+        case LogRecord::SYNC:
+        {
+            std::atomic<uint32_t>* done;
+            memcpy(&done, rec->payload(), sizeof(done));
+            batch.waiters.push_back(done);
+            break;
+        }
+        case LogRecord::DUMP:
+            dump_recorder(batch);
+            break;
+        default:
+            break;
+    }
+}
+
+/// Buffer for the next binary frame. If this is the start of a new
+/// session, it starts out with the magic string.
+std::string& Logger::LogWriter::bin_frame(Batch& batch)
+{
+    std::string& str = batch.next_text();
+    if (not _bin_session.exchange(true))
+    {
+        str.append(logbin::MAGIC, sizeof(logbin::MAGIC));
+        _bin_defs.clear();
+        _bin_comps.clear();
+    }
+    return str;
+}
+
+/// Add formatted text to the batch, for all of the sinks that want it.
+void Logger::LogWriter::add_text(Batch& batch, const LogRecord& rec,
+                                 const char* text, size_t len)
+{
+    if (rec.flags & LogRecord::RECORD)
+    {
+        if (batch.recorder) batch.recorded.push_back({(void*) text, len});
+        return;
+    }
+
+    add_msg(batch, rec, text, len);
+    if (batch.file_level < rec.level) return;
+    add_file_text(batch, text, len);
+    batch.nwritten++;
+}
+
+/// A message with a backtrace: the text is followed by the return
+/// addresses, and then by their number. The addresses are turned into
+/// names here, on the writer thread, so that logging an error costs
+/// the caller no more than a call to backtrace(3).
+void Logger::LogWriter::add_trace(Batch& batch, const LogRecord& rec,
+                                  const char* text, size_t len)
+{
+    uint32_t depth;
+    memcpy(&depth, text + len - sizeof(depth), sizeof(depth));
+    len -= sizeof(depth) + depth * sizeof(void*);
+
+    void* trace[LogRecord::MAX_FRAMES];
+    memcpy(trace, text + len, depth * sizeof(void*));
+
+    std::string& str = batch.next_text();
+    str.append(text, len);
+    symbolize(str, trace, depth);
+    add_text(batch, rec, str.data(), str.size());
+}
+
+#if defined(HAVE_GNU_BACKTRACE)
+/// True if the line from oc_backtrace_symbols() names a member of
+/// Logger, or of one of its nested classes. Only the start of a
+/// mangled name can look like this; a function that merely takes a
+/// Logger argument does not.
+static bool in_logger(const char* sym)
+{
+    return strstr(sym, "_ZN7opencog6Logger") or
+           strstr(sym, "_ZNK7opencog6Logger");
+}
+
+/// Demangle the function name in a line from oc_backtrace_symbols().
+/// The BFD version gives "file:line\tname()", and the glibc version
+/// gives "file(name+0x12) [0x...]".
+static std::string demangle(const char* sym)
+{
+#if defined(HAVE_BFD) && defined(HAVE_IBERTY)
+    const char* begin = strstr(sym, "_ZN");
+    const char* end = strchr(sym, '(');
+    if (nullptr == begin or nullptr == end or end <= begin)
+        return sym;
+    std::string mangled(begin, end);
+    std::string out(sym, begin);
+    out += "  ";
+#else
+    const char* begin = strchr(sym, '(');
+    const char* end = strchr(sym, '+');
+    if (nullptr == begin or nullptr == end or end <= begin)
+        return sym;
+    std::string mangled(begin + 1, end);
+    std::string out(sym, begin);
+    out += " (";
+#endif
+    int status;
+    char* name = abi::__cxa_demangle(mangled.c_str(), nullptr, nullptr,
+                                     &status);
+    out += name ? name : mangled.c_str();
+    free(name);
+#if !(defined(HAVE_BFD) && defined(HAVE_IBERTY))
+    out += ' ';
+    out += end;
+#endif
+    return out;
+}
+#endif
+
+/// Append the backtrace to `out`. Each address is looked up only the
+/// first time it is seen; those not seen before are looked up all at
+/// once.
+void Logger::LogWriter::symbolize(std::string& out, void* const* trace,
+                                  uint32_t depth)
+{
+#if defined(HAVE_GNU_BACKTRACE)
+    // Addresses in a library that was unloaded and replaced might get
+    // stale names; keeping the cache bounded limits that, too.
+    static constexpr size_t MAX_SYMBOLS = 1 << 14;
+    if (MAX_SYMBOLS < _symbols.size() + depth) _symbols.clear();
+
+    void* missing[LogRecord::MAX_FRAMES];
+    int nmissing = 0;
+    for (uint32_t i = 0; i < depth; i++)
+    {
+        if (_symbols.count(trace[i]) or
+            std::find(missing, missing + nmissing, trace[i]) !=
+            missing + nmissing)
+            continue;
+        missing[nmissing++] = trace[i];
+    }
+    if (0 < nmissing)
+    {
+        // Depending on how the dependencies are met, syms could be NULL
+        char** syms = oc_backtrace_symbols(missing, nmissing);
+        for (int i = 0; i < nmissing; i++)
+            _symbols[missing[i]] = syms ?
+                Symbol{demangle(syms[i]), in_logger(syms[i])} :
+                Symbol{"??", false};
+        free(syms);
+    }
+
+    // However the message got to the logger, the way in is of no
+    // interest; the trace starts where the logger was called.
+    uint32_t top = 0;
+    while (top + 1 < depth and _symbols[trace[top]].in_logger) top++;
+
+    out += "\tStack Trace:\n";
+    for (uint32_t i = top; i < depth; i++)
+    {
+        out += '\t';
+        out += std::to_string(i - top + 2);
+        out += ": ";
+        out += _symbols[trace[i]].name;
+        out += '\n';
+    }
+    out += '\n';
+#endif
+}
+
+/// Add text to the file; in binary mode, as a TEXT frame.
+void Logger::LogWriter::add_file_text(Batch& batch,
+                                      const char* text, size_t len)
+{
+    if (is_binary())
+    {
+        logbin::TextFrame tf{logbin::TEXT, (uint32_t) len};
+        std::string& str = bin_frame(batch);
+        str.append((const char*) &tf, sizeof(tf));
+        batch.iov.push_back({str.data(), str.size()});
+    }
+    batch.iov.push_back({(void*) text, len});
+}
+
+/// Write the flight recorder into the file, followed by the messages
+/// recorded so far in this batch.
+void Logger::LogWriter::dump_recorder(Batch& batch)
+{
+    if (not batch.recorder) return;
+    std::lock_guard<std::mutex> lock(main()._sinks_mtx);
+    batch.recorder->write(batch.recorded.data(), batch.recorded.size());
+    batch.recorded.clear();
+
+    std::string& str = batch.next_text();
+    batch.recorder->dump(str);
+    if (not str.empty()) add_file_text(batch, str.data(), str.size());
+}
+
+/// Keep the text of the message for the other sinks, if need be.
+void Logger::LogWriter::add_msg(Batch& batch, const LogRecord& rec,
+                                const char* text, size_t len)
+{
+    if (batch.sinks or (rec.flags & LogRecord::ECHO))
+        batch.msgs.push_back({{(void*) text, len}, rec.level, rec.flags});
+}
+
+/// Add a message from logf(). In binary mode, the call site and the
+/// component are described once per session; after that, only the raw
+/// values are written.
+void Logger::LogWriter::add_binary(Batch& batch, LogRecord* rec,
+                                   BinaryMsg* bm)
+{
+    std::string_view comp(bm->component(), bm->comp_len);
+
+    if (not is_binary() or batch.sinks or
+        (rec->flags & (LogRecord::ECHO | LogRecord::RECORD)))
+    {
+        std::string& str = batch.next_text();
+        logbin::format_header(str, bm->flags, (Level) rec->level,
+                              bm->stamp, comp, bm->thread);
+        bm->format(str, bm->fmt, bm->args());
+        str.push_back('\n');
+        if (not is_binary() or (rec->flags & LogRecord::RECORD))
+        {
+            add_text(batch, *rec, str.data(), str.size());
+            return;
+        }
+        add_msg(batch, *rec, str.data(), str.size());
+    }
+    if (batch.file_level < rec->level) return;
+    batch.nwritten++;
+
+    std::string& str = bin_frame(batch);
+    auto key = std::make_pair(bm->fmt, rec->level);
+    auto def = _bin_defs.find(key);
+    if (_bin_defs.end() == def)
+    {
+        uint32_t id = _bin_defs.size() + 1;
+        def = _bin_defs.emplace(key, id).first;
+        logbin::DefFrame df{logbin::DEF, rec->level, id,
+                            (uint16_t) strlen(bm->fmt),
+                            (uint16_t) strlen(bm->sig)};
+        str.append((const char*) &df, sizeof(df));
+        str.append(bm->fmt, df.fmt_len);
+        str.append(bm->sig, df.sig_len);
+    }
+
+    uint32_t comp_id = 0;
+    if (not comp.empty())
+    {
+        auto ci = _bin_comps.find(comp);
+        if (_bin_comps.end() == ci)
+        {
+            uint32_t id = _bin_comps.size() + 1;
+            ci = _bin_comps.emplace(std::string(comp), id).first;
+            logbin::ComponentFrame cf{logbin::COMPONENT, id,
+                                      (uint16_t) comp.size()};
+            str.append((const char*) &cf, sizeof(cf));
+            str.append(comp);
+        }
+        comp_id = ci->second;
+    }
+
+    logbin::MsgFrame mf{logbin::MSG, bm->flags, def->second, comp_id,
+                        bm->stamp, bm->thread, bm->args_len};
+    str.append((const char*) &mf, sizeof(mf));
+    batch.iov.push_back({str.data(), str.size()});
+    batch.iov.push_back({bm->args(), bm->args_len});
+}
+
+void Logger::LogWriter::writing_loop()
+{
+    set_thread_name("opencog:logger");
+
+    std::vector<std::shared_ptr<LogRing>> rings;
+    size_t gen = 0;
+    Batch batch;
+    batch.iov.reserve(MAX_BATCH);
+
+    // Bytes written since the last group commit.
+    size_t unsynced = 0;
+    auto last_sync = std::chrono::steady_clock::now();
+    auto last_stats = last_sync;
+
+    while (not batch.stop)
+    {
+        bool group = SYNC_GROUP == _durability.load(std::memory_order_acquire);
+        auto due = last_sync + std::chrono::milliseconds(
+                                _group_msec.load(std::memory_order_relaxed));
+
+        if (not pending(rings, gen))
+        {
+            // Nothing to write. If some of what was written is still
+            // waiting for a group commit, poll until it is due; else
+            // sleep until the next message arrives.
+            if (group and 0 < unsynced)
+            {
+                auto now = std::chrono::steady_clock::now();
+                if (due <= now)
+                {
+                    group_commit();
+                    unsynced = 0;
+                    last_sync = now;
+                }
+                else
+                    std::this_thread::sleep_for(std::min(due - now,
+                        std::chrono::steady_clock::duration(
+                            std::chrono::milliseconds(1))));
+                continue;
+            }
+            prune_rings();
+            sleep_writer(rings, gen);
+            continue;
+        }
+
+        {
+            LogWriter& lw = main();
+            std::lock_guard<std::mutex> lock(lw.the_mutex);
+            batch.sinks = lw._extra_sinks;
+            batch.recorder = lw._recorder;
+        }
+        batch.file_level = _file_level.load(std::memory_order_relaxed);
+
+        // A new file gets the binary header, and the definitions,
+        // all over again. The sink must not be held on to past this:
+        // once it is replaced, it is to be closed by the time the
+        // messages written to it are committed.
+        {
+            std::shared_ptr<LogSink> sink(get_sink());
+            if (sink and sink->rotate_if_due()) _bin_session = false;
+        }
+
+        uint64_t depth = 0;
+        for (const auto& r : rings) depth += r->queued();
+        if (_max_depth.load(std::memory_order_relaxed) < depth)
+            _max_depth.store(depth, std::memory_order_relaxed);
+
+        gather(batch, rings, gen);
+
+        unsigned stats_secs = _stats_secs.load(std::memory_order_relaxed);
+        if (0 < stats_secs and last_stats + std::chrono::seconds(stats_secs)
+                               <= std::chrono::steady_clock::now())
+        {
+            add_stats(batch);
+            last_stats = std::chrono::steady_clock::now();
+        }
+
+        size_t bytes = write_batch(batch);
+        unsynced += bytes;
+        _msgs_written.store(_msgs_written.load(std::memory_order_relaxed) +
+                            batch.nwritten, std::memory_order_relaxed);
+        _bytes_written.store(_bytes_written.load(std::memory_order_relaxed) +
+                             bytes, std::memory_order_relaxed);
+
+        // Only now can the ring space be handed back.
+        for (LogRing* ring : batch.rings) ring->release();
+        for (std::string* str : batch.heap) delete str;
+
+        // Everyone who asked for a sync during this batch shares the
+        // one disk sync.
+        bool synced = false;
+        if ((group and not batch.waiters.empty()) or (group and
+            (_group_bytes.load(std::memory_order_relaxed) <= unsynced or
+             due <= std::chrono::steady_clock::now())))
+        {
+            group_commit();
+            unsynced = 0;
+            last_sync = std::chrono::steady_clock::now();
+            synced = true;
+        }
+
+        // A waiter that hears that the disk was synced is done;
+        // otherwise it does what the durability policy asks for.
+        for (std::atomic<uint32_t>* done : batch.waiters)
+        {
+            done->store(synced ? 2 : 1, std::memory_order_release);
+            done->notify_one();
+        }
+
+        bool stop = batch.stop;
+        batch.clear();
+        batch.stop = stop;
+    }
+
+    std::unique_lock<std::mutex> lock(the_mutex);
+    writingLoopActive = false;
+    _sink.reset();
+}
+
+/// Sync the disk, on the writer thread.
+void Logger::LogWriter::group_commit()
+{
+    std::shared_ptr<LogSink> sink(get_sink());
+    if (sink) sink->sync();
+}
+
+void Logger::LogWriter::sync()
+{
+    auto start = std::chrono::steady_clock::now();
+    wait_for();
+    _syncs.fetch_add(1, std::memory_order_relaxed);
+    _sync_nsec.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count(),
+        std::memory_order_relaxed);
+}
+
+void Logger::LogWriter::wait_for()
+{
+    {
+        std::lock_guard<std::mutex> lock(the_mutex);
+        if (not writingLoopActive) return;
+    }
+
+    // The request goes through this thread's ring, so the writer sees
+    // it only after everything logged before it; see gather_records().
+    // The writer lets us know once that is all written, and perhaps
+    // synced, with a group commit.
+    std::atomic<uint32_t> done(0);
+    std::atomic<uint32_t>* pdone = &done;
+    LogRing* ring = get_ring();
+    memcpy(ring->reserve(sizeof(pdone)), &pdone, sizeof(pdone));
+    publish(ring, LogRecord::SYNC, NONE, sizeof(pdone));
+
+    uint32_t state;
+    while (0 == (state = done.load(std::memory_order_acquire)))
+        done.wait(0, std::memory_order_acquire);
+    if (2 == state) return;
+
+    // An asynchronous sink may still be writing it, though.
+    std::shared_ptr<LogSink> sink(get_sink());
+    if (not sink) return;
+    if (SYNC_NONE == _durability.load(std::memory_order_acquire))
+        sink->drain();
+    else
+        sink->sync();
+}
+
+/// Write out the whole batch with as few system calls as possible;
+/// usually just one writev() per sink. Returns the number of bytes
+/// written to the file.
+size_t Logger::LogWriter::write_batch(Batch& batch)
+{
+    // Each of the other sinks gets the messages that pass its filter.
+    auto write_msgs = [&batch](LogSink& sink, Level level, uint8_t flags)
+    {
+        batch.scratch.clear();
+        for (const Batch::Msg& m : batch.msgs)
+            if (m.level <= level and (flags == (m.flags & flags)))
+                batch.scratch.push_back(m.text);
+        if (not batch.scratch.empty())
+            sink.write(batch.scratch.data(), batch.scratch.size());
+    };
+    if (batch.sinks or not batch.msgs.empty() or not batch.recorded.empty())
+    {
+        std::lock_guard<std::mutex> lock(main()._sinks_mtx);
+        if (batch.sinks)
+            for (const ExtraSink& es : *batch.sinks)
+                write_msgs(*es.sink, es.level, 0);
+        write_msgs(_echo, FINE, LogRecord::ECHO);
+        if (batch.recorder and not batch.recorded.empty())
+            batch.recorder->write(batch.recorded.data(),
+                                  batch.recorded.size());
+    }
+
+    if (batch.iov.empty()) return 0;
+
+    size_t bytes = 0;
+    for (const struct iovec& v : batch.iov) bytes += v.iov_len;
+
+    std::shared_ptr<LogSink> sink(get_sink());
+    if (not sink) return bytes;
+
+    auto start = std::chrono::steady_clock::now();
+    sink->write(batch.iov.data(), batch.iov.size());
+    uint64_t nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+    _writes.store(_writes.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+    _write_nsec.store(_write_nsec.load(std::memory_order_relaxed) + nsec,
+                      std::memory_order_relaxed);
+    if (_max_write_nsec.load(std::memory_order_relaxed) < nsec)
+        _max_write_nsec.store(nsec, std::memory_order_relaxed);
+    return bytes;
+}
+
+Logger::Stats Logger::LogWriter::get_stats()
+{
+    Stats st;
+    {
+        std::lock_guard<std::mutex> lock(_rings_mtx);
+        st.msgs_enqueued = _retired_msgs;
+        st.bytes_enqueued = _retired_bytes;
+        st.queue_full_waits = _retired_waits;
+        st.wait_usec = _retired_wait_nsec;
+        for (const auto& r : _rings)
+        {
+            st.msgs_enqueued += r->msgs_in.load(std::memory_order_relaxed);
+            st.bytes_enqueued += r->bytes_in.load(std::memory_order_relaxed);
+            st.queue_full_waits += r->full_waits.load(std::memory_order_relaxed);
+            st.wait_usec += r->full_wait_nsec.load(std::memory_order_relaxed);
+            st.queue_depth += r->queued();
+        }
+    }
+    st.msgs_written = _msgs_written.load(std::memory_order_relaxed);
+    st.bytes_written = _bytes_written.load(std::memory_order_relaxed);
+    st.max_queue_depth = _max_depth.load(std::memory_order_relaxed);
+    st.syncs = _syncs.load(std::memory_order_relaxed);
+    st.wait_usec = (st.wait_usec +
+                    _sync_nsec.load(std::memory_order_relaxed)) / 1000;
+    st.writes = _writes.load(std::memory_order_relaxed);
+    st.write_usec = _write_nsec.load(std::memory_order_relaxed) / 1000;
+    st.max_write_usec = _max_write_nsec.load(std::memory_order_relaxed) / 1000;
+    each_lane([&st](LogWriter& lw) { accumulate(st, lw.get_stats()); });
+    return st;
+}
+
+/// Add a line with the stats to the batch; see set_stats_interval().
+void Logger::LogWriter::add_stats(Batch& batch)
+{
+    Stats st(get_stats());
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    std::string& str = batch.next_text();
+    logbin::format_header(str, logbin::TIMESTAMP | logbin::LEVEL, INFO,
+                          ts.tv_sec * 1000000000ULL + ts.tv_nsec, "", 0);
+    str += "Log stats: enqueued " + std::to_string(st.msgs_enqueued) +
+           " msgs, " + std::to_string(st.bytes_enqueued) +
+           " bytes; written " + std::to_string(st.msgs_written) +
+           " msgs, " + std::to_string(st.bytes_written) +
+           " bytes; queue " + std::to_string(st.queue_depth) +
+           ", max " + std::to_string(st.max_queue_depth) +
+           "; waits " + std::to_string(st.queue_full_waits) +
+           " full, " + std::to_string(st.syncs) +
+           " sync, " + std::to_string(st.wait_usec) +
+           " usec; writes " + std::to_string(st.writes) +
+           ", " + std::to_string(st.write_usec) +
+           " usec, max " + std::to_string(st.max_write_usec) + " usec\n";
+
+    LogRecord note{};
+    note.level = INFO;
+    add_text(batch, note, str.data(), str.size());
+}
+std::shared_ptr<LogSink> Logger::LogWriter::get_sink()
+{
+    std::lock_guard<std::mutex> lock(the_mutex);
+    return _sink;
+}
+
+void Logger::LogWriter::add_sink(std::shared_ptr<LogSink> sink, Level level)
+{
+    std::lock_guard<std::mutex> lock(the_mutex);
+    auto sinks = std::make_shared<SinkList>();
+    if (_extra_sinks) *sinks = *_extra_sinks;
+    sinks->push_back({sink, level});
+    _extra_sinks = sinks;
+}
+
+void Logger::LogWriter::clear_sinks()
+{
+    {
+        std::lock_guard<std::mutex> lock(the_mutex);
+        if (not _extra_sinks) return;
+    }
+
+    // Let the messages queued so far reach the sinks.
+    flush();
+    std::lock_guard<std::mutex> lock(the_mutex);
+    _extra_sinks.reset();
+}
+
+void Logger::LogWriter::set_recorder(size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(the_mutex);
+    if (0 == max_bytes)
+    {
+        _recorder.reset();
+        return;
+    }
+    _recorder = std::make_shared<FlightRecorder>(fileName, max_bytes);
+    FlightRecorder::catch_signals();
+}
+
+bool Logger::LogWriter::has_recorder()
+{
+    std::lock_guard<std::mutex> lock(the_mutex);
+    return nullptr != _recorder;
+}
+
+void Logger::LogWriter::dump_recorder()
+{
+    LogRing* ring = get_ring();
+    ring->reserve(0);
+    publish(ring, LogRecord::DUMP, NONE, 0);
+}
+
+std::shared_ptr<MemorySink> Logger::LogWriter::get_memory_sink()
+{
+    std::lock_guard<std::mutex> lock(the_mutex);
+    if (_extra_sinks)
+        for (const ExtraSink& es : *_extra_sinks)
+            if (auto ms = std::dynamic_pointer_cast<MemorySink>(es.sink))
+                return ms;
+    return nullptr;
+}
+
+/// Switch to a new sink. Everything queued so far goes to the old one.
+void Logger::LogWriter::set_sink(std::shared_ptr<LogSink> sink)
+{
+    std::unique_lock<std::mutex> lock(the_mutex);
+    if (_sink and _sink->is_open()) {
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+    _sink = sink;
+    _bin_session = false;
+}
+
+/// Replace the sink with one set up according to the current settings.
+void Logger::LogWriter::new_sink()
+{
+    std::shared_ptr<LogSink> sink;
+    {
+        std::lock_guard<std::mutex> lock(the_mutex);
+        if (0 < _mmap_seg_size)
+            sink = std::make_shared<MmapSink>(fileName, _mmap_seg_size,
+                                              _mmap_msync_msec);
+        else if (0 < _uring_depth and not _rotation.enabled())
+            sink = UringSink::create(fileName, _uring_depth,
+                                     _uring_buf_size);
+        if (not sink)
+            sink = std::make_shared<FileSink>(fileName, _rotation);
+    }
+    set_sink(sink);
+}
+
+void Logger::LogWriter::setFileName(const std::string& s)
+{
+    {
+        std::lock_guard<std::mutex> lock(the_mutex);
+        fileName.assign(s);
+
+        // A crash dump goes to the new file, too.
+        if (_recorder)
+            _recorder = std::make_shared<FlightRecorder>(fileName,
+                                                         _recorder->size());
+    }
+    new_sink();
+    start_write_loop();
+}
+
+void Logger::LogWriter::set_mmap(size_t seg_size, unsigned msync_msec)
+{
+    {
+        std::lock_guard<std::mutex> lock(the_mutex);
+        _mmap_seg_size = seg_size;
+        _mmap_msync_msec = msync_msec;
+    }
+    new_sink();
+    each_lane([=](LogWriter& lw) { lw.set_mmap(seg_size, msync_msec); });
+}
+
+void Logger::LogWriter::set_rotation(const LogRotation& rotation)
+{
+    {
+        std::lock_guard<std::mutex> lock(the_mutex);
+        _rotation = rotation;
+    }
+    new_sink();
+    each_lane([&rotation](LogWriter& lw) { lw.set_rotation(rotation); });
+}
+
+void Logger::LogWriter::set_io_uring(unsigned depth, size_t buf_size)
+{
+    {
+        std::lock_guard<std::mutex> lock(the_mutex);
+        _uring_depth = depth;
+        _uring_buf_size = buf_size;
+    }
+    new_sink();
+    each_lane([=](LogWriter& lw) { lw.set_io_uring(depth, buf_size); });
+}
+
+void Logger::LogWriter::flush()
+{
+    sync();
+    each_lane([](LogWriter& lw) { lw.flush(); });
+}
+
+void Logger::LogWriter::set_lanes(unsigned k)
+{
+    k = std::clamp(k, 1u, MAX_LANES);
+    std::lock_guard<std::mutex> lanes_lock(_lanes_mtx);
+    for (unsigned i = _lanes_made.load(); i + 1 < k; i++)
+    {
+        // The new lane starts out with the settings of this one.
+        LogWriter* lw = new LogWriter();
+        lw->_main = this;
+        {
+            std::lock_guard<std::mutex> lock(the_mutex);
+            lw->_mmap_seg_size = _mmap_seg_size;
+            lw->_mmap_msync_msec = _mmap_msync_msec;
+            lw->_rotation = _rotation;
+            lw->_uring_depth = _uring_depth;
+            lw->_uring_buf_size = _uring_buf_size;
+        }
+        lw->_file_level.store(_file_level.load());
+        lw->_stats_secs.store(_stats_secs.load());
+        lw->_durability.store(_durability.load());
+        lw->_group_msec.store(_group_msec.load());
+        lw->_group_bytes.store(_group_bytes.load());
+        lw->_backpressure.store(_backpressure.load());
+        lw->_capacity.store(_capacity.load());
+        lw->_batch_max.store(_batch_max.load());
+        lw->_batch_wait_usec.store(_batch_wait_usec.load());
+        lw->_binary.store(_binary.load());
+        lw->setFileName(fileName + ".lane" + std::to_string(i + 1));
+
+        _lanes[i].reset(lw);
+        _lanes_made.store(i + 1, std::memory_order_release);
+    }
+    _nlanes.store(k, std::memory_order_release);
+}
+
+Logger::LogWriter* Logger::LogWriter::pick_lane(unsigned n)
+{
+    if (UINT_MAX == t_lane)
+        t_lane = next_lane.fetch_add(1, std::memory_order_relaxed);
+    unsigned i = t_lane % n;
+    return 0 == i ? this : _lanes[i - 1].get();
+}
@@ -0,0 +1,627 @@
+/*
+ * opencog/util/LogWriter.h
+ *
+ * Copyright (C) 2008, 2010 OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _OPENCOG_LOG_WRITER_H
+#define _OPENCOG_LOG_WRITER_H
+
+// Private to the Logger implementation; this header is not installed.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include <opencog/util/Logger.h>
+
+#include "LogSink.h"
+
+namespace opencog
+{
+/** \addtogroup grp_cogutil
+ *  @{
+ */
+
+//! Header of one record in a LogRing.
+///
+/// Records are 8-byte aligned, and the payload immediately follows
+/// the header. The sequence number is the time of publication, in
+/// nanoseconds of the steady clock, kept strictly increasing within
+/// each ring; see LogRing::next_seq(). The writer thread merges the
+/// rings on it, which puts the messages of different threads in the
+/// order in which they were logged, whenever that order is defined.
+struct LogRecord
+{
+    enum Kind : uint8_t
+    {
+        TEXT,    // payload is the formatted message
+        HEAP,    // payload is a std::string* (oversized messages)
+        DEFERRED,// payload is a DeferredMsg, to be formatted
+        BINARY,  // payload is a BinaryMsg, for the binary format
+        PAD,     // filler up to the end of the ring; skip it
+        STOP,    // ask the writer thread to exit
+        SYNC,    // wake a waiter once all before it is written;
+                 // payload is a std::atomic<uint32_t>*
+        DUMP,    // dump the flight recorder into the file
+    };
+
+    enum Flags : uint8_t
+    {
+        ECHO = 1,    // also print to stdout; see set_print_to_stdout_flag()
+        RECORD = 2,  // keep in the flight recorder only; not logged
+        DUMP_FIRST = 4,  // dump the flight recorder before this message
+        TRACE = 8,   // the payload ends with a backtrace; see add_trace()
+    };
+
+    /// The most frames kept for a backtrace.
+    static constexpr unsigned MAX_FRAMES = 50;
+
+    uint64_t seq;
+    uint32_t size;   // total size of the record, header included
+    uint32_t len;    // payload length
+    Kind kind;
+    uint8_t level;
+    uint8_t flags;
+
+    char* payload() { return reinterpret_cast<char*>(this + 1); }
+};
+
+//! Payload of a DEFERRED record.
+///
+/// It is followed by the message header (timestamp, level and so on,
+/// already formatted) and then by the packed arguments. The writer
+/// thread formats the message by calling `format`.
+struct DeferredMsg
+{
+    logfmt::FormatFn format;
+    const char* fmt;
+    uint32_t prefix_len;
+    uint32_t args_len;
+
+    char* prefix() { return reinterpret_cast<char*>(this + 1); }
+    char* args() { return prefix() + prefix_len; }
+};
+
+//! Payload of a BINARY record.
+///
+/// Like DeferredMsg, but with the raw header fields instead of the
+/// formatted header. It is followed by the component tag, and then by
+/// the packed arguments.
+struct BinaryMsg
+{
+    logfmt::FormatFn format;
+    const char* fmt;
+    const char* sig;
+    uint64_t stamp;
+    uint64_t thread;
+    uint32_t args_len;
+    uint16_t comp_len;
+    uint8_t flags;
+
+    char* component() { return reinterpret_cast<char*>(this + 1); }
+    char* args() { return component() + comp_len; }
+};
+
+//! Single-producer, single-consumer ring of variable-sized records.
+///
+/// Each thread that logs gets one of these (per LogWriter), so the
+/// producer side never contends with any other producer. The buffer
+/// is allocated once, up front; after that, logging a message is a
+/// memcpy and one release-store. The consumer (the writer thread)
+/// reads records in place, and hands the space back only after the
+/// record has been written out.
+///
+/// What happens when the ring is full depends on the backpressure
+/// policy (see Logger::set_backpressure()). By default, the producer
+/// blocks (on std::atomic::wait), which is the analog of the old
+/// "queue too long" flush. Otherwise, the message is either dropped,
+/// or put on the spill list: an overflow queue of heap-allocated
+/// records, which the writer drains along with the ring. Spilled
+/// records get their sequence numbers just like any other, so the
+/// order of the messages is kept.
+///
+/// Nothing in here is shared between producers: the sequence numbers
+/// come from the clock, not from a common counter.
+class LogRing
+{
+public:
+    static constexpr size_t MIN_CAPACITY = 1 << 16;
+
+    /// Messages longer than this are not copied into the ring;
+    /// a pointer to a heap copy is passed instead.
+    static constexpr size_t MAX_INLINE = MIN_CAPACITY / 4;
+
+    /// The capacity is rounded up to a power of two.
+    LogRing(size_t capacity = MIN_CAPACITY);
+    ~LogRing();
+    LogRing(const LogRing&) = delete;
+    LogRing& operator=(const LogRing&) = delete;
+
+    size_t capacity() const { return _capacity; }
+
+    /// Nanoseconds on the steady clock.
+    static uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Producer side. try_reserve() returns null if the ring is full.
+    uint64_t next_seq()
+    {
+        _last_seq = std::max(now(), _last_seq + 1);
+        return _last_seq;
+    }
+    char* reserve(size_t len);
+    char* try_reserve(size_t len);
+    void commit(uint64_t seq, LogRecord::Kind, uint8_t level, size_t len,
+                uint8_t flags = 0);
+
+    // Producer side, when the ring is full. Reserve space on the spill
+    // list instead; if that holds `limit` bytes already, either block
+    // until it doesn't, or else (with `drop_oldest`) make room by
+    // dropping the oldest spilled records.
+    char* spill_reserve(size_t len, size_t limit, bool drop_oldest);
+    bool spill_pending() const { return nullptr != _spill_rec.get(); }
+    void spill_commit(uint64_t seq, LogRecord::Kind, uint8_t level,
+                      size_t len, uint8_t flags = 0);
+
+    /// Written to by any number of threads, one at a time; see
+    /// LogWriter::get_ring().
+    bool shared;
+
+    /// Messages dropped because the ring was full; see DROP_NEWEST.
+    std::atomic<size_t> dropped;
+
+    /// Counters for Logger::get_stats(). Only the producer writes
+    /// them (only the consumer, msgs_out), so a plain load and store
+    /// does; anyone may read them.
+    std::atomic<uint64_t> msgs_in;
+    std::atomic<uint64_t> msgs_out;
+    std::atomic<uint64_t> bytes_in;
+    std::atomic<uint64_t> full_waits;
+    std::atomic<uint64_t> full_wait_nsec;
+    static void bump(std::atomic<uint64_t>& c, uint64_t n)
+    {
+        c.store(c.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+    }
+    uint64_t queued() const
+    {
+        uint64_t out = msgs_out.load(std::memory_order_relaxed);
+        uint64_t in = msgs_in.load(std::memory_order_relaxed);
+        return (out < in) ? in - out : 0;
+    }
+
+    // Consumer side.
+    LogRecord* peek();
+    void consume(const LogRecord*);
+    void release();
+
+    /// A record taken off the spill list. The buffer holds the record
+    /// header and the payload; it is null if the record was dropped.
+    struct Spilled
+    {
+        uint64_t seq;
+        std::unique_ptr<uint64_t[]> buf;
+        size_t bytes;
+        LogRecord* rec() { return reinterpret_cast<LogRecord*>(buf.get()); }
+    };
+    bool has_spill() const
+        { return 0 < _nspill.load(std::memory_order_acquire); }
+    bool spill_front(uint64_t& seq);
+    Spilled spill_pop();
+
+    /// The owning thread has exited; no more records will arrive.
+    void orphan() { _orphaned.store(true, std::memory_order_release); }
+    bool is_orphaned() const
+        { return _orphaned.load(std::memory_order_acquire); }
+
+private:
+    static size_t record_size(size_t len)
+        { return (sizeof(LogRecord) + len + 7) & ~size_t(7); }
+
+    bool has_room(size_t pos, size_t need);
+
+    const size_t _capacity;
+    const size_t _mask;
+    char* _buf;
+
+    // Producer-owned.
+    alignas(64) std::atomic<size_t> _tail;
+    uint64_t _last_seq;
+    size_t _cached_head;
+    size_t _rec_pos;
+    std::unique_ptr<uint64_t[]> _spill_rec;
+    size_t _spill_limit;
+    bool _drop_oldest;
+
+    // Shared; the list is protected by the lock, and the writer checks
+    // the count before taking it.
+    std::mutex _spill_mtx;
+    std::deque<Spilled> _spill;
+    std::atomic<size_t> _nspill;
+    std::atomic<size_t> _spill_bytes;
+    size_t _ndead;
+
+    // Consumer-owned.
+    alignas(64) std::atomic<size_t> _head;
+    size_t _read;
+    size_t _cached_tail;
+
+    alignas(64) std::atomic<bool> _orphaned;
+};
+
+//! All of the writing for one log file.
+///
+/// Producers write into per-thread rings; the single writer thread
+/// merges the rings in sequence-number (i.e. time) order, so that the
+/// file sees messages in the same order in which they were issued.
+///
+/// With lanes (see set_lanes()), there are several such writers for
+/// one log, each with its own rings, thread and file; the order holds
+/// within each lane.
+class Logger::LogWriter
+{
+    /* One writer per file */
+    std::string fileName;
+    bool writingLoopActive;
+
+    /** Where the messages go; see set_mmap(). The writer thread and
+     *  sync() each take their own reference, so that the sink can be
+     *  replaced while they are using it. */
+    std::shared_ptr<LogSink> _sink;
+    std::shared_ptr<LogSink> get_sink();
+    void set_sink(std::shared_ptr<LogSink>);
+
+    /** More places for the messages to go, besides the file; see
+     *  add_sink(). The list is replaced, never modified, so that the
+     *  writer thread can hold on to it while writing a batch. */
+    struct ExtraSink
+    {
+        std::shared_ptr<LogSink> sink;
+        Level level;
+    };
+    typedef std::vector<ExtraSink> SinkList;
+    std::shared_ptr<const SinkList> _extra_sinks;
+    std::atomic<Level> _file_level;
+
+    /** Messages from loggers with the stdout flag set; see ECHO. */
+    StreamSink _echo;
+
+    /** Messages that were not logged; see set_recorder(). */
+    std::shared_ptr<FlightRecorder> _recorder;
+
+    /** The writer of lane 0, if this is one of the other lanes; see
+     *  set_lanes(). Lanes write to the other sinks and the flight
+     *  recorder of lane 0, taking turns on its sinks lock, since the
+     *  sinks expect a single writer. */
+    LogWriter* _main;
+    std::mutex _sinks_mtx;
+    LogWriter& main() { return _main ? *_main : *this; }
+
+    /** How the sink is to be set up; protected by the_mutex. */
+    size_t _mmap_seg_size;
+    unsigned _mmap_msync_msec;
+    LogRotation _rotation;
+    unsigned _uring_depth;
+    size_t _uring_buf_size;
+    void new_sink();
+
+    /* Distinguishes writers in the per-thread ring cache. */
+    const uint64_t _id;
+
+    /** One single thread does all writing of log messages */
+    std::thread writer_thread;
+    std::mutex the_mutex;
+
+    /** Per-thread rings. The lock is only taken when a thread logs
+     *  to this writer for the first time, and by the writer thread
+     *  when it notices that a ring was added. */
+    std::mutex _rings_mtx;
+    std::vector<std::shared_ptr<LogRing>> _rings;
+    std::atomic<size_t> _rings_gen;
+
+    /** For threads whose ring cache is gone: those logging from the
+     *  destructor of another thread_local, or from a static destructor
+     *  or an atexit handler, after thread-local storage was torn down.
+     *  They take turns on one ring, holding the lock from get_ring()
+     *  until publish(), or until reserve() gives up. */
+    std::mutex _shared_mtx;
+    std::shared_ptr<LogRing> _shared_ring;
+
+    /** Counters for get_stats(). Those of the rings that were
+     *  discarded are added up here, under the rings lock; the writer
+     *  counters are only written by the writer thread. */
+    uint64_t _retired_msgs, _retired_bytes;
+    uint64_t _retired_waits, _retired_wait_nsec;
+    std::atomic<uint64_t> _msgs_written;
+    std::atomic<uint64_t> _bytes_written;
+    std::atomic<uint64_t> _max_depth;
+    std::atomic<uint64_t> _writes;
+    std::atomic<uint64_t> _write_nsec;
+    std::atomic<uint64_t> _max_write_nsec;
+    std::atomic<uint64_t> _syncs;
+    std::atomic<uint64_t> _sync_nsec;
+
+    /** Log the stats every so many seconds; see set_stats_interval(). */
+    std::atomic<unsigned> _stats_secs;
+
+    /** Set by the writer thread when it has nothing to do, just
+     *  before it goes to sleep on the wakeup count. Producers only
+     *  read it, so it costs them nothing while the writer is busy. */
+    alignas(64) std::atomic<bool> _sleeping;
+    std::atomic<uint32_t> _wakeups;
+    void wake_writer();
+    void sleep_writer(std::vector<std::shared_ptr<LogRing>>&, size_t&);
+
+    /** Durability policy; see set_durability(). With group commit,
+     *  the writer thread syncs the disk before it lets those waiting
+     *  in sync() go. */
+    alignas(64) std::atomic<Durability> _durability;
+    std::atomic<unsigned> _group_msec;
+    std::atomic<size_t> _group_bytes;
+
+    /** What to do when a ring fills up; see set_backpressure(). */
+    std::atomic<Backpressure> _backpressure;
+    std::atomic<size_t> _capacity;
+
+    /** Limits on how much goes into one writev(); see set_batch(). */
+    std::atomic<size_t> _batch_max;
+    std::atomic<unsigned> _batch_wait_usec;
+
+    /** Messages gathered by the writer thread for a single writev().
+     *  The iovecs point directly into the rings, so the rings are
+     *  released only after the write has completed. */
+    struct Batch
+    {
+        // What goes to the file.
+        std::vector<struct iovec> iov;
+
+        // The text of each message, for the other sinks, if there
+        // are any, and for printing to stdout.
+        struct Msg
+        {
+            struct iovec text;
+            uint8_t level;
+            uint8_t flags;
+        };
+        std::vector<Msg> msgs;
+        std::shared_ptr<const SinkList> sinks;
+        Level file_level = FINE;
+        std::vector<struct iovec> scratch;
+
+        // Messages for the flight recorder, if there is one.
+        std::shared_ptr<FlightRecorder> recorder;
+        std::vector<struct iovec> recorded;
+
+        // The rings with records to take, oldest first, as a heap;
+        // and those to release once the batch is written.
+        std::vector<std::pair<uint64_t, LogRing*>> fronts;
+        std::vector<LogRing*> rings;
+        std::vector<std::string*> heap;
+        std::vector<std::unique_ptr<uint64_t[]>> spilled;
+        size_t ndropped = 0;
+        size_t nwritten = 0;    // messages that go to the file
+        bool stop = false;
+        bool sync = false;
+
+        // Threads waiting in sync(); see LogRecord::SYNC.
+        std::vector<std::atomic<uint32_t>*> waiters;
+
+        // Text of deferred messages, formatted by the writer thread.
+        // A deque, so that the strings don't move as it grows; the
+        // strings are reused from one batch to the next.
+        std::deque<std::string> text;
+        size_t ntext = 0;
+        std::string& next_text();
+
+        void clear()
+        {
+            iov.clear(); msgs.clear(); sinks.reset();
+            recorder.reset(); recorded.clear();
+            rings.clear(); heap.clear(); spilled.clear(); waiters.clear();
+            ntext = 0; ndropped = 0; nwritten = 0; sync = false;
+        }
+    };
+
+    /** Binary output; see Logger::set_binary_flag(). The call-site
+     *  and component tables are owned by the writer thread, and start
+     *  over with each session (i.e. each time the file is opened). */
+    std::atomic<bool> _binary;
+    std::atomic<bool> _bin_session;
+    std::map<std::pair<const char*, uint8_t>, uint32_t> _bin_defs;
+    std::map<std::string, uint32_t, std::less<>> _bin_comps;
+
+    /** Names of the return addresses seen in backtraces, as printed,
+     *  and whether they are in the logger itself. Owned by the writer
+     *  thread. */
+    struct Symbol
+    {
+        std::string name;
+        bool in_logger;
+    };
+    std::unordered_map<void*, Symbol> _symbols;
+    void symbolize(std::string&, void* const*, uint32_t);
+    void add_trace(Batch&, const LogRecord&, const char*, size_t);
+
+    void add_record(Batch&, LogRecord*);
+    void add_text(Batch&, const LogRecord&, const char*, size_t);
+    void add_msg(Batch&, const LogRecord&, const char*, size_t);
+    void add_file_text(Batch&, const char*, size_t);
+    void dump_recorder(Batch&);
+    void add_stats(Batch&);
+    std::string& bin_frame(Batch&);
+    void add_binary(Batch&, LogRecord*, BinaryMsg*);
+
+    LogRing* get_ring();
+    uint64_t publish(LogRing*, LogRecord::Kind, Level, size_t,
+                     uint8_t flags = 0);
+    void prune_rings();
+
+    void start_write_loop();
+    void stop_write_loop();
+    void writing_loop();
+    void update_rings(std::vector<std::shared_ptr<LogRing>>&, size_t&);
+    bool pending(std::vector<std::shared_ptr<LogRing>>&, size_t&);
+    void gather(Batch&, std::vector<std::shared_ptr<LogRing>>&, size_t&);
+    void gather_records(Batch&, std::vector<std::shared_ptr<LogRing>>&,
+                        size_t&);
+    void take(Batch&, LogRing*, bool spilled);
+    void add_dropped(Batch&, const std::vector<std::shared_ptr<LogRing>>&);
+    size_t write_batch(Batch&);
+    void group_commit();
+    void wait_for();
+
+public:
+    LogWriter(void);
+    ~LogWriter();
+
+    void setFileName(const std::string&);
+
+    const std::string& getFileName(void) const
+        { return fileName; }
+
+    /// Queue the concatenation of the given pieces as one message.
+    /// Returns the sequence number of the message, or UINT64_MAX if
+    /// it was dropped. If `wait` is set, the message is never dropped
+    /// or spilled, whatever the backpressure policy.
+    uint64_t qmsg(Level, const std::string_view*, size_t, bool wait = false,
+                  uint8_t flags = 0);
+    uint64_t qmsg(const std::string& str)
+        { std::string_view sv(str); return qmsg(NONE, &sv, 1); }
+
+    /// Two-step version of qmsg(), for callers that build the payload
+    /// in place: reserve() returns space for a payload of `len` bytes
+    /// in this thread's ring (or its spill list), and commit() makes
+    /// it visible. reserve() returns null if the message is dropped.
+    char* reserve(LogRing*&, size_t len, bool wait = false);
+    uint64_t commit(LogRing* ring, LogRecord::Kind kind,
+                    Level level, size_t len, uint8_t flags = 0)
+        { return publish(ring, kind, level, len, flags); }
+
+    /// Write into memory-mapped segments of `seg_size` bytes, rather
+    /// than appending to the file; or go back to appending, if zero.
+    void set_mmap(size_t seg_size, unsigned msync_msec);
+
+    /// Rotate the (plain, not memory-mapped) log file.
+    void set_rotation(const LogRotation&);
+
+    /// Append to the file through io_uring, with up to `depth` buffers
+    /// in flight; or with plain writev(), if zero.
+    void set_io_uring(unsigned depth, size_t buf_size);
+
+    void set_binary(bool b)
+    {
+        _binary.store(b);
+        each_lane([b](LogWriter& lw) { lw.set_binary(b); });
+    }
+    bool is_binary() const
+        { return _binary.load(std::memory_order_relaxed); }
+
+    void set_backpressure(Backpressure, size_t capacity);
+
+    /// Also send the messages at `level` and below to `sink`. All
+    /// sinks are written by the writer thread.
+    void add_sink(std::shared_ptr<LogSink>, Level level);
+    void clear_sinks();
+    std::shared_ptr<MemorySink> get_memory_sink();
+    void set_file_level(Level l)
+    {
+        _file_level.store(l);
+        each_lane([l](LogWriter& lw) { lw.set_file_level(l); });
+    }
+
+    /// Keep up to `max_bytes` of the messages marked RECORD in a
+    /// flight recorder; none at all, if zero.
+    void set_recorder(size_t max_bytes);
+    bool has_recorder();
+
+    /// Ask the writer thread to dump the flight recorder.
+    void dump_recorder();
+
+    /// Write at most `max_msgs` messages per system call, and linger
+    /// up to `max_wait_usec` for a batch to fill up.
+    void set_batch(size_t max_msgs, unsigned max_wait_usec);
+
+    void set_durability(Durability, unsigned group_msec, size_t group_bytes);
+
+    /// Block until everything that the calling thread logged so far,
+    /// and all messages logged before those, have been written and
+    /// synced to disk, as far as the durability policy asks for it.
+    void sync();
+
+    Stats get_stats();
+    void set_stats_interval(unsigned secs)
+    {
+        _stats_secs.store(secs);
+        each_lane([secs](LogWriter& lw) { lw.set_stats_interval(secs); });
+    }
+
+    /// Block until everything queued so far, in all lanes, is on disk.
+    void flush();
+
+    /// Spread the producers over `k` writers, this one and `k - 1`
+    /// more, each with a file of its own. The settings made on this
+    /// writer are passed on to the others.
+    void set_lanes(unsigned k);
+
+    /// The writer for the calling thread.
+    LogWriter* lane()
+    {
+        unsigned n = _nlanes.load(std::memory_order_acquire);
+        return n <= 1 ? this : pick_lane(n);
+    }
+
+private:
+    /** Lanes 1 and up; see set_lanes(). Lanes are added, but never
+     *  removed, so that a producer can use the one it picked without
+     *  a lock. Declared last, so that the lanes are gone before the
+     *  sinks that they share. */
+    static constexpr unsigned MAX_LANES = 64;
+    std::mutex _lanes_mtx;
+    std::atomic<unsigned> _nlanes;
+    std::atomic<unsigned> _lanes_made;
+    std::unique_ptr<LogWriter> _lanes[MAX_LANES - 1];
+
+    LogWriter* pick_lane(unsigned n);
+    template<typename F> void each_lane(F f)
+    {
+        unsigned n = _lanes_made.load(std::memory_order_acquire);
+        for (unsigned i = 0; i < n; i++) f(*_lanes[i]);
+    }
+};
+
+/** @}*/
+}  // namespace opencog
+
+#endif // _OPENCOG_LOG_WRITER_H
@@ -28,16 +28,16 @@
  */
 
 #if defined(HAVE_GNU_BACKTRACE)
-#include <cxxabi.h>
 #include <execinfo.h>
 #endif
 
-#include <iostream>
+#include <algorithm>
 #include <sstream>
 
 #include <stdarg.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -54,97 +54,44 @@
 #include <valgrind/drd.h>
 #endif
 
-#include <opencog/util/backtrace-symbols.h>
 #include <opencog/util/platform.h>
 
 #include "Logger.h"
-
-#ifdef __APPLE__
-#define fdatasync fsync
-#endif
+#include "LogBinary.h"
+#include "LogLimiter.h"
+#include "LogWriter.h"
 
 using namespace opencog;
 
 // messages greater than this will be truncated
 #define MAX_PRINTF_STYLE_MESSAGE_SIZE (1<<15)
 const char* levelStrings[] = {"NONE", "ERROR", "WARN", "INFO", "DEBUG", "FINE"};
+static const std::string_view levelTags[] =
+    {"[NONE] ", "[ERROR] ", "[WARN] ", "[INFO] ", "[DEBUG] ", "[FINE] "};
 
 #if defined(HAVE_GNU_BACKTRACE) /// @todo backtrace and backtrace_symbols
                                 /// is LINUX, we may need a WIN32 version
-static void prt_backtrace(std::ostringstream& oss)
-{
-#define BT_BUFSZ 50
-	void *bt_buf[BT_BUFSZ];
-
-	int stack_depth = backtrace(bt_buf, BT_BUFSZ);
-	char **syms = oc_backtrace_symbols(bt_buf, stack_depth);
-
-    // Depending on how the dependencies are met, syms could be NULL
-    if (syms == NULL) return;
-
-	// Start printing at a bit into the stack, so as to avoid recording
-	// the logger functions in the stack trace.
-	oss << "\tStack Trace:\n";
-	for (int i=2; i < stack_depth; i++)
-	{
-		// Most things we'll print are mangled C++ names,
-		// So demangle them, get them to pretty-print.
-#if defined(HAVE_BFD) && defined(HAVE_IBERTY)
-		// The standard and the heck versions differ slightly in layout.
-		char * begin = strstr(syms[i], "_ZN");
-		char * end = strchr(syms[i], '(');
-		if (!(begin && end) || end <= begin)
-		{
-			// Failed to pull apart the symbol names
-			oss << "\t" << i << ": " << syms[i] << "\n";
-		}
-		else
-		{
-			*begin = 0x0;
-			oss << "\t" << i << ": " << syms[i] << "  ";
-			*begin = '_';
-			size_t sz = 250;
-			int status;
-			char *fname = (char *) malloc(sz);
-			*end = 0x0;
-			char *rv = abi::__cxa_demangle(begin, fname, &sz, &status);
-			if (rv) fname = rv; // might have re-alloced
-			oss << fname << std::endl;
-			free(fname);
-		}
-#else
-		char * begin = strchr(syms[i], '(');
-		char * end = strchr(syms[i], '+');
-		if (!(begin && end) || end <= begin)
-		{
-			// Failed to pull apart the symbol names
-			oss << "\t" << i << ": " << syms[i] << "\n";
-		}
-		else
-		{
-			*begin = 0x0;
-			oss << "\t" << i << ": " << syms[i] << " ";
-			*begin = '(';
-			size_t sz = 250;
-			int status;
-			char *fname = (char *) malloc(sz);
-			*end = 0x0;
-			char *rv = abi::__cxa_demangle(begin+1, fname, &sz, &status);
-			*end = '+';
-			if (rv) fname = rv; // might have re-alloced
-			oss << "(" << fname << " " << end << std::endl;
-			free(fname);
-		}
-#endif
-	}
-	oss << std::endl;
-	free(syms);
+/// Capture the return addresses of the stack, leaving out this
+/// function and its caller. Turning them into names is slow, and is
+/// left to the writer thread, which also leaves out whatever other
+/// frames of the logger are on top; see LogWriter::symbolize().
+__attribute__ ((noinline))
+static uint32_t capture_backtrace(void** trace)
+{
+    int depth = ::backtrace(trace, LogRecord::MAX_FRAMES + 2);
+    return 2 < depth ? depth - 2 : 0;
 }
 #endif
 
 std::mutex Logger::_loggers_mtx;
 std::map<std::string, Logger::LogWriter*> Logger::_loggers;
 
+std::mutex Logger::_tree_mtx;
+
+std::mutex Logger::_sites_mtx;
+std::vector<Logger::SiteEntry> Logger::_sites;
+std::vector<Logger::SiteRule> Logger::_site_rules;
+
 Logger::~Logger()
 {
     // Do NOT destroy/delete the LogWriter; other logger instances
@@ -152,183 +99,22 @@ Logger::~Logger()
     _log_writer = nullptr;
 }
 
-Logger::LogWriter::LogWriter(void)
-{
-    writingLoopActive = false;
-#ifdef HAVE_VALGRIND
-    DRD_IGNORE_VAR(this->msg_queue);
-#endif
-    logfile = NULL;
-    pending_write = false;
-}
-
-Logger::LogWriter::~LogWriter()
-{
-    if (logfile == NULL) return;
-
-    // Remove the logfile from the list.
-    std::lock_guard<std::mutex> lock(_loggers_mtx);
-    _loggers.erase(fileName);
-
-    // Wait for queue to empty
-    flush();
-    stop_write_loop();
-    fflush(logfile);
-    fclose(logfile);
-    logfile = nullptr;
-}
-
-void Logger::LogWriter::start_write_loop()
-{
-    std::unique_lock<std::mutex> lock(the_mutex);
-    if (!writingLoopActive)
-        writer_thread = std::thread(&Logger::LogWriter::writing_loop, this);
-}
-
-void Logger::LogWriter::stop_write_loop()
-{
-    std::unique_lock<std::mutex> lock(the_mutex);
-    msg_queue.close();
-    // rejoin thread
-    writer_thread.join();
-}
-
-void Logger::LogWriter::writing_loop()
-{
-    set_thread_name("opencog:logger");
-
-    // When the thread exits, make sure that all pending messages have
-    // been written to the logfile. This code is here because the usual
-    // case is that the singleton logger() has continued to live on
-    // until program termination.  If it was ever used, a LogWriter
-    // thread was started (this thread), and the ~LogWriter() dtor
-    // never gets a chance to run before program exit. We cannot call
-    // ~LogWriter() in the shared library _fini() because, by then,
-    // other assorted globals may be gone, and, in particular, this
-    // thread might have been destructed already. So our one and only
-    // chance to flush the message queue is on thread exit, namely
-    // with the class below, whose dtor is called upon exit from scope.
-    class OnExit
-    {
-        public:
-            LogWriter* that;
-            ~OnExit()
-            {
-                // Try very very hard to make sure that the message
-                // queue has been completely drained.
-                while (not that->msg_queue.is_closed())
-                {
-                    std::string* msg = that->msg_queue.value_pop();
-                    that->write_msg(*msg);
-                    delete msg;
-                }
-                that->pending_write = false;
-                that->writingLoopActive = false;
-                fflush(that->logfile);
-                fclose(that->logfile);
-                that->logfile = nullptr;
-            }
-    };
-    thread_local OnExit exiter;
-    exiter.that = this;
-
-    writingLoopActive = true;
-    try
-    {
-        while (true)
-        {
-            // The pending_write flag prevents Logger::flush()
-            // from returning prematurely.
-            std::string* msg = msg_queue.value_pop();
-            pending_write = true;
-            write_msg(*msg);
-            pending_write = false;
-            delete msg;
-        }
-    }
-    catch (concurrent_queue< std::string* >::Canceled &e)
-    {
-    }
-    pending_write = false;
-    writingLoopActive = false;
-}
-
 void Logger::flush()
 {
+    if (_limiter) report_repeats();
     if (_log_writer) _log_writer->flush();
 }
 
-void Logger::LogWriter::flush()
-{
-    // There is a timing window between when pending_write is set,
-    // and the msg_queue being empty. We could fall through that
-    // window. Yes, its stupid, but too low-importance to fix.
-    // try to work around it by sleeping.
-    usleep(10);
-
-    // Perhaps we could do this with semaphores, but this is not
-    // really critical code, so a busy-wait is good enough.
-    size_t cnt = 0;
-    while (pending_write or not msg_queue.is_empty())
-    {
-        usleep(100);
-        cnt++;
-        if (0 == cnt%12123 and logfile) fdatasync(fileno(logfile));
-    }
-
-    // Force a write to the disk. Don't need to update metadata, though.
-    if (logfile) fdatasync(fileno(logfile));
-}
-
-void Logger::LogWriter::write_msg(const std::string &msg)
-{
-    std::unique_lock<std::mutex> lock(the_mutex);
-
-    // Delay opening the file until the first logging statement is issued;
-    // this allows us to set the main logger's filename without creating
-    // a useless log file with the default filename.
-    if (logfile == NULL)
-    {
-        if ((logfile = fopen(fileName.c_str(), "a")) == NULL)
-        {
-            fprintf(stderr, "[ERROR] Unable to open log file \"%s\"\n",
-                    fileName.c_str());
-            lock.unlock();
-            stop_write_loop();
-            return;
-        }
-    }
-
-    // Write to file.
-    int rc = fprintf(logfile, "%s", msg.c_str());
-    if ((int) msg.size() != rc)
-    {
-        fprintf(stderr,
-            "[ERROR] failed write to logfile, rc=%d sz=%zu\n",
-            rc, msg.size());
-        exit(1);
-    }
-
-    // Flush, because log messages are important, especially if we
-    // are about to crash. So we don't want to have these buffered up.
-    rc = fflush(logfile);
-    if (0 != rc)
-    {
-        int norr = errno;
-        fprintf(stderr,
-            "[ERROR] failed to flush logfile, rc=%d errno=%d %s\n",
-            rc, norr, strerror(norr));
-        exit(1);
-    }
-}
-
 Logger::Logger(const std::string &fname, Logger::Level level, bool tsEnabled)
     : error(*this), warn(*this), info(*this), debug(*this), fine(*this)
 {
     set_filename(fname);
 
-    this->currentLevel = level;
+    this->currentLevel.store(level, std::memory_order_relaxed);
+    this->levelSource.store(&currentLevel, std::memory_order_relaxed);
+    this->_parent = nullptr;
     this->backTraceLevel = ERROR;
+    this->recordLevel = NONE;
 
     this->timestampEnabled = tsEnabled;
     this->threadIdEnabled = false;
@@ -345,19 +131,26 @@ Logger::Logger(const std::string &fname, Logger::Level level, bool tsEnabled)
 Logger::Logger(const Logger& log)
     : error(*this), warn(*this), info(*this), debug(*this), fine(*this)
 {
+    // A copy writes to the same file, until told otherwise.
+    this->_log_writer = log._log_writer;
+    this->levelSource.store(&currentLevel, std::memory_order_relaxed);
+    this->_parent = nullptr;
     set(log);
 }
 
 Logger& Logger::operator=(const Logger& log)
 {
     this->set(log);
+    set_level(log.get_level());
     return *this;
 }
 
 void Logger::set(const Logger& log)
 {
     this->component.assign(log.component);
-    this->currentLevel = log.currentLevel;
+    this->componentTag.assign(log.componentTag);
+    this->currentLevel.store(log.get_level(), std::memory_order_relaxed);
+    this->recordLevel = log.recordLevel;
     this->printToStdout = log.printToStdout;
     this->printLevel = log.printLevel;
     this->backTraceLevel = log.backTraceLevel;
@@ -365,6 +158,7 @@ void Logger::set(const Logger& log)
     this->threadIdEnabled = log.threadIdEnabled;
     this->syncEnabled = log.syncEnabled;
     this->logEnabled = log.logEnabled;
+    this->_limiter = log._limiter;
 }
 
 // ***********************************************/
@@ -372,37 +166,70 @@ void Logger::set(const Logger& log)
 
 void Logger::set_level(Logger::Level newLevel)
 {
-    currentLevel = newLevel;
+    std::lock_guard<std::mutex> lock(_tree_mtx);
+    currentLevel.store(newLevel, std::memory_order_relaxed);
+    if (&currentLevel != levelSource.load(std::memory_order_relaxed))
+        inherit_from(&currentLevel);
 }
 
 Logger::Level Logger::get_level() const
 {
-    return currentLevel;
+    return level_now();
 }
 
-void Logger::set_backtrace_level(Logger::Level newLevel)
+/// Take the level from `src`, along with the children that inherit
+/// this logger's level; the tree lock must be held.
+void Logger::inherit_from(const std::atomic<Level>* src)
 {
-    backTraceLevel = newLevel;
+    levelSource.store(src, std::memory_order_relaxed);
+    for (auto& c : _children)
+        if (&c.second->currentLevel !=
+            c.second->levelSource.load(std::memory_order_relaxed))
+            c.second->inherit_from(src);
 }
 
-Logger::Level Logger::get_backtrace_level() const
+void Logger::inherit_level()
 {
-    return backTraceLevel;
+    std::lock_guard<std::mutex> lock(_tree_mtx);
+    if (nullptr == _parent) return;
+    inherit_from(_parent->levelSource.load(std::memory_order_relaxed));
 }
 
-void Logger::LogWriter::setFileName(const std::string& s)
+Logger& Logger::child(const std::string& name)
 {
-    fileName.assign(s);
+    std::lock_guard<std::mutex> lock(_tree_mtx);
+    Logger* node = this;
+    size_t start = 0;
+    while (start < name.size())
+    {
+        size_t dot = std::min(name.find('.', start), name.size());
+        std::string part(name, start, dot - start);
+        start = dot + 1;
+        if (part.empty()) continue;
 
-    std::unique_lock<std::mutex> lock(the_mutex);
-    if (logfile != NULL) {
-        flush();
-        fclose(logfile);
+        std::unique_ptr<Logger>& c = node->_children[part];
+        if (nullptr == c)
+        {
+            c.reset(new Logger(*node));
+            c->_parent = node;
+            c->levelSource.store(node->levelSource.load(
+                std::memory_order_relaxed), std::memory_order_relaxed);
+            c->set_component(node->component.empty() ?
+                             part : node->component + "." + part);
+        }
+        node = c.get();
     }
-    logfile = NULL;
+    return *node;
+}
+
+void Logger::set_backtrace_level(Logger::Level newLevel)
+{
+    backTraceLevel = newLevel;
+}
 
-    lock.unlock();
-    start_write_loop();
+Logger::Level Logger::get_backtrace_level() const
+{
+    return backTraceLevel;
 }
 
 void Logger::set_filename(const std::string& fname)
@@ -433,6 +260,7 @@ const std::string& Logger::get_filename() const
 void Logger::set_component(const std::string& c)
 {
     component = c;
+    componentTag = c.empty() ? "" : "[" + c + "] ";
 }
 
 const std::string& Logger::get_component() const
@@ -475,6 +303,227 @@ void Logger::set_sync_flag(bool flag)
     syncEnabled = flag;
 }
 
+void Logger::set_durability(Durability d, unsigned group_msec,
+                            size_t group_bytes)
+{
+    if (_log_writer) _log_writer->set_durability(d, group_msec, group_bytes);
+}
+
+void Logger::set_backpressure(Backpressure bp, size_t capacity)
+{
+    if (_log_writer) _log_writer->set_backpressure(bp, capacity);
+}
+
+void Logger::add_stdout_sink(Level max_level, bool use_stderr)
+{
+    if (_log_writer)
+        _log_writer->add_sink(std::make_shared<StreamSink>(
+                                  use_stderr ? stderr : stdout), max_level);
+}
+
+void Logger::add_memory_sink(size_t max_bytes, Level max_level)
+{
+    if (_log_writer)
+        _log_writer->add_sink(std::make_shared<MemorySink>(max_bytes),
+                              max_level);
+}
+
+bool Logger::add_socket_sink(const std::string& path, Level max_level)
+{
+    if (nullptr == _log_writer) return false;
+    auto sink = std::make_shared<SocketSink>(path);
+    _log_writer->add_sink(sink, max_level);
+    return sink->is_open();
+}
+
+void Logger::remove_sinks()
+{
+    if (_log_writer) _log_writer->clear_sinks();
+}
+
+std::string Logger::get_memory_log()
+{
+    if (nullptr == _log_writer) return "";
+
+    // Whatever was logged so far has to get there first.
+    std::shared_ptr<MemorySink> sink(_log_writer->get_memory_sink());
+    if (nullptr == sink) return "";
+    _log_writer->flush();
+    return sink->contents();
+}
+
+void Logger::set_flight_recorder(size_t max_bytes, Level record_level)
+{
+    if (nullptr == _log_writer) return;
+    _log_writer->set_recorder(max_bytes);
+    recordLevel = (0 < max_bytes) ? record_level : NONE;
+}
+
+void Logger::dump_flight_recorder()
+{
+    if (_log_writer) _log_writer->dump_recorder();
+}
+
+void Logger::set_file_level(Level max_level)
+{
+    if (_log_writer) _log_writer->set_file_level(max_level);
+}
+
+void Logger::set_write_batch(size_t max_msgs, unsigned max_wait_usec)
+{
+    if (_log_writer) _log_writer->set_batch(max_msgs, max_wait_usec);
+}
+
+Logger::Stats Logger::get_stats() const
+{
+    if (nullptr == _log_writer) return Stats();
+    return _log_writer->get_stats();
+}
+
+void Logger::set_stats_interval(unsigned secs)
+{
+    if (_log_writer) _log_writer->set_stats_interval(secs);
+}
+
+void Logger::set_binary_flag(bool flag)
+{
+    if (_log_writer) _log_writer->set_binary(flag);
+}
+
+void Logger::set_mmap_segments(size_t segment_size, unsigned msync_msec)
+{
+    if (_log_writer) _log_writer->set_mmap(segment_size, msync_msec);
+}
+
+void Logger::set_rotation(size_t max_bytes, unsigned max_seconds,
+                          unsigned keep, bool compress)
+{
+    if (nullptr == _log_writer) return;
+    LogRotation rotation;
+    rotation.max_bytes = max_bytes;
+    rotation.max_seconds = max_seconds;
+    rotation.keep = keep;
+    rotation.compress = compress;
+    _log_writer->set_rotation(rotation);
+}
+
+void Logger::set_io_uring(unsigned depth, size_t buffer_size)
+{
+    if (_log_writer) _log_writer->set_io_uring(depth, buffer_size);
+}
+
+void Logger::set_lanes(unsigned lanes)
+{
+    if (_log_writer) _log_writer->set_lanes(lanes);
+}
+
+void Logger::set_rate_limit(double msgs_per_sec, unsigned burst)
+{
+    if (nullptr == _limiter) _limiter = std::make_shared<LogLimiter>();
+    _limiter->set_rate(msgs_per_sec, burst);
+    if (not _limiter->rate_limited() and not _limiter->collapsing())
+        _limiter = nullptr;
+}
+
+void Logger::set_collapse_repeats(bool flag)
+{
+    if (nullptr == _limiter) _limiter = std::make_shared<LogLimiter>();
+    else report_repeats();
+    _limiter->set_collapse(flag);
+    if (not _limiter->rate_limited() and not _limiter->collapsing())
+        _limiter = nullptr;
+}
+
+// ***********************************************/
+// Call sites
+
+/// A file name matches the end of the path, at a slash.
+bool Logger::matches(const SiteRule& r, const SiteEntry& e)
+{
+    if (not r.file.empty())
+    {
+        std::string_view path(e.site->file);
+        if (path.size() < r.file.size() or
+            path.substr(path.size() - r.file.size()) != r.file)
+            return false;
+        if (path.size() > r.file.size() and
+            '/' != path[path.size() - r.file.size() - 1])
+            return false;
+        if (0 < r.line and r.line != e.site->line)
+            return false;
+        return true;
+    }
+    return r.component == e.component;
+}
+
+/// Set the mode of the matching sites; the lock must be held.
+unsigned Logger::apply(const SiteRule& r)
+{
+    unsigned n = 0;
+    for (const SiteEntry& e : _sites)
+    {
+        if (not matches(r, e)) continue;
+        e.site->mode.store(r.mode, std::memory_order_relaxed);
+        n++;
+    }
+    return n;
+}
+
+void Logger::enroll(Site& site) const
+{
+    std::lock_guard<std::mutex> lock(_sites_mtx);
+    if (Site::UNSEEN != site.mode.load(std::memory_order_relaxed))
+        return;
+
+    _sites.push_back(SiteEntry{&site, component});
+    uint8_t mode = SITE_DEFAULT;
+    for (const SiteRule& r : _site_rules)
+        if (matches(r, _sites.back())) mode = r.mode;
+    site.mode.store(mode, std::memory_order_relaxed);
+}
+
+unsigned Logger::set_site_mode(SiteMode mode, const std::string& file,
+                               unsigned line)
+{
+    if (file.empty()) return 0;
+    std::lock_guard<std::mutex> lock(_sites_mtx);
+    _site_rules.push_back(SiteRule{mode, file, line, ""});
+    return apply(_site_rules.back());
+}
+
+unsigned Logger::set_component_site_mode(SiteMode mode,
+                                         const std::string& comp)
+{
+    std::lock_guard<std::mutex> lock(_sites_mtx);
+    _site_rules.push_back(SiteRule{mode, "", 0, comp});
+    return apply(_site_rules.back());
+}
+
+void Logger::reset_sites()
+{
+    std::lock_guard<std::mutex> lock(_sites_mtx);
+    _site_rules.clear();
+    for (const SiteEntry& e : _sites)
+        e.site->mode.store(SITE_DEFAULT, std::memory_order_relaxed);
+}
+
+std::string Logger::get_sites()
+{
+    static const char* modes[] = { "default", "on", "off" };
+    std::string out;
+    std::lock_guard<std::mutex> lock(_sites_mtx);
+    for (const SiteEntry& e : _sites)
+    {
+        out += e.site->file;
+        out += ':' + std::to_string(e.site->line) + " [";
+        out += get_level_string(e.site->level);
+        out += "] [" + e.component + "] ";
+        out += modes[e.site->mode.load(std::memory_order_relaxed)];
+        out += '\n';
+    }
+    return out;
+}
+
 void Logger::set_print_error_level_stdout()
 {
     set_print_to_stdout_flag(true);
@@ -491,105 +540,487 @@ void Logger::disable()
     logEnabled = false;
 }
 
-void Logger::log(Logger::Level level, const std::string &txt)
+/// Write the "[YYYY-MM-DD HH:MM:SS:mmm] " timestamp into buf, and
+/// return its length. Messages logged within the same second differ
+/// only in the milliseconds, so everything else is formatted once per
+/// second (per thread), and merely copied for the other messages.
+#define TIMESTAMP_BUFSZ 64
+static size_t format_timestamp(char* buf)
 {
-    static const unsigned int max_queue_size_allowed = 1024;
-    // Don't log if not enabled, or level is too low.
-    if (!logEnabled) return;
-    if (level > currentLevel) return;
-    if (nullptr == _log_writer) return;
+    struct StampCache
+    {
+        time_t sec = -1;
+        size_t len = 0;
+        char text[TIMESTAMP_BUFSZ];
+    };
+    thread_local StampCache cache;
 
-    std::ostringstream oss;
-    if (timestampEnabled)
+    struct timeval stv;
+    ::gettimeofday(&stv, NULL);
+    if (stv.tv_sec != cache.sec)
     {
-        struct timeval stv;
         struct tm stm;
-        char timestamp[64];
-        char timestampStr[256];
-
-
-        ::gettimeofday(&stv, NULL);
         time_t t = stv.tv_sec;
         gmtime_r(&t, &stm);
-        strftime(timestamp, sizeof(timestamp), "%F %T", &stm);
-        snprintf(timestampStr, sizeof(timestampStr),
-                "[%s:%03ld] ",timestamp, (long)stv.tv_usec / 1000);
-        oss << timestampStr;
+        cache.len = strftime(cache.text, sizeof(cache.text), "[%F %T:", &stm);
+        cache.sec = stv.tv_sec;
     }
 
+    memcpy(buf, cache.text, cache.len);
+    char* p = buf + cache.len;
+    long ms = (long) stv.tv_usec / 1000;
+    p[0] = '0' + ms / 100;
+    p[1] = '0' + (ms / 10) % 10;
+    p[2] = '0' + ms % 10;
+    p[3] = ']';
+    p[4] = ' ';
+    return cache.len + 5;
+}
+
+/// The "[thread-N] " prefix for the calling thread; "[thread-N:name] "
+/// once it has been named with set_thread_name(). It is rebuilt only
+/// when the name changes. The cache is a plain char buffer, so that
+/// it is still there while the thread exits.
+static std::string_view thread_id_prefix()
+{
+    struct PrefixCache
+    {
+        unsigned changes;
+        size_t len;
+        char text[64];
+    };
+    thread_local PrefixCache cache;
+
+    unsigned changes = thread_name_changes();
+    if (0 == cache.len or changes != cache.changes)
+    {
+        const char* name = get_thread_name();
+        int n = snprintf(cache.text, sizeof(cache.text), "[thread-%lu%s%s] ",
+                         (unsigned long) pthread_self(),
+                         *name ? ":" : "", name);
+        cache.len = std::min((size_t) n, sizeof(cache.text) - 1);
+        cache.changes = changes;
+    }
+    return std::string_view(cache.text, cache.len);
+}
+
+/// Fill in the pieces of the message header: timestamp, level,
+/// component and thread. All of them are precomputed; only the
+/// timestamp needs any work, and it goes into `stamp`.
+size_t Logger::header_parts(Level level, std::string_view* parts,
+                            char* stamp) const
+{
+    size_t np = 0;
+    if (timestampEnabled)
+        parts[np++] = std::string_view(stamp, format_timestamp(stamp));
+
     if (printLevel)
-        oss << "[" << get_level_string(level) << "] ";
+        parts[np++] = (level <= FINE) ? levelTags[level] : "[Bad level] ";
 
     if (!component.empty())
-        oss << "[" << component << "] ";
+        parts[np++] = componentTag;
 
     if (threadIdEnabled)
-        oss << "[thread-" << std::this_thread::get_id() << "] ";
+        parts[np++] = thread_id_prefix();
+
+    return np;
+}
+
+// ***********************************************/
+// Stream buffers for Logger::Base
+
+namespace {
+
+/// An ostream that appends to a string, which is reused (capacity and
+/// all) from one message to the next.
+class LogStream : public std::ostream
+{
+    class Buf : public std::streambuf
+    {
+    public:
+        std::string text;
+    protected:
+        int_type overflow(int_type c) override
+        {
+            if (not traits_type::eq_int_type(c, traits_type::eof()))
+                text.push_back(traits_type::to_char_type(c));
+            return traits_type::not_eof(c);
+        }
+        std::streamsize xsputn(const char* p, std::streamsize n) override
+        {
+            text.append(p, n);
+            return n;
+        }
+    };
+    Buf _buf;
+
+public:
+    // Enough for most messages, so that even a fresh stream usually
+    // doesn't have to grow.
+    static constexpr size_t INITIAL_CAPACITY = 256;
+
+    LogStream() : std::ostream(nullptr)
+    {
+        rdbuf(&_buf);
+        _buf.text.reserve(INITIAL_CAPACITY);
+    }
+
+    const std::string& text() const { return _buf.text; }
+
+    /// Forget the text, and any formatting left behind by the caller.
+    void reset()
+    {
+        _buf.text.clear();
+        clear();
+        flags(std::ios_base::dec | std::ios_base::skipws);
+        precision(6);
+        width(0);
+        fill(' ');
+    }
+};
+
+/// Idle streams of the current thread. A Base usually needs one at a
+/// time; a few more cover messages built while another is being built.
+/// This is trivially destructible, so it can still be looked at while
+/// the thread (or the program) exits, after the streams are deleted.
+struct StreamPool
+{
+    static constexpr int MAX_IDLE = 4;
+    LogStream* idle[MAX_IDLE];
+    int nidle;
+    bool dead;
+};
+thread_local StreamPool t_streams;
+
+struct StreamPoolCleanup
+{
+    ~StreamPoolCleanup()
+    {
+        while (0 < t_streams.nidle) delete t_streams.idle[--t_streams.nidle];
+        t_streams.dead = true;
+    }
+    void touch() {}
+};
+thread_local StreamPoolCleanup t_streams_cleanup;
 
-    oss << txt << std::endl;
+} // anonymous namespace
 
+void Logger::Base::acquire()
+{
+    if (0 < t_streams.nidle)
+    {
+        os = t_streams.idle[--t_streams.nidle];
+        return;
+    }
+    if (not t_streams.dead) t_streams_cleanup.touch();
+    os = new LogStream();
+}
+
+/// Log the message, and give the stream back to the pool of the
+/// current thread; that need not be the one it came from.
+void Logger::Base::release()
+{
+    LogStream* ls = static_cast<LogStream*>(os);
+    os = nullptr;
+    // A LAZY_LOG_* statement was checked against the rate limit
+    // already. Any other is told apart by where this returns to, i.e.
+    // the end of the statement.
+    if (ls->text().empty()) {}
+    else if (forced) logger.log_forced(lvl, ls->text());
+    else if (limited) logger.log_text(lvl, ls->text());
+    else logger.log_text(lvl, ls->text(), __builtin_return_address(0));
+
+    ls->reset();
+    if (not t_streams.dead and t_streams.nidle < StreamPool::MAX_IDLE)
+        t_streams.idle[t_streams.nidle++] = ls;
+    else
+        delete ls;
+}
+
+void Logger::log(Logger::Level level, const std::string &txt)
+{
+    log_text(level, txt);
+}
+
+void Logger::log_text(Logger::Level level, std::string_view txt,
+                      const void* site)
+{
+    // Don't log if not enabled, or level is too low.
+    if (!logEnabled) return;
+    Level cur = level_now();
+    if (level > cur and level > recordLevel) return;
+    if (nullptr == _log_writer) return;
+
+    if (_limiter and level <= cur)
+    {
+        size_t hash = std::hash<std::string_view>()(txt);
+        if (not admit(level, hash ? hash : 1, site, txt)) return;
+    }
+    write(level, txt, true);
+}
+
+void Logger::log_forced(Logger::Level level, const std::string &txt)
+{
+    if (!logEnabled or nullptr == _log_writer) return;
+    if (_limiter)
+    {
+        size_t hash = std::hash<std::string>()(txt);
+        if (not admit(level, hash ? hash : 1)) return;
+    }
+    write(level, txt, true, true);
+}
+
+bool Logger::admit(Level level, size_t hash, const void* site,
+                   std::string_view what)
+{
+    unsigned n = 0;
+    Level rlevel = level;
+    if (hash and not _limiter->check_repeat(level, hash, n, rlevel))
+        return false;
+    if (0 < n)
+        write(rlevel, "Last message repeated " + std::to_string(n) +
+                      " times", false);
+
+    if (nullptr == site) return true;
+    if (not _limiter->take_token(site, n))
+        return false;
+    if (0 < n)
+    {
+        std::string like(what.substr(0, 80));
+        if (like.size() < what.size()) like += "...";
+        write(level, "Rate limit: dropped " + std::to_string(n) +
+                     " messages like \"" + like + "\"", false);
+    }
+    return true;
+}
+
+bool Logger::admit(const Site& s)
+{
+    if (not _limiter->rate_limited()) return true;
+
+    // Messages that only go to the flight recorder are not limited.
+    if (s.level > level_now() and not s.forced()) return true;
+
+    unsigned n;
+    if (not _limiter->take_token(&s, n)) return false;
+    if (0 < n)
+        write(s.level, "Rate limit: dropped " + std::to_string(n) +
+                       " messages from " + s.file + ":" +
+                       std::to_string(s.line), false);
+    return true;
+}
+
+void Logger::report_repeats()
+{
+    if (nullptr == _log_writer) return;
+    for (const auto& [n, rlevel] : _limiter->take_repeats())
+        write(rlevel, "Last message repeated " + std::to_string(n) +
+                      " times", false);
+}
+
+void Logger::write(Level level, std::string_view txt, bool with_backtrace,
+                   bool forced)
+{
+    // The message is handed to the writer as a list of pieces, which
+    // get copied straight into this thread's ring. Nothing on this
+    // path allocates.
+    std::string_view parts[8];
+    char stamp[TIMESTAMP_BUFSZ];
+    size_t np = header_parts(level, parts, stamp);
+
+    parts[np++] = txt;
+    parts[np++] = "\n";
+
+    // Messages above the log level go to the flight recorder only.
+    LogWriter* lw = _log_writer->lane();
+    if (level > level_now() and not forced)
+    {
+        lw->qmsg(level, parts, np, false, LogRecord::RECORD);
+        return;
+    }
+
+    uint8_t flags = printToStdout ? LogRecord::ECHO : 0;
+    if (level <= backTraceLevel) flags |= LogRecord::DUMP_FIRST;
+
+    // The stack goes along as raw addresses, followed by their number.
 #if defined(HAVE_GNU_BACKTRACE)
-    if (level <= backTraceLevel)
+    void* trace[LogRecord::MAX_FRAMES + 2];
+    uint32_t depth;
+    if (with_backtrace and level <= backTraceLevel)
     {
-        prt_backtrace(oss);
+        depth = capture_backtrace(trace);
+        parts[np++] = std::string_view((const char*) (trace + 2),
+                                       depth * sizeof(void*));
+        parts[np++] = std::string_view((const char*) &depth, sizeof(depth));
+        flags |= LogRecord::TRACE;
     }
 #endif
 
-    _log_writer->qmsg(oss.str());
-
-    // If the queue gets too full, block until it's flushed to
-    // file. This can sometimes happen, if some component is spewing
-    // lots of debugging messages in a tight loop.
-    if (_log_writer->size() > max_queue_size_allowed) flush();
+    // If this thread's ring is full, what happens depends on the
+    // backpressure policy; by default, this blocks until the writer
+    // thread has caught up. This can sometimes happen, if some
+    // component is spewing lots of debugging messages in a tight loop.
+    // Messages that must reach the disk are never dropped.
+    // Printing to stdout is left to the writer thread, too, as is
+    // dumping the flight recorder ahead of an error.
+    bool wait = level <= backTraceLevel or syncEnabled;
+    uint64_t seq = lw->qmsg(level, parts, np, wait, flags);
 
     // Errors are associated with imminent crashes. Make sure that the
     // stack trace is written to disk *before* the crash happens! Yes,
     // this introduces latency and lag. Tough. Don't generate errors.
-    if (level <= backTraceLevel) flush();
+    // Only this message (and those before it) need to be waited for;
+    // not whatever other threads logged in the meantime.
+    if ((level <= backTraceLevel or syncEnabled) and UINT64_MAX != seq)
+        lw->sync();
+}
+
+bool Logger::begin_deferred(Deferred& d, Level level, size_t args_len,
+                            logfmt::FormatFn fn, const char* fmt,
+                            const char* sig)
+{
+    d.writer = _log_writer->lane();
+    if (d.writer->is_binary())
+    {
+        // Nothing gets formatted at all; just the raw header fields.
+        size_t comp_len = componentTag.size();
+        d.len = sizeof(BinaryMsg) + comp_len + args_len;
+        if (LogRing::MAX_INLINE < d.len) return false;
+
+        LogRing* ring;
+        BinaryMsg* bm = reinterpret_cast<BinaryMsg*>(
+            d.writer->reserve(ring, d.len, syncEnabled));
+        d.ring = ring;
+
+        // Dropped; see set_backpressure().
+        if (nullptr == bm)
+        {
+            d.ring = nullptr;
+            return true;
+        }
+        bm->format = fn;
+        bm->fmt = fmt;
+        bm->sig = sig;
+        bm->flags = 0;
+        bm->stamp = 0;
+        if (timestampEnabled)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            bm->stamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            bm->flags |= logbin::TIMESTAMP;
+        }
+        if (printLevel) bm->flags |= logbin::LEVEL;
+        if (threadIdEnabled) bm->flags |= logbin::THREAD;
+        bm->thread = (uint64_t) pthread_self();
+        bm->args_len = args_len;
+        bm->comp_len = comp_len;
+        memcpy(bm->component(), componentTag.data(), comp_len);
+
+        d.args = bm->args();
+        d.kind = LogRecord::BINARY;
+        return true;
+    }
+
+    std::string_view parts[4];
+    char stamp[TIMESTAMP_BUFSZ];
+    size_t np = header_parts(level, parts, stamp);
 
-    if (syncEnabled) flush();
+    size_t prefix_len = 0;
+    for (size_t i = 0; i < np; i++) prefix_len += parts[i].size();
 
-    // Write to stdout.
-    if (printToStdout)
+    // Big messages take the ordinary path.
+    d.len = sizeof(DeferredMsg) + prefix_len + args_len;
+    if (LogRing::MAX_INLINE < d.len) return false;
+
+    LogRing* ring;
+    DeferredMsg* dm = reinterpret_cast<DeferredMsg*>(
+        d.writer->reserve(ring, d.len, syncEnabled));
+    d.ring = ring;
+
+    // Dropped; see set_backpressure().
+    if (nullptr == dm)
+    {
+        d.ring = nullptr;
+        return true;
+    }
+    dm->format = fn;
+    dm->fmt = fmt;
+    dm->prefix_len = prefix_len;
+    dm->args_len = args_len;
+
+    char* p = dm->prefix();
+    for (size_t i = 0; i < np; i++)
+    {
+        memcpy(p, parts[i].data(), parts[i].size());
+        p += parts[i].size();
+    }
+
+    d.args = p;
+    d.kind = LogRecord::DEFERRED;
+    return true;
+}
+
+void Logger::end_deferred(Deferred& d, Level level)
+{
+    if (level > level_now())
     {
-        std::cout << oss.str();
-        std::cout.flush();
+        d.writer->commit((LogRing*) d.ring, (LogRecord::Kind) d.kind,
+                         level, d.len, LogRecord::RECORD);
+        return;
     }
+    uint64_t seq = d.writer->commit((LogRing*) d.ring,
+                                    (LogRecord::Kind) d.kind, level, d.len,
+                                    printToStdout ? LogRecord::ECHO : 0);
+    if (syncEnabled and UINT64_MAX != seq) d.writer->sync();
 }
 
 void Logger::backtrace()
 {
     if (nullptr == _log_writer) return;
 
-    static const unsigned int max_queue_size_allowed = 1024;
-    std::ostringstream oss;
-
     #if defined(HAVE_GNU_BACKTRACE)
-    prt_backtrace(oss);
+    void* trace[LogRecord::MAX_FRAMES + 2];
+    uint32_t depth = capture_backtrace(trace);
+    std::string_view parts[2] = {
+        std::string_view((const char*) (trace + 2), depth * sizeof(void*)),
+        std::string_view((const char*) &depth, sizeof(depth)) };
+    _log_writer->lane()->qmsg(NONE, parts, 2, false, LogRecord::TRACE);
     #endif
-
-    _log_writer->qmsg(oss.str());
-
-    // If the queue gets too full, block until it's flushed to file or
-    // stdout. This can sometimes happen, if some component is spewing
-    // lots of debugging messages in a tight loop.
-    if (_log_writer->size() > max_queue_size_allowed) {
-        flush();
-    }
 }
 
+/// Longest message, with its terminating null, that logva() formats
+/// without allocating.
+#define LOGVA_BUFSZ 4096
 void Logger::logva(Logger::Level level, const char *fmt, va_list args)
 {
-    if (level <= currentLevel) {
+    Level cur = level_now();
+    if (level <= cur or level <= recordLevel) {
+        // Rate limits are checked before formatting; repeats can only
+        // be spotted after.
+        if (_limiter and level <= cur and
+            not admit(level, 0, fmt, fmt)) return;
+
+        // Most messages fit in this thread's scratch buffer, and cost
+        // no allocation. It is trivially destructible, so it is still
+        // there while the thread exits. Only longer messages get
+        // formatted a second time, into a string of the right size.
+        thread_local char t_scratch[LOGVA_BUFSZ];
         va_list args_copy;
         va_copy(args_copy, args);
-        int needed = vsnprintf(nullptr, 0, fmt, args_copy);
+        int needed = vsnprintf(t_scratch, sizeof(t_scratch), fmt, args_copy);
         va_end(args_copy);
+        if (needed < 0) return;
 
+        if ((size_t) needed < sizeof(t_scratch))
+        {
+            log_text(level, std::string_view(t_scratch, needed));
+            return;
+        }
         std::string buffer(needed + 1, '\0');
         vsnprintf(&buffer[0], buffer.size(), fmt, args);
         buffer.resize(needed);
-        log(level, buffer);
+        log_text(level, buffer);
     }
 }
 
@@ -27,20 +27,36 @@
 #ifndef _OPENCOG_LOGGER_H
 #define _OPENCOG_LOGGER_H
 
+#include <atomic>
 #include <cstdarg>
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <vector>
 
 #include <opencog/util/concurrent_queue.h>
+#include <opencog/util/LogFormat.h>
 
 // Some systems try to define DEBUG, which interferes with the below.
 #ifdef DEBUG
 #undef DEBUG
 #endif
 
+// The least severe level that is compiled in at all, as a number:
+// 0 NONE, 1 ERROR, 2 WARN, 3 INFO, 4 DEBUG, 5 FINE. Messages above it
+// that are logged with the LAZY_LOG_* macros, or with logf() and the
+// fmt() methods, compile down to nothing, whatever the log level is
+// at run time. Define it when building the code that does the logging,
+// e.g. -DCOGUTIL_LOG_MIN_LEVEL=3 to strip out DEBUG and FINE messages.
+#ifndef COGUTIL_LOG_MIN_LEVEL
+#define COGUTIL_LOG_MIN_LEVEL 5
+#endif
+
 namespace opencog
 {
 /** \addtogroup grp_cogutil
@@ -55,6 +71,24 @@ public:
 
     enum Level { NONE, ERROR, WARN, INFO, DEBUG, FINE, BAD_LEVEL=255 };
 
+    /**
+     * How hard the writer tries to get messages onto the disk; see
+     * set_durability().
+     */
+    enum Durability { SYNC_NONE, SYNC_BATCH, SYNC_GROUP };
+
+    /**
+     * What to do with a message when the log queue is full; see
+     * set_backpressure().
+     */
+    enum Backpressure { QUEUE_BLOCK, QUEUE_DROP_NEWEST,
+                        QUEUE_DROP_OLDEST, QUEUE_SPILL };
+
+    /**
+     * Whether a LAZY_LOG_* statement logs; see set_site_mode().
+     */
+    enum SiteMode { SITE_DEFAULT, SITE_ON, SITE_OFF };
+
     /**
      * Convert from string to enum (ignoring case), and vice-versa.
      */
@@ -100,6 +134,26 @@ public:
      */
     Level get_level() const;
 
+    /**
+     * The child logger of the given name, created if need be. Names
+     * are dotted paths: "atomspace.storage.rocks" is a child of
+     * "atomspace.storage", which is a child of "atomspace", which is a
+     * child of this logger. A child writes to the same file as its
+     * parent, with its full dotted name as its component, and starts
+     * out with the parent's settings. Its log level is that of its
+     * parent, until set_level() is called on it; then that level is
+     * its own, and its children's, until inherit_level() is called.
+     * A new level takes effect at once in every logger that inherits
+     * it. Children live as long as their parent, so a reference to
+     * one can be kept, e.g. in a static:
+     *
+     * static Logger& log = logger().child("atomspace.storage.rocks");
+     */
+    Logger& child(const std::string& name);
+
+    /** Go back to the log level of the parent, if there is one. */
+    void inherit_level();
+
     /**
      * Set the level of messages which should be logged with back trace.
      * Every message with log-level lower than or equals to the given argument
@@ -140,7 +194,10 @@ public:
     void set_timestamp_flag(bool);
 
     /**
-     * If set, log messages are prefixed with a thread id.
+     * If set, log messages are prefixed with a thread id, and with the
+     * thread's name, if it was given one with set_thread_name(). (In
+     * binary mode, messages logged with logf() or fmt() carry only
+     * the id.)
      */
     void set_thread_id_flag(bool);
 
@@ -150,7 +207,9 @@ public:
     bool get_thread_id_flag() const;
 
     /**
-     * If set, log messages are printed to the stdout.
+     * If set, log messages are printed to the stdout, as well as being
+     * written to the log file. The printing is done by the writer
+     * thread, not by the caller.
      */
     void set_print_to_stdout_flag(bool);
 
@@ -174,6 +233,311 @@ public:
      */
     void set_sync_flag(bool);
 
+    /**
+     * Set the durability policy, which decides what happens when a
+     * message must reach the disk: on flush(), for messages at or
+     * below the backtrace level (i.e. errors), and for every message
+     * if the sync flag is set.
+     *
+     * SYNC_NONE: the disk is never synced. flush() and friends wait
+     *     only until the messages have been handed to the kernel.
+     * SYNC_BATCH: each batch is handed to the kernel as soon as it is
+     *     gathered; a message that must reach the disk is synced by
+     *     the caller, right away. This is the default.
+     * SYNC_GROUP: the writer thread syncs the disk every `group_msec`
+     *     milliseconds, or every `group_bytes` bytes, whichever comes
+     *     first. A message that must reach the disk waits for the
+     *     next group commit, and asks for it to happen now; callers
+     *     that wait at the same time share one disk sync.
+     *
+     * This setting is shared by all loggers that write to the same
+     * file.
+     */
+    void set_durability(Durability, unsigned group_msec = 10,
+                        size_t group_bytes = 1 << 20);
+
+    /**
+     * Decide what happens when a thread logs faster than the writer
+     * thread can keep up with. Each thread queues its messages in a
+     * buffer of `capacity` bytes (rounded up to a power of two, and
+     * to at least 64KB); once that is full:
+     *
+     * QUEUE_BLOCK: the thread waits for the writer to catch up. No
+     *     message is ever lost. This is the default.
+     * QUEUE_DROP_NEWEST: the message is dropped.
+     * QUEUE_SPILL: the message is copied to the heap, into an
+     *     overflow queue of up to `capacity` more bytes; once that is
+     *     full too, the thread waits.
+     * QUEUE_DROP_OLDEST: like QUEUE_SPILL, but once the overflow
+     *     queue is full, the oldest messages in it are dropped to
+     *     make room, instead of waiting.
+     *
+     * Either way, messages keep their order, and the writer notes
+     * in the log how many were dropped. Errors that get a backtrace,
+     * and all messages when the sync flag is set, are never dropped
+     * or spilled. This setting is shared by all loggers that write
+     * to the same file.
+     */
+    void set_backpressure(Backpressure, size_t capacity = 1 << 16);
+
+    /**
+     * Send the log to more places than just the log file. Each place
+     * (sink) gets the messages at `max_level` and below, from every
+     * logger writing to the same file; and, like the file, all of
+     * them are written by the writer thread, so a message costs the
+     * caller the same, no matter how many sinks there are. Only
+     * messages that pass the logger's own level get to any sink.
+     *
+     * add_stdout_sink() prints to stdout, or to stderr.
+     * add_memory_sink() keeps the most recent messages, up to
+     *     `max_bytes` of them, in memory; get_memory_log() returns
+     *     them.
+     * add_socket_sink() sends each message to a Unix-domain socket,
+     *     such as that of a log collector. Returns false if the
+     *     socket could not be connected to; it is then retried
+     *     every so often.
+     *
+     * These settings are shared by all loggers that write to the same
+     * file.
+     */
+    void add_stdout_sink(Level max_level = FINE, bool use_stderr = false);
+    void add_memory_sink(size_t max_bytes = 1 << 20, Level max_level = FINE);
+    bool add_socket_sink(const std::string& path, Level max_level = FINE);
+    void remove_sinks();
+    std::string get_memory_log();
+
+    /**
+     * Write only the messages at `max_level` and below to the log
+     * file itself. Unlike set_level(), this leaves the other sinks
+     * alone; e.g. the file can have everything, and stdout just the
+     * errors, or the other way around.
+     */
+    void set_file_level(Level max_level);
+
+    /**
+     * Keep the messages that are not logged, because they are above
+     * the log level, in an in-memory flight recorder, instead of just
+     * throwing them away; messages up to `record_level` are kept, and
+     * the most recent `max_bytes` of them. Recording costs the caller
+     * about what logging does; nothing is written to disk until the
+     * recorder is dumped into the log file, which happens
+     *
+     * - just before a message at or below the backtrace level (i.e.
+     *   an error) is logged;
+     * - on a fatal signal (SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT),
+     *   from the signal handler, before the signal is passed on; this
+     *   dump goes to a file of its own, the log file name plus
+     *   ".crash", and is taken on a separate stack, so that a stack
+     *   overflow can be dumped too;
+     * - when dump_flight_recorder() is called.
+     *
+     * Each dump holds what was recorded since the one before. This
+     * gives DEBUG or FINE detail for a post-mortem, while logging at
+     * INFO. Messages skipped by the LAZY_LOG_* macros are not seen,
+     * and so not recorded. The recorder itself is shared by all
+     * loggers that write to the same file; the record level is not.
+     * Zero bytes turns the recorder off.
+     */
+    void set_flight_recorder(size_t max_bytes, Level record_level = FINE);
+    void dump_flight_recorder();
+
+    /**
+     * Tune how the writer thread batches messages. Up to `max_msgs`
+     * queued messages (at most 1024) are written out with a single
+     * system call. If `max_wait_usec` is non-zero, the writer waits
+     * up to that long for a partial batch to fill; the default is to
+     * not wait at all, so that messages reach the file just as soon
+     * as before. This setting is shared by all loggers that write to
+     * the same file.
+     */
+    void set_write_batch(size_t max_msgs, unsigned max_wait_usec = 0);
+
+    /**
+     * What the writer for the log file has been doing. The counts are
+     * for all loggers that write to the same file, since it was first
+     * opened. Messages kept only in the flight recorder are counted
+     * as enqueued, but not as written.
+     */
+    struct Stats
+    {
+        uint64_t msgs_enqueued = 0;    // messages handed to the writer
+        uint64_t bytes_enqueued = 0;
+        uint64_t msgs_written = 0;     // messages written to the file
+        uint64_t bytes_written = 0;
+        uint64_t queue_depth = 0;      // messages not yet written
+        uint64_t max_queue_depth = 0;
+        uint64_t queue_full_waits = 0; // callers that waited for room
+        uint64_t syncs = 0;            // callers that waited for the disk:
+                                       // flush(), errors, the sync flag
+        uint64_t wait_usec = 0;        // time callers spent in either wait
+        uint64_t writes = 0;           // batches written to the file
+        uint64_t write_usec = 0;       // time spent writing them
+        uint64_t max_write_usec = 0;
+    };
+    Stats get_stats() const;
+
+    /**
+     * Log the stats, at INFO, every `secs` seconds, as long as there
+     * is something being logged; or never, if zero (the default).
+     * This setting is shared by all loggers that write to the same
+     * file.
+     */
+    void set_stats_interval(unsigned secs);
+
+    /**
+     * If set, the log file is written in a compact binary format.
+     * Messages logged with logf() (or the fmt() methods) are then not
+     * formatted at all: only a call-site id, a timestamp and the raw
+     * arguments get written. Use the cogutil-logdecode tool to turn
+     * the file back into text. This setting is shared by all loggers
+     * that write to the same file, and should be made before the
+     * first message is logged.
+     */
+    void set_binary_flag(bool);
+
+    /**
+     * Write the log into memory-mapped segment files, instead of
+     * appending to it with write(2). The segments are named after the
+     * log file, with a numeric suffix: `opencog.log.000000` and so on.
+     * Each is preallocated at `segment_size` bytes; when one fills
+     * up, it is trimmed to the used length and the next one is
+     * started. Concatenating the segments, in order, gives the log.
+     * Writing a message then takes no system call at all, and what
+     * was written survives a crash of the program. (The current
+     * segment is padded with zero bytes until it is finished; after a
+     * restart, writing resumes where it left off.) Every
+     * `msync_msec` milliseconds (never, if zero) the segment is synced
+     * to disk; flush() and error messages sync it right away.
+     * A `segment_size` of zero goes back to the plain log file. This
+     * setting is shared by all loggers that write to the same file.
+     */
+    void set_mmap_segments(size_t segment_size, unsigned msync_msec = 1000);
+
+    /**
+     * Rotate the log file once it grows past `max_bytes`, or once it
+     * is `max_seconds` old (either may be zero, for no limit; both
+     * zero turns rotation off). The old file is renamed, with the
+     * date and time of the rotation appended to its name, as in
+     * `opencog.log.20240131-235959`, and a new file is started. Only
+     * the `keep` most recent of the rotated files are kept (all, if
+     * zero). If `compress` is set, and cogutil was built with zlib,
+     * the rotated files are gzipped. Compression and clean-up happen
+     * on a low-priority background thread, so neither the writer
+     * thread nor the callers of the logger ever wait on them.
+     *
+     * The file is checked before each batch of messages is written;
+     * a file that is not written to is not rotated. In binary mode,
+     * each new file starts with its own header, and can be decoded on
+     * its own. This setting is shared by all loggers that write to the
+     * same file, and does not apply to memory-mapped segments.
+     */
+    void set_rotation(size_t max_bytes, unsigned max_seconds = 0,
+                      unsigned keep = 0, bool compress = true);
+
+    /**
+     * Write the log file through io_uring (Linux 5.6 and later), with
+     * up to `depth` batches in flight, each copied into a buffer of
+     * `buffer_size` bytes that is registered with the kernel up front.
+     * The writer thread hands a batch to the kernel and goes on to the
+     * next one, without waiting for the write; and a sync, for
+     * SYNC_BATCH or SYNC_GROUP, is an fdatasync queued behind the
+     * writes, which only the callers waiting on it wait for. flush()
+     * still returns only once everything is in the file. A `depth` of
+     * zero goes back to plain writes; so does a kernel without
+     * io_uring, silently. Not used with memory-mapped segments or
+     * with rotation. This setting is shared by all loggers that write
+     * to the same file.
+     */
+    void set_io_uring(unsigned depth, size_t buffer_size = 1 << 20);
+
+    /**
+     * Split the writing of the log over `lanes` writer threads, for
+     * programs that log heavily from many cores. Each thread that logs
+     * is assigned to one lane, round-robin, and stays there; each lane
+     * has its own queue and its own file. Lane 0 writes to the log
+     * file itself, and the others to `opencog.log.lane1` and so on.
+     * Within a lane, the messages are in order; across lanes, there is
+     * no order at all, until the files are merged by timestamp, with
+     * `sort-log.py opencog.log opencog.log.lane*` (or, in binary mode,
+     * `cogutil-logdecode` given all of the files). So turn the
+     * timestamps on. The other sinks, the flight recorder and flush()
+     * cover all of the lanes. A single lane (the default) is the
+     * plain, totally ordered log file.
+     *
+     * This setting is shared by all loggers that write to the same
+     * file, and should be made before the first message is logged;
+     * lane files, once started, are kept until the program exits.
+     */
+    void set_lanes(unsigned lanes);
+
+    /**
+     * Limit how often any one call site may log. Each call site gets a
+     * bucket of `burst` tokens, refilled at `msgs_per_sec` tokens per
+     * second; a message is dropped when the bucket is empty. The next
+     * message from that call site that does get through is preceded
+     * by a note saying how many were dropped. The check is made
+     * before the message is formatted, so a runaway loop costs very
+     * little. A rate of zero turns the limit off.
+     *
+     * Call sites are told apart by their format strings, for the
+     * printf-style calls, logf() and fmt(); by their statement, for
+     * LAZY_LOG_*, which are checked before the stream is evaluated;
+     * and by the code that ends the statement, for other messages
+     * built with operator<<. Messages passed in as a std::string are
+     * not limited.
+     */
+    void set_rate_limit(double msgs_per_sec, unsigned burst = 10);
+
+    /**
+     * If set, a message that is the same as the one before it from
+     * the same thread (same level, same text) is not logged. (Threads
+     * are spread over 16 slots; threads that share one also collapse
+     * each other's repeats.) Instead, when a different
+     * message comes along, or on flush(), the note "Last message
+     * repeated N times" is logged. For logf() and fmt(), messages are
+     * compared by format string and argument values, without being
+     * formatted.
+     */
+    void set_collapse_repeats(bool);
+
+    /**
+     * Turn individual LAZY_LOG_* statements on or off at run time,
+     * e.g. to get the FINE messages of one function, without lowering
+     * the log level and paying for every other DEBUG statement in the
+     * program. SITE_ON logs the statements whatever the log level is,
+     * SITE_OFF never logs them, and SITE_DEFAULT goes back to the log
+     * level. The statements picked are those in `file`, or just the
+     * one on `line` of it; the file is matched against the end of the
+     * path, so "Logger.cc" and "util/Logger.cc" both match
+     * "/src/opencog/util/Logger.cc". The setting also applies to
+     * statements that have not been reached yet; later settings take
+     * precedence over earlier ones. Returns the number of statements
+     * reached so far that were changed.
+     *
+     * These settings apply to the whole process. Each statement keeps
+     * its own flag; checking it costs no more than checking the log
+     * level does. Statements above COGUTIL_LOG_MIN_LEVEL are not
+     * compiled in, and can't be turned on.
+     */
+    static unsigned set_site_mode(SiteMode, const std::string& file,
+                                  unsigned line = 0);
+
+    /**
+     * The same, for the statements logged with the given component
+     * string (that of logger(), when the statement was first reached).
+     */
+    static unsigned set_component_site_mode(SiteMode,
+                                            const std::string& component);
+
+    /** Forget all of the above settings. */
+    static void reset_sites();
+
+    /**
+     * The LAZY_LOG_* statements reached so far, one per line, as
+     * `file:line [LEVEL] [component] mode`.
+     */
+    static std::string get_sites();
+
     /**
      * Set the main logger to print only
      * error level log on stdout (useful when one is only interested
@@ -212,27 +576,111 @@ public:
     // void debug(const char *, ...);
     // void fine (const char *, ...);
 
+    /**
+     * Log a message, std::format style, if and only if the passed
+     * level is lower than or equal to the current log level. Unlike
+     * the printf-style methods, the formatting is not done by the
+     * caller: the arguments are copied into the log queue as they
+     * are, and the writer thread formats them later. Thus, the format
+     * string must outlive the call; in practice, it should always be
+     * a string literal. Only plain `{}` placeholders are supported,
+     * e.g.
+     *
+     * logf(Logger::FINE, "Count = {} of {}", count, total)
+     * debug.fmt("Count = {}", count)
+     */
+    template<typename... Args>
+    void logf(Level level, const char* fmt, const Args&... args)
+    {
+        if (level > COGUTIL_LOG_MIN_LEVEL) return;
+        Level cur = level_now();
+        if (!logEnabled or nullptr == _log_writer or
+            (level > cur and level > recordLevel))
+            return;
+
+        // Messages with a backtrace have to be formatted right away
+        // anyway.
+        if constexpr ((logfmt::is_packable<Args> and ...))
+        {
+            if (_limiter and level <= cur and
+                not admit(level, logfmt::hash_args(fmt, args...), fmt, fmt))
+                return;
+
+            size_t len = (logfmt::packed_size(args) + ... + 0);
+            Deferred d;
+            if (level > backTraceLevel and
+                begin_deferred(d, level, len,
+                               &logfmt::format_packed<Args...>, fmt,
+                               logfmt::signature<Args...>::value))
+            {
+                // No ring means that the message was dropped.
+                if (nullptr == d.ring) return;
+                (logfmt::pack(d.args, args), ...);
+                end_deferred(d, level);
+                return;
+            }
+
+            std::string msg;
+            logfmt::format(msg, fmt, args...);
+            write(level, msg, true);
+        }
+        else
+        {
+            // Repeats are spotted by log(), once this is formatted.
+            if (_limiter and level <= cur and
+                not admit(level, 0, fmt, fmt)) return;
+
+            std::string msg;
+            logfmt::format(msg, fmt, args...);
+            log(level, msg);
+        }
+    }
+
+    /**
+     * Stream-style logging: `logger().debug() << "x = " << x;` logs
+     * the message when the expression ends. The text goes into a
+     * buffer borrowed from a per-thread pool, which keeps its capacity
+     * from one message to the next, and is handed to the writer from
+     * there; so, once warmed up, this allocates nothing.
+     */
     class Base
     {
     public:
-        Base(const Base& b) : logger(b.logger), lvl(b.lvl) {}
-        template<typename T> std::stringstream& operator<<(const T& v)
+        Base(const Base& b)
+            : logger(b.logger), lvl(b.lvl), forced(b.forced),
+              limited(b.limited), os(nullptr) {}
+        template<typename T> std::ostream& operator<<(const T& v)
+        {
+            if (nullptr == os) acquire();
+            *os << v;
+            return *os;
+        }
+        /// Log with deferred formatting; see Logger::logf().
+        template<typename... Args>
+        void fmt(const char* f, const Args&... args)
         {
-            ss << v;
-            return ss;
+            if (not forced) { logger.logf(lvl, f, args...); return; }
+            std::string msg;
+            logfmt::format(msg, f, args...);
+            logger.log_forced(lvl, msg);
         }
         ~Base()
         {
-            if (0 < ss.str().length())
-                logger.log(lvl, ss.str());
+            if (os) release();
         }
     protected:
         friend class Logger;
-        Base(Logger& l, Level v) : logger(l), lvl(v) {}
+        Base(Logger& l, Level v, bool f = false, bool lim = false)
+            : logger(l), lvl(v), forced(f), limited(lim), os(nullptr) {}
     private:
+        void acquire();
+        void release();
+
         Logger& logger;
-        std::stringstream ss;
         Level lvl;
+        bool forced;    // log whatever the level; see set_site_mode()
+        bool limited;   // rate limit already checked; see within_rate()
+        std::ostream* os;
     };
 
     class Error : public Base
@@ -302,23 +750,88 @@ public:
      * avoiding unnecessary code for logger. For example:
      * if (isDebugEnabled())  debug(...);
      */
-    bool is_enabled(Level level) const { return level <= currentLevel; }
-    bool is_error_enabled() const { return ERROR <= currentLevel; }
-    bool is_warn_enabled() const { return WARN <= currentLevel; }
-    bool is_info_enabled() const { return INFO <= currentLevel; }
-    bool is_debug_enabled() const { return DEBUG <= currentLevel; }
-    bool is_fine_enabled() const { return FINE <= currentLevel; }
+    bool is_enabled(Level level) const
+        { return level <= level_now(); }
+    bool is_error_enabled() const { return is_enabled(ERROR); }
+    bool is_warn_enabled() const { return is_enabled(WARN); }
+    bool is_info_enabled() const { return is_enabled(INFO); }
+    bool is_debug_enabled() const { return is_enabled(DEBUG); }
+    bool is_fine_enabled() const { return is_enabled(FINE); }
+
+    /**
+     * A LAZY_LOG_* statement. Each one has a static Site, which is
+     * entered into a process-wide list when the statement is first
+     * reached; set_site_mode() then sets its flag.
+     */
+    class Site
+    {
+    public:
+        constexpr Site(const char* f, unsigned l, Level v)
+            : file(f), line(l), level(v), mode(UNSEEN) {}
+
+        /// Whether the statement is to log anything, with `l`.
+        bool enabled(const Logger& l)
+        {
+            switch (mode.load(std::memory_order_relaxed))
+            {
+                case SITE_DEFAULT: return l.is_enabled(level);
+                case SITE_ON: return true;
+                case SITE_OFF: return false;
+                default: l.enroll(*this); return enabled(l);
+            }
+        }
+        bool forced() const
+            { return SITE_ON == mode.load(std::memory_order_relaxed); }
+
+        const char* const file;
+        const unsigned line;
+        const Level level;
+
+    private:
+        friend class Logger;
+        static constexpr uint8_t UNSEEN = 255;
+        std::atomic<uint8_t> mode;
+    };
+
+    /** The stream for the given statement; used by LAZY_LOG_*. */
+    Base stream(const Site& s)
+        { return Base(*this, s.level, s.forced(), true); }
+
+    /** False if the statement is over its rate limit; see
+     *  set_rate_limit(). Checked by LAZY_LOG_* before the stream
+     *  is evaluated. */
+    bool within_rate(const Site& s)
+        { return nullptr == _limiter or admit(s); }
 
     /**
-     * Block until all messages have been written out.
+     * Block until all messages have been written out: those that this
+     * thread logged, and those that other threads logged before them
+     * (i.e. before something that this thread waited for).
      */
     void flush();
 
 private:
 
     std::string component;
-    Level currentLevel;
+    std::string componentTag;   // "[component] ", ready to be copied
+    std::atomic<Level> currentLevel;
+
+    // The level in effect: currentLevel, or that of the nearest
+    // ancestor that has a level of its own; see child().
+    std::atomic<const std::atomic<Level>*> levelSource;
+    Level level_now() const
+    {
+        return levelSource.load(std::memory_order_relaxed)
+                          ->load(std::memory_order_relaxed);
+    }
+
+    // Child loggers; see child(). The tree is guarded by _tree_mtx.
+    Logger* _parent;
+    std::map<std::string, std::unique_ptr<Logger>> _children;
+    static std::mutex _tree_mtx;
+    void inherit_from(const std::atomic<Level>*);
     Level backTraceLevel;
+    Level recordLevel;          // see set_flight_recorder()
     bool timestampEnabled;
     bool threadIdEnabled;
     bool logEnabled;
@@ -336,43 +849,83 @@ private:
      */
     void disable();
 
-    class LogWriter
-    {
-        /* One writer per file */
-        std::string fileName;
-        FILE *logfile;
-        bool writingLoopActive;
-
-        /** One single thread does all writing of log messages */
-        std::thread writer_thread;
-        std::mutex the_mutex;
-
-        /** Queue for log messages */
-        concurrent_queue< std::string* > msg_queue;
-        bool pending_write;
-
-        void start_write_loop();
-        void stop_write_loop();
-        void writing_loop();
-        void write_msg(const std::string&);
-
-    public:
-        LogWriter(void);
-        ~LogWriter();
+    /**
+     * The LogWriter does all of the actual writing; it is defined in
+     * LogWriter.h, which is private to the implementation.
+     */
+    class LogWriter;
 
-        void setFileName(const std::string&);
+    /**
+     * Space reserved in the log queue for a message with deferred
+     * formatting. The header has already been filled in; the packed
+     * arguments are to be written starting at `args`.
+     */
+    struct Deferred
+    {
+        char* args;
+        LogWriter* writer;
+        void* ring;
+        size_t len;
+        int kind;
+    };
+    bool begin_deferred(Deferred&, Level, size_t,
+                        logfmt::FormatFn, const char*, const char*);
+    void end_deferred(Deferred&, Level);
 
-        const std::string& getFileName(void) const
-            { return fileName; }
+    size_t header_parts(Level, std::string_view*, char*) const;
 
-        void qmsg(const std::string& str)
-            { msg_queue.push(new std::string(str)); }
+    /** Log the message, without checking the level or the limits. A
+     *  message above the level goes to the flight recorder, unless
+     *  it is forced. */
+    void write(Level, std::string_view, bool with_backtrace,
+               bool forced = false);
 
-        size_t size(void)
-            { return msg_queue.size(); }
+    /** log(), for text that need not be in a std::string. If `site`
+     *  is given, it tells call sites apart for the rate limit. */
+    void log_text(Level, std::string_view, const void* site = nullptr);
 
-        void flush();
+    /**
+     * Rate limits and repeat collapsing; see set_rate_limit(). Null
+     * unless one of them is turned on. Shared with copies of this
+     * logger. LogLimiter is defined in LogLimiter.h, which is private
+     * to the implementation.
+     */
+    class LogLimiter;
+    std::shared_ptr<LogLimiter> _limiter;
+
+    /** Check the message against the limits; false if it is to be
+     *  dropped. `hash` identifies the message, or is zero. `site`
+     *  identifies the call site (e.g. the format string), or is null;
+     *  `what` is shown when messages from it are dropped. */
+    bool admit(Level, size_t hash, const void* site = nullptr,
+               std::string_view what = {});
+    bool admit(const Site&);
+    void report_repeats();
+
+    /** Log a message from a statement that was turned on with
+     *  set_site_mode(), whatever the log level. */
+    void log_forced(Level, const std::string&);
+
+    /** Enter the statement into the list of those reached, and set
+     *  its mode from the settings made so far. */
+    void enroll(Site&) const;
+    struct SiteEntry
+    {
+        Site* site;
+        std::string component;
+    };
+    struct SiteRule
+    {
+        SiteMode mode;
+        std::string file;
+        unsigned line;
+        std::string component;
     };
+    static bool matches(const SiteRule&, const SiteEntry&);
+    static unsigned apply(const SiteRule&);
+    static std::mutex _sites_mtx;
+    static std::vector<SiteEntry> _sites;
+    static std::vector<SiteRule> _site_rules;
 
     LogWriter* _log_writer;
 
@@ -384,12 +937,25 @@ private:
 // A singleton instance is enough for most users.
 Logger& logger();
 
-// Macros that avoid evaluating the stream if the log-level is disabled
-#define LAZY_LOG_ERROR if(logger().is_error_enabled()) logger().error()
-#define LAZY_LOG_WARN if(logger().is_warn_enabled()) logger().warn()
-#define LAZY_LOG_INFO if(logger().is_info_enabled()) logger().info()
-#define LAZY_LOG_DEBUG if(logger().is_debug_enabled()) logger().debug()
-#define LAZY_LOG_FINE if(logger().is_fine_enabled()) logger().fine()
+// Macros that avoid evaluating the stream if the log-level is disabled.
+// Levels above COGUTIL_LOG_MIN_LEVEL are not even compiled in. Each
+// statement can also be turned on or off by itself; see set_site_mode().
+// The Site is constant-initialized, so that it costs no guard variable.
+#define COGUTIL_LAZY_LOG(LEVEL)                                         \
+    if (opencog::Logger::LEVEL > COGUTIL_LOG_MIN_LEVEL) {}              \
+    else if (static opencog::Logger::Site lazy_site_(                   \
+                 __FILE__, __LINE__, opencog::Logger::LEVEL);           \
+             false) {}                                                  \
+    else if (opencog::Logger& lazy_logger_ = logger();                  \
+             not lazy_site_.enabled(lazy_logger_) or                    \
+             not lazy_logger_.within_rate(lazy_site_)) {}               \
+    else lazy_logger_.stream(lazy_site_)
+
+#define LAZY_LOG_ERROR COGUTIL_LAZY_LOG(ERROR)
+#define LAZY_LOG_WARN COGUTIL_LAZY_LOG(WARN)
+#define LAZY_LOG_INFO COGUTIL_LAZY_LOG(INFO)
+#define LAZY_LOG_DEBUG COGUTIL_LAZY_LOG(DEBUG)
+#define LAZY_LOG_FINE COGUTIL_LAZY_LOG(FINE)
 
 /** @}*/
 }  // namespace opencog
@@ -0,0 +1,222 @@
+/*
+ * opencog/util/LoggerBench.cc
+ *
+ * Copyright (C) 2008 by OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// LoggerBench: how fast is the Logger? Drives a Logger from 1 to N
+// threads, with messages of 32 bytes to 4 KiB, and with the timestamp,
+// thread-id and backtrace settings on and off. For each combination,
+// reports messages and bytes per second, and the latency of each call
+// (p50, p99, p99.9), as JSON. Not installed; build it with
+// `make LoggerBench`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencog/util/Logger.h>
+
+using namespace opencog;
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct Config
+{
+    unsigned threads;
+    size_t msg_bytes;
+    bool timestamp;
+    bool thread_id;
+    bool backtrace;
+};
+
+struct Result
+{
+    Config cfg;
+    size_t messages;
+    double seconds;
+    size_t file_bytes;
+    double p50, p99, p999;   // nanoseconds
+};
+
+void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-t THREADS] [-n COUNT] [-d DIR] [-o OUTPUT]\n",
+            prog);
+    fprintf(stderr, "Measure the throughput and latency of the Logger.\n");
+    fprintf(stderr, " -t Up to THREADS producer threads, doubling from 1"
+                    " (default: the number of cores).\n");
+    fprintf(stderr, " -n Messages per thread (default: 20000; a tenth of"
+                    " that with backtraces).\n");
+    fprintf(stderr, " -d Write the log files in DIR (default: /tmp).\n");
+    fprintf(stderr, " -o Write the JSON to OUTPUT instead of stdout.\n");
+}
+
+// The latency at the given fraction, from the sorted samples.
+double percentile(const std::vector<uint64_t>& sorted, double frac)
+{
+    if (sorted.empty()) return 0;
+    size_t i = std::min(sorted.size() - 1, (size_t) (frac * sorted.size()));
+    return sorted[i];
+}
+
+Result run(const Config& cfg, size_t count, const std::string& dir,
+           unsigned serial)
+{
+    // Loggers share a writer per file name, for good; so each run
+    // gets a file of its own.
+    std::string fname = dir + "/LoggerBench." + std::to_string(getpid()) +
+                        "." + std::to_string(serial) + ".log";
+    unlink(fname.c_str());
+
+    Logger log(fname, Logger::INFO, cfg.timestamp);
+    log.set_thread_id_flag(cfg.thread_id);
+    log.set_backtrace_level(cfg.backtrace ? Logger::INFO : Logger::NONE);
+
+    std::string msg(cfg.msg_bytes, 'x');
+    std::vector<std::vector<uint64_t>> lat(cfg.threads);
+    std::vector<std::thread> producers;
+
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned t = 0; t < cfg.threads; t++)
+    {
+        lat[t].reserve(count);
+        producers.emplace_back([&log, &msg, &lat, t, count]() {
+            for (size_t i = 0; i < count; i++)
+            {
+                bench_clock::time_point t0 = bench_clock::now();
+                log.info(msg);
+                lat[t].push_back(std::chrono::duration_cast<
+                    std::chrono::nanoseconds>(bench_clock::now() - t0).count());
+            }
+        });
+    }
+    for (std::thread& p : producers) p.join();
+    log.flush();
+    double secs = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+
+    std::vector<uint64_t> all;
+    all.reserve(count * cfg.threads);
+    for (const std::vector<uint64_t>& l : lat)
+        all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+
+    struct stat st;
+    size_t bytes = (0 == stat(fname.c_str(), &st)) ? st.st_size : 0;
+    unlink(fname.c_str());
+
+    return Result{cfg, all.size(), secs, bytes,
+                  percentile(all, 0.5), percentile(all, 0.99),
+                  percentile(all, 0.999)};
+}
+
+void print_json(FILE* out, const std::vector<Result>& results)
+{
+    fprintf(out, "{\n  \"benchmark\": \"LoggerBench\",\n  \"results\": [");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result& r = results[i];
+        fprintf(out, "%s\n    {\"threads\": %u, \"msg_bytes\": %zu, "
+                "\"timestamp\": %s, \"thread_id\": %s, \"backtrace\": %s, "
+                "\"messages\": %zu, \"seconds\": %.6f, "
+                "\"msgs_per_sec\": %.1f, \"bytes_per_sec\": %.1f, "
+                "\"latency_ns\": {\"p50\": %.0f, \"p99\": %.0f, "
+                "\"p99_9\": %.0f}}",
+                i ? "," : "",
+                r.cfg.threads, r.cfg.msg_bytes,
+                r.cfg.timestamp ? "true" : "false",
+                r.cfg.thread_id ? "true" : "false",
+                r.cfg.backtrace ? "true" : "false",
+                r.messages, r.seconds,
+                r.messages / r.seconds, r.file_bytes / r.seconds,
+                r.p50, r.p99, r.p999);
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t count = 20000;
+    std::string dir = "/tmp";
+    const char* outname = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ht:n:d:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't': max_threads = std::max(1, atoi(optarg)); break;
+            case 'n': count = std::max(1L, atol(optarg)); break;
+            case 'd': dir = optarg; break;
+            case 'o': outname = optarg; break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (outname and nullptr == (out = fopen(outname, "w")))
+    {
+        fprintf(stderr, "Error: cannot open %s\n", outname);
+        return 1;
+    }
+
+    std::vector<unsigned> threads;
+    for (unsigned t = 1; t < max_threads; t *= 2) threads.push_back(t);
+    threads.push_back(max_threads);
+
+    std::vector<Result> results;
+    unsigned serial = 0;
+    for (unsigned nthr : threads)
+    for (size_t bytes : {32, 256, 4096})
+    for (int flags = 0; flags < 8; flags++)
+    {
+        Config cfg{nthr, bytes, bool(flags & 1), bool(flags & 2),
+                   bool(flags & 4)};
+        // Backtraces are slow; and each one is synced to disk.
+        size_t n = cfg.backtrace ? std::max<size_t>(1, count / 10) : count;
+        results.push_back(run(cfg, n, dir, serial++));
+        fprintf(stderr, "threads=%u bytes=%zu ts=%d tid=%d bt=%d: "
+                "%.0f msgs/sec\n", nthr, bytes, cfg.timestamp,
+                cfg.thread_id, cfg.backtrace,
+                results.back().messages / results.back().seconds);
+    }
+
+    print_json(out, results);
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * opencog/util/QueueBench.cc
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// QueueBench: concurrent_queue against mpmc_queue and spsc_queue, for
+// handing items from one thread to the next. Each queue is run as a
+// pipeline of 1 to N stages (a producer, N-1 forwarding threads, and a
+// consumer, with a queue between each pair), and the items per second
+// through the whole pipeline are reported, as JSON. Not installed;
+// build it with `make QueueBench`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencog/util/concurrent_queue.h>
+#include <opencog/util/mpmc_queue.h>
+#include <opencog/util/spsc_queue.h>
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Marks the end of the stream; canceling won't do, since a canceled
+// concurrent_queue throws away what is left in it.
+const uint64_t END = UINT64_MAX;
+
+struct Result
+{
+    const char* queue;
+    unsigned hops;
+    size_t items;
+    size_t capacity;
+    double seconds;
+};
+
+void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-s STAGES] [-n COUNT] [-c CAPACITY]"
+                    " [-o OUTPUT]\n", prog);
+    fprintf(stderr, "Measure the throughput of the concurrent queues.\n");
+    fprintf(stderr, " -s Up to STAGES queues in a row, doubling from 1"
+                    " (default: 4).\n");
+    fprintf(stderr, " -n Items to send through (default: 2000000).\n");
+    fprintf(stderr, " -c Bound on the queue length (default: 1024).\n");
+    fprintf(stderr, " -o Write the JSON to OUTPUT instead of stdout.\n");
+}
+
+// A bounded concurrent_queue is one with a high watermark; the
+// lock-free queues get the same bound as their capacity.
+template<typename Queue>
+std::unique_ptr<Queue> make_queue(size_t cap)
+{
+    std::unique_ptr<Queue> q(new Queue(cap));
+    return q;
+}
+
+template<>
+std::unique_ptr<concurrent_queue<uint64_t>>
+make_queue<concurrent_queue<uint64_t>>(size_t cap)
+{
+    std::unique_ptr<concurrent_queue<uint64_t>> q(
+        new concurrent_queue<uint64_t>());
+    q->set_watermarks(cap, cap / 2);
+    return q;
+}
+
+template<typename Queue>
+Result run(const char* name, unsigned hops, size_t count, size_t cap)
+{
+    std::vector<std::unique_ptr<Queue>> queues;
+    for (unsigned i = 0; i < hops; i++)
+        queues.push_back(make_queue<Queue>(cap));
+
+    uint64_t sum = 0;
+    std::vector<std::thread> threads;
+    bench_clock::time_point start = bench_clock::now();
+
+    // The consumer, and the stages in between, last to first.
+    threads.emplace_back([&queues, &sum, hops]() {
+        Queue& in = *queues[hops - 1];
+        for (uint64_t v = in.value_pop(); v != END; v = in.value_pop())
+            sum += v;
+    });
+    for (unsigned i = 1; i < hops; i++)
+        threads.emplace_back([&queues, i]() {
+            Queue& in = *queues[i - 1];
+            Queue& out = *queues[i];
+            uint64_t v;
+            do { v = in.value_pop(); out.push(v); } while (v != END);
+        });
+
+    Queue& first = *queues[0];
+    for (uint64_t i = 0; i < count; i++) first.push(i);
+    first.push(END);
+    for (std::thread& th : threads) th.join();
+
+    double secs = std::chrono::duration<double>(
+        bench_clock::now() - start).count();
+    if (sum != count * (count - 1) / 2)
+    {
+        fprintf(stderr, "Error: %s lost items\n", name);
+        exit(1);
+    }
+    return Result{name, hops, count, cap, secs};
+}
+
+void print_json(FILE* out, const std::vector<Result>& results)
+{
+    fprintf(out, "{\n  \"benchmark\": \"QueueBench\",\n  \"results\": [");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result& r = results[i];
+        fprintf(out, "%s\n    {\"queue\": \"%s\", \"stages\": %u, "
+                "\"capacity\": %zu, \"items\": %zu, \"seconds\": %.6f, "
+                "\"items_per_sec\": %.1f, \"ns_per_hop\": %.1f}",
+                i ? "," : "", r.queue, r.hops, r.capacity, r.items,
+                r.seconds, r.items / r.seconds,
+                1e9 * r.seconds / r.items / r.hops);
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+    unsigned max_hops = 4;
+    size_t count = 2000000;
+    size_t cap = 1024;
+    const char* outname = nullptr;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hs:n:c:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's': max_hops = std::max(1, atoi(optarg)); break;
+            case 'n': count = std::max(1L, atol(optarg)); break;
+            case 'c': cap = std::max(2L, atol(optarg)); break;
+            case 'o': outname = optarg; break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (outname and nullptr == (out = fopen(outname, "w")))
+    {
+        fprintf(stderr, "Error: cannot open %s\n", outname);
+        return 1;
+    }
+
+    std::vector<unsigned> hops;
+    for (unsigned h = 1; h < max_hops; h *= 2) hops.push_back(h);
+    hops.push_back(max_hops);
+
+    std::vector<Result> results;
+    for (unsigned h : hops)
+    {
+        results.push_back(run<concurrent_queue<uint64_t>>(
+            "concurrent_queue", h, count, cap));
+        results.push_back(run<mpmc_queue<uint64_t>>(
+            "mpmc_queue", h, count, cap));
+        results.push_back(run<spsc_queue<uint64_t>>(
+            "spsc_queue", h, count, cap));
+        for (size_t i = results.size() - 3; i < results.size(); i++)
+            fprintf(stderr, "stages=%u %-16s %.0f items/sec\n", h,
+                    results[i].queue, results[i].items / results[i].seconds);
+    }
+
+    print_json(out, results);
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -34,6 +34,7 @@
 #include <opencog/util/concurrent_queue.h>
 #include <opencog/util/concurrent_stack.h>
 #include <opencog/util/exceptions.h>
+#include <opencog/util/mpmc_queue.h>
 #include <opencog/util/Logger.h>
 
 namespace opencog
@@ -93,12 +94,21 @@ namespace opencog
  * barrier() call needs to do is to be a fence, ensuring that everything
  * before really is before everything after. It didn't need to actually
  * drain everything.
+ *
+ * The work queue is a concurrent_queue, by default. With many threads
+ * enqueueing at once, they all contend for its one mutex; passing
+ * mpmc_queue as the third template parameter, as in
+ * `async_caller<Writer, Element, mpmc_queue>`, avoids that. That queue
+ * is bounded (65536 elements); a writer thread that enqueues more
+ * work into a full queue will block, so keep the high watermark
+ * well below that.
  */
-template<typename Writer, typename Element>
+template<typename Writer, typename Element,
+         template<typename> class Queue = concurrent_queue>
 class async_caller
 {
 	private:
-		concurrent_queue<Element> _store_queue;
+		Queue<Element> _store_queue;
 		std::vector<std::thread> _write_threads;
 		std::mutex _write_mutex;
 		std::mutex _enqueue_mutex;
@@ -166,8 +176,8 @@ class async_caller
 /// cb: the method that will be called.
 /// nthreads: the number of threads in the writer pool to use. Defaults
 /// to 4 if not specified.
-template<typename Writer, typename Element>
-async_caller<Writer, Element>::async_caller(Writer* wr,
+template<typename Writer, typename Element, template<typename> class Queue>
+async_caller<Writer, Element, Queue>::async_caller(Writer* wr,
                                             void (Writer::*cb)(const Element&),
                                             int nthreads)
 {
@@ -190,8 +200,8 @@ async_caller<Writer, Element>::async_caller(Writer* wr,
 		start_writer_thread();
 }
 
-template<typename Writer, typename Element>
-async_caller<Writer, Element>::~async_caller()
+template<typename Writer, typename Element, template<typename> class Queue>
+async_caller<Writer, Element, Queue>::~async_caller()
 {
 	stop_writer_threads();
 }
@@ -205,15 +215,15 @@ async_caller<Writer, Element>::~async_caller()
 /// this does not prevent other threads from adding more work, as long
 /// as those other threads did not see a large backlog.
 ///
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::set_watermarks(size_t hi, size_t lo)
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::set_watermarks(size_t hi, size_t lo)
 {
 	_high_watermark = hi;
 	_low_watermark = lo;
 }
 
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::clear_stats()
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::clear_stats()
 {
 	_item_count = 0;
 	_flush_count = 0;
@@ -227,8 +237,8 @@ void async_caller<Writer, Element>::clear_stats()
 
 /// Start a single writer thread.
 /// May be called multiple times.
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::start_writer_thread()
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::start_writer_thread()
 {
 	// logger().info("async_caller: starting a writer thread");
 	std::unique_lock<std::mutex> lock(_write_mutex);
@@ -241,8 +251,8 @@ void async_caller<Writer, Element>::start_writer_thread()
 }
 
 /// Stop all writer threads, but only after they are done writing.
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::stop_writer_threads()
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::stop_writer_threads()
 {
 	// logger().info("async_caller: stopping all writer threads");
 	std::unique_lock<std::mutex> lock(_write_mutex);
@@ -293,8 +303,8 @@ void async_caller<Writer, Element>::stop_writer_threads()
 ///
 /// This will deadlock, if called from a writer thread.
 /// Thus, not for public use.
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::drain()
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::drain()
 {
 	_flush_count++;
 
@@ -315,8 +325,8 @@ void async_caller<Writer, Element>::drain()
 /// adding at a high rate, this call might not return for a long time;
 /// it might never return! There is no guarantee of forward progress!
 ///
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::flush_queue()
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::flush_queue()
 {
 	_flush_count++;
 	while (0 < _store_queue.size())
@@ -333,8 +343,8 @@ void async_caller<Writer, Element>::flush_queue()
 /// Forward progress is guaranteed: this method will return in finite
 /// time.
 ///
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::barrier()
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::barrier()
 {
 	std::unique_lock<std::mutex> lock(_enqueue_mutex);
 
@@ -363,8 +373,8 @@ void async_caller<Writer, Element>::barrier()
 /// other actions that require synchronization that the default
 /// `barrier(void)` would miss.
 ///
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::barrier(const Element& elt)
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::barrier(const Element& elt)
 {
 	std::unique_lock<std::mutex> lock(_enqueue_mutex);
 
@@ -406,8 +416,8 @@ void async_caller<Writer, Element>::barrier(const Element& elt)
 
 /// A single write thread. Reads elements from queue, and invokes the
 /// method on them.
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::write_loop()
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::write_loop()
 {
 	while (true)
 	{
@@ -422,7 +432,7 @@ void async_caller<Writer, Element>::write_loop()
 			if (1 == old_pend)
 				_pending.notify_all();
 		}
-		catch (typename concurrent_queue<Element>::Canceled& e)
+		catch (typename Queue<Element>::Canceled& e)
 		{
 			if (_current_barrier != nullptr)
 			{
@@ -463,8 +473,8 @@ void async_caller<Writer, Element>::write_loop()
  * If the queue is over-full, then this will block until the queue is
  * mostly drained...
  */
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::enqueue(Element&& elt)
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::enqueue(Element&& elt)
 {
 	// Sanity checks.
 	if (_stopping_writers)
@@ -550,8 +560,8 @@ void async_caller<Writer, Element>::enqueue(Element&& elt)
 	}
 }
 
-template<typename Writer, typename Element>
-void async_caller<Writer, Element>::enqueue(const Element& elt)
+template<typename Writer, typename Element, template<typename> class Queue>
+void async_caller<Writer, Element, Queue>::enqueue(const Element& elt)
 {
 	enqueue(std::move(Element(elt)));
 }
@@ -51,11 +51,6 @@
 
     #include "backtrace-symbols.h"
 
-    #define fatal(a, b) exit(1)
-    #define bfd_fatal(a) exit(1)
-    #define bfd_nonfatal(a) exit(1)
-    #define list_matching_formats(a) exit(1)
-
     /* 2 characters for each byte, plus 1 each for 0, x, and NULL */
     #define PTRSTR_LEN (sizeof(void *) * 2 + 3)
     #define true 1
@@ -73,6 +68,7 @@
     #include <bfd.h>
     #include <dlfcn.h>
     #include <link.h>
+    #include <sys/stat.h>
     #include <pthread.h>
 
     /* 150 isn't special; it's just an arbitrary non-ASCII char value.  */
@@ -83,17 +79,19 @@
     #endif
 /* Read in the symbol table.  */
 
-static void slurp_symtab(bfd *abfd, asymbol **syms)
+static asymbol **slurp_symtab(bfd *abfd)
 {
     long symcount;
     unsigned int size;
+    asymbol **syms = NULL;
 
-    if ((bfd_get_file_flags(abfd) & HAS_SYMS) == 0) return;
+    if ((bfd_get_file_flags(abfd) & HAS_SYMS) == 0) return NULL;
 
     symcount = bfd_read_minisymbols(abfd, false, (PTR)&syms, &size);
     if (symcount == 0) symcount = bfd_read_minisymbols(abfd, true /* dynamic */, (PTR)&syms, &size);
 
-    if (symcount < 0) bfd_fatal(bfd_get_filename(abfd));
+    if (symcount < 0) return NULL;
+    return syms;
 }
 
 /* These variables are used to pass information between
@@ -182,7 +180,7 @@ static char **translate_addresses_buf(bfd *abfd, bfd_vma *addr, int naddr, asymb
             spot.pc = addr[naddr - 1];
 
             spot.found = false;
-            bfd_map_over_sections(abfd, find_address_in_section, (PTR)&spot);
+            if (abfd != NULL) bfd_map_over_sections(abfd, find_address_in_section, (PTR)&spot);
 
             if (!spot.found) {
                 total += snprintf(buf, len, "[0x%llx] \?\?() \?\?:0",
@@ -213,42 +211,91 @@ static char **translate_addresses_buf(bfd *abfd, bfd_vma *addr, int naddr, asymb
     }
     return ret_buf;
 }
+/* Files opened so far, with their symbol tables. Opening a file and
+   reading in its symbols is by far the slowest part of a lookup, so
+   this is done once per file, and not once per address. The files stay
+   open for the life of the process; if there are too many, the oldest
+   one is closed. A file is known by its device, inode and modification
+   time as well as by its name, so that a library that was rebuilt or
+   replaced under the same name is read in again. Protected by
+   bfd_mutex.  */
+
+    #define MAX_OPEN_FILES 32
+
+struct open_file {
+    char *name;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    bfd *abfd;
+    asymbol **syms;
+};
+static struct open_file open_files[MAX_OPEN_FILES];
+static int n_open_files = 0;
+static int next_to_close = 0;
+
 /* Process a file.  */
 
 static char **process_file(const char *file_name, bfd_vma *addr, int naddr)
 {
     bfd *abfd = NULL;
     char **matching = NULL;
-    char **ret_buf = NULL;
-    asymbol **syms = NULL; /* Symbol table */
+    struct open_file *of, *stale;
+    struct stat st;
+    int i;
+
+    /* If the file can't be looked at, the name is all there is.  */
+    if (stat(file_name, &st) != 0)
+        memset(&st, 0, sizeof(st));
+
+    /* A file replaced under the same name gets its old slot back.  */
+    stale = NULL;
+    for (i = 0; i < n_open_files; i++) {
+        of = &open_files[i];
+        if (strcmp(of->name, file_name) != 0) continue;
+        if (of->dev == st.st_dev && of->ino == st.st_ino && of->mtime == st.st_mtime)
+            return translate_addresses_buf(of->abfd, addr, naddr, of->syms);
+        stale = of;
+    }
 
+    /* This runs on the logger's writer thread, so a file that can't be
+       read (deleted since it was loaded, say) must not end the process;
+       its addresses are printed without symbols instead.  */
     abfd = bfd_openr(file_name, NULL);
 
-    if (abfd == NULL) bfd_fatal(file_name);
-
-    if (bfd_check_format(abfd, bfd_archive))
-        fatal("%s: can not get addresses from archive", file_name);
+    if (abfd == NULL)
+        return translate_addresses_buf(NULL, addr, naddr, NULL);
 
-    if (!bfd_check_format_matches(abfd, bfd_object, &matching)) {
-        bfd_nonfatal(bfd_get_filename(abfd));
-        if (bfd_get_error() == bfd_error_file_ambiguously_recognized) {
-            list_matching_formats(matching);
+    if (bfd_check_format(abfd, bfd_archive) ||
+        !bfd_check_format_matches(abfd, bfd_object, &matching)) {
+        if (bfd_get_error() == bfd_error_file_ambiguously_recognized)
             free(matching);
-        }
-        xexit(1);
+        bfd_close(abfd);
+        return translate_addresses_buf(NULL, addr, naddr, NULL);
     }
 
-    slurp_symtab(abfd, syms);
-
-    ret_buf = translate_addresses_buf(abfd, addr, naddr, syms);
-
-    if (syms != NULL) {
-        free(syms);
-        syms = NULL;
+    if (stale != NULL) {
+        of = stale;
+        free(of->syms);
+        bfd_close(of->abfd);
+        free(of->name);
+    } else if (n_open_files < MAX_OPEN_FILES) {
+        of = &open_files[n_open_files++];
+    } else {
+        of = &open_files[next_to_close];
+        next_to_close = (next_to_close + 1) % MAX_OPEN_FILES;
+        free(of->syms);
+        bfd_close(of->abfd);
+        free(of->name);
     }
-
-    bfd_close(abfd);
-    return ret_buf;
+    of->name = strdup(file_name);
+    of->dev = st.st_dev;
+    of->ino = st.st_ino;
+    of->mtime = st.st_mtime;
+    of->abfd = abfd;
+    of->syms = slurp_symtab(abfd);
+
+    return translate_addresses_buf(abfd, addr, naddr, of->syms);
 }
 
     #define MAX_DEPTH 16
@@ -286,6 +333,7 @@ static int find_matching_file(struct dl_phdr_info *info, size_t size, void *data
 char **oc_backtrace_symbols(void *const *buffer, int size)
 {
     static pthread_mutex_t bfd_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static int bfd_ready = false;
 
     int stack_depth = size - 1;
     int x, y;
@@ -299,7 +347,10 @@ char **oc_backtrace_symbols(void *const *buffer, int size)
     locations = malloc(sizeof(char **) * (stack_depth + 1));
 
     pthread_mutex_lock(&bfd_mutex);
-    bfd_init();
+    if (!bfd_ready) {
+        bfd_init();
+        bfd_ready = true;
+    }
     for (x = stack_depth, y = 0; x >= 0; x--, y++) {
         struct file_match match = {.address = buffer[x]};
         char **ret_buf;
@@ -0,0 +1,255 @@
+/*
+ * opencog/util/logdecode.cc
+ *
+ * Copyright (C) 2008 by OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// cogutil-logdecode: convert a binary log file (written by a Logger
+// with the binary flag set) back into the usual text layout, which
+// is what scripts/util/sort-log.py and filter-log.sh expect. Given
+// several files, such as the lanes of a log written with
+// Logger::set_lanes(), it merges them by timestamp.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "LogBinary.h"
+
+using namespace opencog;
+
+namespace {
+
+struct CallSite
+{
+    Logger::Level level;
+    std::string fmt;
+    std::string sig;
+};
+
+void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-o OUTPUT] LOGFILE...\n", prog);
+    fprintf(stderr, "Convert a binary OpenCog log file to text. Several"
+                    " files are merged by timestamp.\n");
+    fprintf(stderr, " -o Write to OUTPUT instead of stdout.\n");
+}
+
+// Copy a frame header out of the buffer, if there is enough left.
+template<typename T>
+bool get_frame(T& frame, const char* p, const char* end)
+{
+    if ((size_t) (end - p) < sizeof(T)) return false;
+    memcpy(&frame, p, sizeof(T));
+    return true;
+}
+
+// A decoded message, with its timestamp, for the merge. Messages
+// without one take that of the message before.
+struct Entry
+{
+    uint64_t stamp;
+    std::string text;
+};
+typedef std::function<void(uint64_t, const char*, size_t)> Emit;
+
+// Decode the file, passing each message to `emit`, in file order.
+// Returns false if the file is corrupt.
+bool decode(const char* name, const Emit& emit)
+{
+    std::ifstream in(name, std::ios::binary);
+    if (not in)
+    {
+        fprintf(stderr, "Error: cannot open %s\n", name);
+        return false;
+    }
+    std::vector<char> buf((std::istreambuf_iterator<char>(in)),
+                          std::istreambuf_iterator<char>());
+
+    std::map<uint32_t, CallSite> defs;
+    std::map<uint32_t, std::string> comps;
+    std::string line;
+    uint64_t stamp = 0;
+
+    const char* p = buf.data();
+    const char* end = p + buf.size();
+    bool truncated = false;
+    while (p < end and not truncated)
+    {
+        line.clear();
+        switch ((uint8_t) *p)
+        {
+            case logbin::SESSION:
+            {
+                if ((size_t) (end - p) < sizeof(logbin::MAGIC) or
+                    memcmp(p, logbin::MAGIC, sizeof(logbin::MAGIC)))
+                    goto corrupt;
+                defs.clear();
+                comps.clear();
+                p += sizeof(logbin::MAGIC);
+                break;
+            }
+            case logbin::DEF:
+            {
+                logbin::DefFrame df;
+                if (not get_frame(df, p, end) or
+                    (size_t) (end - p) < sizeof(df) + df.fmt_len + df.sig_len)
+                { truncated = true; break; }
+                p += sizeof(df);
+                CallSite& cs = defs[df.id];
+                cs.level = (Logger::Level) df.level;
+                cs.fmt.assign(p, df.fmt_len);
+                cs.sig.assign(p + df.fmt_len, df.sig_len);
+                p += df.fmt_len + df.sig_len;
+                break;
+            }
+            case logbin::COMPONENT:
+            {
+                logbin::ComponentFrame cf;
+                if (not get_frame(cf, p, end) or
+                    (size_t) (end - p) < sizeof(cf) + cf.len)
+                { truncated = true; break; }
+                p += sizeof(cf);
+                comps[cf.id].assign(p, cf.len);
+                p += cf.len;
+                break;
+            }
+            case logbin::MSG:
+            {
+                logbin::MsgFrame mf;
+                if (not get_frame(mf, p, end) or
+                    (size_t) (end - p) < sizeof(mf) + mf.args_len)
+                { truncated = true; break; }
+                p += sizeof(mf);
+
+                auto def = defs.find(mf.id);
+                if (defs.end() == def) goto corrupt;
+                const CallSite& cs = def->second;
+                logbin::format_header(line, mf.flags, cs.level, mf.stamp,
+                                      mf.component ? comps[mf.component] : "",
+                                      mf.thread);
+                if (not logbin::format_args(line, cs.fmt.c_str(),
+                                            cs.sig.c_str(), p, mf.args_len))
+                    goto corrupt;
+                line.push_back('\n');
+                if (mf.flags & logbin::TIMESTAMP) stamp = mf.stamp;
+                emit(stamp, line.data(), line.size());
+                p += mf.args_len;
+                break;
+            }
+            case logbin::TEXT:
+            {
+                logbin::TextFrame tf;
+                if (not get_frame(tf, p, end) or
+                    (size_t) (end - p) < sizeof(tf) + tf.len)
+                { truncated = true; break; }
+                p += sizeof(tf);
+                // Formatted in the caller; the time is in the text.
+                logbin::Header hdr;
+                if (logbin::parse_header(p, tf.len, hdr) and hdr.stamp)
+                    stamp = hdr.stamp;
+                emit(stamp, p, tf.len);
+                p += tf.len;
+                break;
+            }
+            default:
+                goto corrupt;
+        }
+    }
+
+    // The last frame may have been cut short by a crash.
+    if (truncated)
+        fprintf(stderr, "Warning: %s: truncated frame at offset %zd\n",
+                name, p - buf.data());
+    return true;
+
+corrupt:
+    fprintf(stderr, "Error: %s: corrupt log at offset %zd\n",
+            name, p - buf.data());
+    return false;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+    const char* outname = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "ho:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'o': outname = optarg; break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind == argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (outname and nullptr == (out = fopen(outname, "w")))
+    {
+        fprintf(stderr, "Error: cannot open %s\n", outname);
+        return 1;
+    }
+
+    // A single file is written out as it is decoded.
+    int nfiles = argc - optind;
+    if (1 == nfiles)
+    {
+        bool ok = decode(argv[optind],
+            [out](uint64_t, const char* text, size_t len)
+            { fwrite(text, 1, len, out); });
+        if (out != stdout) fclose(out);
+        return ok ? 0 : 1;
+    }
+
+    // Several files: sort all of the messages by time. Threads that
+    // share a lane take their timestamps before they queue, so even
+    // one file is not quite in order. The sort is stable, so ties
+    // keep the order of the files, and the order within each.
+    std::vector<Entry> entries;
+    bool ok = true;
+    for (int i = optind; i < argc; i++)
+        ok = decode(argv[i], [&entries](uint64_t stamp, const char* text,
+                                        size_t len)
+                    { entries.push_back({stamp, std::string(text, len)}); })
+             and ok;
+
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const Entry& a, const Entry& b)
+                     { return a.stamp < b.stamp; });
+    for (const Entry& e : entries)
+        fwrite(e.text.data(), 1, e.text.size(), out);
+    if (out != stdout) fclose(out);
+    return ok ? 0 : 1;
+}
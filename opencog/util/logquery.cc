@@ -0,0 +1,516 @@
+/*
+ * opencog/util/logquery.cc
+ *
+ * Copyright (C) 2008 by OpenCog Foundation
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// cogutil-logquery: filter and sort a text log file, as filter-log.sh
+// and sort-log.py do, but without parsing the whole log on every
+// query. The first query builds an index of the messages (where each
+// starts, and its timestamp, level, component and thread), using all
+// cores, and keeps it next to the log, in `opencog.log.idx`. Later
+// queries read the index, and touch only the messages they print. If
+// the log has grown since, only the new part is indexed; if it was
+// rotated or rewritten, the index is built afresh.
+//
+// A message is a line that starts with a header, as written by
+// Logger::log() (a timestamp, a level, or both), and all of the lines
+// after it that don't, such as those of a backtrace.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "LogBinary.h"
+
+using namespace opencog;
+
+namespace {
+
+/// One message of the log.
+struct Entry
+{
+    uint64_t offset;
+    uint64_t stamp;     // nanoseconds; that of the message before, if none
+    uint32_t length;    // all of the lines, newlines included
+    uint32_t comp;      // one plus the index in the component table; or 0
+    uint32_t thread;    // likewise, for the thread table
+    uint8_t level;      // a Logger::Level, or BAD_LEVEL if there is none
+    uint8_t unused[3];
+};
+
+/// Start of the index file. It is followed by the entries, and then by
+/// the component and thread names, each preceded by its length.
+struct IndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t indexed;     // bytes of the log covered by the index
+    uint64_t head_hash;   // of the first HEAD_BYTES of them
+    uint64_t nentries;
+    uint32_t ncomps;
+    uint32_t nthreads;
+};
+
+const char INDEX_MAGIC[8] = {'O','C','L','O','G','I','D','X'};
+const uint32_t INDEX_VERSION = 1;
+const size_t HEAD_BYTES = 4096;
+
+// Don't bother splitting up less than this.
+const size_t MIN_CHUNK = 1 << 20;
+
+/// Names interned as small ids. A deque, so that the views into the
+/// names stay put as it grows.
+struct Names
+{
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, uint32_t> ids;
+
+    uint32_t id(std::string_view name)
+    {
+        if (name.empty()) return 0;
+        auto it = ids.find(name);
+        if (ids.end() != it) return it->second;
+        names.emplace_back(name);
+        uint32_t id = names.size();
+        ids.emplace(names.back(), id);
+        return id;
+    }
+
+    // The id of a name, or 0 if it does not occur at all.
+    uint32_t find(std::string_view name) const
+    {
+        auto it = ids.find(name);
+        return ids.end() == it ? 0 : it->second;
+    }
+};
+
+struct Index
+{
+    std::vector<Entry> entries;
+    Names comps, threads;
+    uint64_t indexed = 0;
+    uint64_t head_hash = 0;
+};
+
+/// The messages of one chunk of the log, with names local to it.
+struct Chunk
+{
+    std::vector<Entry> entries;
+    Names comps, threads;
+};
+
+void usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] LOGFILE\n", prog);
+    fprintf(stderr, "Filter and sort an OpenCog log file, using an index"
+                    " kept in LOGFILE.idx.\n");
+    fprintf(stderr, " -l LEVEL     Only messages of level LEVEL.\n");
+    fprintf(stderr, " -m LEVEL     Only messages of level LEVEL and more"
+                    " severe.\n");
+    fprintf(stderr, " -c COMPONENT Only messages from COMPONENT.\n");
+    fprintf(stderr, " -T THREAD    Only messages from thread THREAD.\n");
+    fprintf(stderr, " -f TIME      Only messages from TIME on, such as"
+                    " \"2024-01-31 23:59\".\n");
+    fprintf(stderr, " -u TIME      Only messages before TIME.\n");
+    fprintf(stderr, " -s           Sort chronologically.\n");
+    fprintf(stderr, " -t           Sort such that messages from the same"
+                    " thread are clumped together.\n");
+    fprintf(stderr, " -n           Print the number of messages, not the"
+                    " messages.\n");
+    fprintf(stderr, " -o OUTPUT    Write to OUTPUT instead of stdout.\n");
+    fprintf(stderr, " -x INDEX     Keep the index in INDEX instead.\n");
+    fprintf(stderr, " -j JOBS      Index with JOBS threads (default: the"
+                    " number of cores).\n");
+    fprintf(stderr, " -r           Rebuild the index.\n");
+}
+
+uint64_t fnv1a(const char* p, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) p[i]) * 1099511628211ULL;
+    return h;
+}
+
+// The end of the line at `p`, past the newline.
+const char* line_end(const char* p, const char* end)
+{
+    const char* nl = (const char*) memchr(p, '\n', end - p);
+    return nl ? nl + 1 : end;
+}
+
+/// Index the messages in [begin, end). Both are at the start of a
+/// message, except maybe at the very start of the log.
+void scan(const char* base, uint64_t begin, uint64_t end, Chunk& chunk)
+{
+    const char* p = base + begin;
+    const char* stop = base + end;
+    logbin::Header h;
+    while (p < stop)
+    {
+        const char* eol = line_end(p, stop);
+        if (logbin::parse_header(p, eol - p, h) or chunk.entries.empty())
+        {
+            Entry e = {};
+            e.offset = p - base;
+            e.stamp = h.stamp;
+            e.length = 0;
+            e.comp = chunk.comps.id(h.component);
+            e.thread = chunk.threads.id(h.thread);
+            e.level = (0 <= h.level) ? h.level : Logger::BAD_LEVEL;
+            chunk.entries.push_back(e);
+        }
+        Entry& last = chunk.entries.back();
+        last.length = eol - (base + last.offset);
+        p = eol;
+    }
+}
+
+// The first message that starts at or after `pos`.
+uint64_t next_message(const char* base, uint64_t pos, uint64_t end)
+{
+    if (0 == pos) return 0;
+    const char* p = line_end(base + pos - 1, base + end);
+    logbin::Header h;
+    while (p < base + end)
+    {
+        const char* eol = line_end(p, base + end);
+        if (logbin::parse_header(p, eol - p, h)) break;
+        p = eol;
+    }
+    return p - base;
+}
+
+/// Index [begin, end) of the log, in parallel, and add it to the index.
+void extend(Index& index, const char* base, uint64_t begin, uint64_t end,
+            unsigned jobs)
+{
+    uint64_t bytes = end - begin;
+    jobs = std::max<uint64_t>(1, std::min<uint64_t>(jobs, bytes / MIN_CHUNK));
+
+    std::vector<uint64_t> bounds(jobs + 1, end);
+    bounds[0] = begin;
+    for (unsigned j = 1; j < jobs; j++)
+        bounds[j] = std::max(bounds[j - 1],
+                             next_message(base, begin + bytes * j / jobs, end));
+
+    std::vector<Chunk> chunks(jobs);
+    std::vector<std::thread> workers;
+    for (unsigned j = 1; j < jobs; j++)
+        workers.emplace_back(scan, base, bounds[j], bounds[j + 1],
+                             std::ref(chunks[j]));
+    scan(base, bounds[0], bounds[1], chunks[0]);
+    for (std::thread& w : workers) w.join();
+
+    // Only the first chunk may start in the middle of a message: the
+    // lines at the very start of the log, before any header.
+    uint64_t stamp = index.entries.empty() ? 0 : index.entries.back().stamp;
+    for (Chunk& c : chunks)
+    {
+        for (Entry e : c.entries)
+        {
+            if (e.comp) e.comp = index.comps.id(c.comps.names[e.comp - 1]);
+            if (e.thread)
+                e.thread = index.threads.id(c.threads.names[e.thread - 1]);
+            if (0 == e.stamp) e.stamp = stamp;
+            stamp = e.stamp;
+            index.entries.push_back(e);
+        }
+    }
+    index.indexed = end;
+}
+
+bool load_index(Index& index, const std::string& name)
+{
+    std::ifstream in(name, std::ios::binary);
+    if (not in) return false;
+    std::vector<char> buf((std::istreambuf_iterator<char>(in)),
+                          std::istreambuf_iterator<char>());
+
+    IndexHeader ih;
+    if (buf.size() < sizeof(ih)) return false;
+    memcpy(&ih, buf.data(), sizeof(ih));
+    if (memcmp(ih.magic, INDEX_MAGIC, sizeof(ih.magic)) or
+        INDEX_VERSION != ih.version or sizeof(Entry) != ih.entry_size or
+        (buf.size() - sizeof(ih)) / sizeof(Entry) < ih.nentries)
+        return false;
+
+    const char* p = buf.data() + sizeof(ih);
+    const char* end = buf.data() + buf.size();
+    index.entries.resize(ih.nentries);
+    memcpy(index.entries.data(), p, ih.nentries * sizeof(Entry));
+    p += ih.nentries * sizeof(Entry);
+
+    for (Names* names : {&index.comps, &index.threads})
+    {
+        uint32_t n = (names == &index.comps) ? ih.ncomps : ih.nthreads;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            uint32_t len;
+            if ((size_t) (end - p) < sizeof(len)) return false;
+            memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            if ((size_t) (end - p) < len) return false;
+            names->id(std::string_view(p, len));
+            p += len;
+        }
+    }
+    index.indexed = ih.indexed;
+    index.head_hash = ih.head_hash;
+    return true;
+}
+
+bool save_index(const Index& index, const std::string& name)
+{
+    std::string tmp = name + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (nullptr == f) return false;
+
+    IndexHeader ih;
+    memcpy(ih.magic, INDEX_MAGIC, sizeof(ih.magic));
+    ih.version = INDEX_VERSION;
+    ih.entry_size = sizeof(Entry);
+    ih.indexed = index.indexed;
+    ih.head_hash = index.head_hash;
+    ih.nentries = index.entries.size();
+    ih.ncomps = index.comps.names.size();
+    ih.nthreads = index.threads.names.size();
+    fwrite(&ih, sizeof(ih), 1, f);
+    fwrite(index.entries.data(), sizeof(Entry), index.entries.size(), f);
+    for (const Names* names : {&index.comps, &index.threads})
+        for (const std::string& s : names->names)
+        {
+            uint32_t len = s.size();
+            fwrite(&len, sizeof(len), 1, f);
+            fwrite(s.data(), 1, len, f);
+        }
+
+    bool ok = not ferror(f);
+    ok = (0 == fclose(f)) and ok;
+    if (ok and 0 == rename(tmp.c_str(), name.c_str())) return true;
+    unlink(tmp.c_str());
+    return false;
+}
+
+// A time given on the command line, in the layout of the log, and
+// cut short anywhere: "2024-01-31", "2024-01-31 23:59" and the like.
+bool parse_time(const char* arg, uint64_t& stamp)
+{
+    static const std::string zero = "1970-01-01 00:00:00:000";
+    size_t len = strlen(arg);
+    if (zero.size() < len) return false;
+    std::string line = "[" + std::string(arg) + zero.substr(len) + "] ";
+    logbin::Header h;
+    if (not logbin::parse_header(line.data(), line.size(), h) or
+        h.length != line.size())
+        return false;
+    stamp = h.stamp;
+    return true;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+    const char* outname = nullptr;
+    std::string idxname;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    bool rebuild = false, chrono = false, by_thread = false, count = false;
+    Logger::Level level = Logger::BAD_LEVEL, max_level = Logger::BAD_LEVEL;
+    const char* component = nullptr;
+    const char* thread = nullptr;
+    uint64_t from = 0, until = UINT64_MAX;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hl:m:c:T:f:u:stno:x:j:r")) != -1)
+    {
+        switch (opt)
+        {
+            case 'l':
+            case 'm':
+            {
+                Logger::Level l = Logger::get_level_from_string(optarg);
+                if (Logger::BAD_LEVEL == l)
+                {
+                    fprintf(stderr, "Error: unknown level %s\n", optarg);
+                    return 1;
+                }
+                ('l' == opt ? level : max_level) = l;
+                break;
+            }
+            case 'c': component = optarg; break;
+            case 'T': thread = optarg; break;
+            case 'f':
+            case 'u':
+                if (not parse_time(optarg, 'f' == opt ? from : until))
+                {
+                    fprintf(stderr, "Error: bad time %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's': chrono = true; break;
+            case 't': by_thread = true; break;
+            case 'n': count = true; break;
+            case 'o': outname = optarg; break;
+            case 'x': idxname = optarg; break;
+            case 'j': jobs = std::max(1, atoi(optarg)); break;
+            case 'r': rebuild = true; break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind + 1 != argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    const char* logname = argv[optind];
+    if (idxname.empty()) idxname = std::string(logname) + ".idx";
+
+    int fd = open(logname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 or fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "Error: cannot open %s\n", logname);
+        return 1;
+    }
+    size_t size = st.st_size;
+    const char* base = nullptr;
+    if (0 < size)
+    {
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED == map)
+        {
+            fprintf(stderr, "Error: cannot map %s\n", logname);
+            return 1;
+        }
+        base = (const char*) map;
+    }
+    close(fd);
+
+    // Only whole lines get indexed; a line still being written is
+    // left for the next time.
+    uint64_t end = size;
+    while (0 < end and '\n' != base[end - 1]) end--;
+    uint64_t head_hash = fnv1a(base, std::min<uint64_t>(end, HEAD_BYTES));
+
+    // Use the index if it is for this log; extend it if the log has
+    // grown. The last message may have grown, too, so it is indexed
+    // over again.
+    Index index;
+    bool grown = false;
+    bool fresh = rebuild or not load_index(index, idxname) or
+                 end < index.indexed or
+                 index.head_hash != fnv1a(base,
+                     std::min<uint64_t>(index.indexed, HEAD_BYTES));
+    if (fresh)
+    {
+        index = Index();
+        madvise((void*) base, size, MADV_SEQUENTIAL);
+        extend(index, base, 0, end, jobs);
+    }
+    else if (index.indexed < end)
+    {
+        uint64_t begin = 0;
+        if (not index.entries.empty())
+        {
+            begin = index.entries.back().offset;
+            index.entries.pop_back();
+        }
+        extend(index, base, begin, end, jobs);
+        grown = true;
+    }
+    if (fresh or grown)
+    {
+        index.head_hash = head_hash;
+        if (not save_index(index, idxname))
+            fprintf(stderr, "Warning: cannot write the index %s\n",
+                    idxname.c_str());
+    }
+
+    // The query proper; nothing but the index is looked at.
+    uint32_t comp_id = component ? index.comps.find(component) : 0;
+    uint32_t thread_id = thread ? index.threads.find(thread) : 0;
+    std::vector<const Entry*> hits;
+    if ((nullptr == component or comp_id) and (nullptr == thread or thread_id))
+        for (const Entry& e : index.entries)
+        {
+            if (Logger::BAD_LEVEL != level and level != e.level) continue;
+            if (Logger::BAD_LEVEL != max_level and
+                (Logger::BAD_LEVEL == e.level or max_level < e.level))
+                continue;
+            if (component and comp_id != e.comp) continue;
+            if (thread and thread_id != e.thread) continue;
+            if (e.stamp < from or until <= e.stamp) continue;
+            hits.push_back(&e);
+        }
+
+    FILE* out = stdout;
+    if (outname and nullptr == (out = fopen(outname, "w")))
+    {
+        fprintf(stderr, "Error: cannot open %s\n", outname);
+        return 1;
+    }
+    if (count)
+    {
+        fprintf(out, "%zu\n", hits.size());
+        if (out != stdout) fclose(out);
+        return 0;
+    }
+
+    // Threads are clumped in the order in which they first appear.
+    if (by_thread)
+    {
+        std::vector<uint32_t> rank(index.threads.names.size() + 1, UINT32_MAX);
+        uint32_t next = 0;
+        for (const Entry* e : hits)
+            if (UINT32_MAX == rank[e->thread]) rank[e->thread] = next++;
+        std::stable_sort(hits.begin(), hits.end(),
+            [&rank, chrono](const Entry* a, const Entry* b)
+            {
+                if (rank[a->thread] != rank[b->thread])
+                    return rank[a->thread] < rank[b->thread];
+                return chrono and a->stamp < b->stamp;
+            });
+    }
+    else if (chrono)
+        std::stable_sort(hits.begin(), hits.end(),
+            [](const Entry* a, const Entry* b) { return a->stamp < b->stamp; });
+
+    for (const Entry* e : hits)
+        fwrite(base + e->offset, 1, e->length, out);
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,418 @@
+/*
+ * opencog/util/mpmc_queue.h
+ *
+ * Bounded multi-producer, multi-consumer queue; a drop-in variant of
+ * concurrent_queue that takes no locks. The ring is that of Dmitry
+ * Vyukov's "Bounded MPMC queue", from 1024cores.net.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _OC_MPMC_QUEUE_H
+#define _OC_MPMC_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <queue>
+#include <thread>
+
+/** \addtogroup grp_cogutil
+ *  @{
+ */
+
+//! A thread-safe first in-first out list, of bounded size, with no locks.
+///
+/// Same API as concurrent_queue, and the same behavior, with these
+/// exceptions:
+/// 1) The queue holds at most capacity() elements, fixed when it is
+///    constructed (rounded up to a power of two). push() blocks when
+///    the queue is full, as it does at the high watermark; try_push()
+///    doesn't.
+/// 2) There is no snapshot().
+/// 3) size(), and the watermarks that depend on it, are approximate
+///    while other threads are pushing or popping.
+///
+/// The elements live in an array of cells, each with a sequence number
+/// that says whether it is ready to be written or to be read. A push
+/// or a pop claims a cell with a single compare-and-swap on the tail
+/// or the head index, which live on cache lines of their own; there
+/// is no lock to contend for, however many threads are pushing. A
+/// thread waits only when the queue is empty (or full): it spins for
+/// a little while, then sleeps with std::atomic::wait(); and the other
+/// side pays for a wake-up only when someone is actually sleeping.
+///
+/// Element must be default-constructible and move-assignable; popped
+/// cells are left holding a moved-from Element.
+
+template<typename Element>
+class mpmc_queue
+{
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        Element data;
+    };
+
+    const size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+
+    // Next cell to push into, and next cell to pop from.
+    alignas(64) std::atomic<size_t> _tail;
+    alignas(64) std::atomic<size_t> _head;
+
+    // Bumped to wake up the threads waiting for an element, or for
+    // room; each side counts its waiters, so that the other side can
+    // skip the wake-up if there are none.
+    alignas(64) std::atomic<uint32_t> _pushed;
+    std::atomic<uint32_t> _pop_waiters;
+    alignas(64) std::atomic<uint32_t> _popped;
+    std::atomic<uint32_t> _push_waiters;
+
+    std::atomic<bool> is_canceled;
+    std::atomic<size_t> _high_watermark;
+    std::atomic<size_t> _low_watermark;
+
+    mpmc_queue(const mpmc_queue&) = delete;  // disable copying
+    mpmc_queue& operator=(const mpmc_queue&) = delete; // no assign
+
+    static size_t round_up(size_t n)
+    {
+        size_t cap = 2;
+        while (cap < n) cap <<= 1;
+        return cap;
+    }
+
+    // How many times to look again before going to sleep.
+    static constexpr int SPIN_TRIES = 64;
+
+public:
+    // These limits seem ... reasonable ...
+    static constexpr size_t DEFAULT_CAPACITY = 65536;
+    static constexpr size_t DEFAULT_HIGH_WATER_MARK = INT32_MAX;
+    static constexpr size_t DEFAULT_LOW_WATER_MARK = INT32_MAX - 65536;
+
+    mpmc_queue(size_t capacity = DEFAULT_CAPACITY)
+        : _mask(round_up(capacity) - 1),
+          _cells(new Cell[_mask + 1]),
+          _tail(0), _head(0),
+          _pushed(0), _pop_waiters(0), _popped(0), _push_waiters(0),
+          is_canceled(false),
+          _high_watermark(DEFAULT_HIGH_WATER_MARK),
+          _low_watermark(DEFAULT_LOW_WATER_MARK)
+    {
+        for (size_t i = 0; i <= _mask; i++)
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    ~mpmc_queue()
+    { if (not is_canceled) cancel(); }
+
+    struct Canceled : public std::exception
+    {
+        const char * what() { return "Cancellation of wait on mpmc_queue"; }
+    };
+
+    size_t capacity() const noexcept { return _mask + 1; }
+
+private:
+    /// Claim the cell at the tail, and move the Element into it; false
+    /// if the queue is full.
+    template<typename E>
+    bool push_cell(E&& item)
+    {
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true)
+        {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+            if (0 == dif)
+            {
+                if (_tail.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+                return false;
+            else
+                pos = _tail.load(std::memory_order_relaxed);
+        }
+        cell->data = std::forward<E>(item);
+        cell->seq.store(pos + 1, std::memory_order_release);
+
+        // Pairs with the fence in wait_for(): either the waiter sees
+        // the element, or we see the waiter.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (0 < _pop_waiters.load(std::memory_order_relaxed))
+        {
+            _pushed.fetch_add(1, std::memory_order_release);
+            _pushed.notify_one();
+        }
+        return true;
+    }
+
+    /// Take the Element out of the cell at the head; false if the
+    /// queue is empty.
+    bool pop_cell(Element& value)
+    {
+        size_t pos = _head.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true)
+        {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (0 == dif)
+            {
+                if (_head.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+                return false;
+            else
+                pos = _head.load(std::memory_order_relaxed);
+        }
+        value = std::move(cell->data);
+        cell->seq.store(pos + _mask + 1, std::memory_order_release);
+
+        // Wake up waiting pushers when dropping below the low
+        // watermark. (hysteresis)
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (0 < _push_waiters.load(std::memory_order_relaxed) and
+            size() < low_mark())
+        {
+            _popped.fetch_add(1, std::memory_order_release);
+            _popped.notify_all();
+        }
+        return true;
+    }
+
+    /// Block until `ready()`, or until the queue is canceled: spin a
+    /// while, then sleep. The generation is read before the waiter is
+    /// counted, and the waiter is counted before ready() is looked
+    /// at; so a wake-up that comes in between is not lost.
+    template<typename Ready>
+    void wait_for(std::atomic<uint32_t>& gen, std::atomic<uint32_t>& waiters,
+                  Ready&& ready)
+    {
+        // Counted waiters cost the other side a wake-up on every
+        // push (or pop); a short wait is better spent not counted.
+        for (int i = 0; i < SPIN_TRIES; i++)
+        {
+            if (ready() or is_canceled) return;
+            std::this_thread::yield();
+        }
+        while (true)
+        {
+            uint32_t g = gen.load(std::memory_order_acquire);
+            waiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ready() or is_canceled)
+            {
+                waiters.fetch_sub(1);
+                return;
+            }
+            gen.wait(g, std::memory_order_acquire);
+            waiters.fetch_sub(1);
+        }
+    }
+
+    bool below_high_watermark() const
+    {
+        return size() < std::min(_high_watermark.load(), capacity());
+    }
+
+    /// Blocked pushers go again below this many elements.
+    size_t low_mark() const
+    {
+        return std::min({_low_watermark.load(), _high_watermark.load(),
+                         capacity()});
+    }
+
+    /// The cell at the head holds an element, or the one at the tail
+    /// is free; not merely claimed by a push or pop under way.
+    bool head_ready() const
+    {
+        size_t pos = _head.load(std::memory_order_relaxed);
+        return _cells[pos & _mask].seq.load(std::memory_order_acquire)
+               == pos + 1;
+    }
+    bool tail_ready() const
+    {
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        return _cells[pos & _mask].seq.load(std::memory_order_acquire)
+               == pos;
+    }
+
+    template<typename E>
+    void push_impl(E&& item)
+    {
+        // Block if the queue is at or above the high watermark, or
+        // full; wait until it drops below the low watermark.
+        while (true)
+        {
+            if (is_canceled) throw Canceled();
+            if (below_high_watermark() and push_cell(std::forward<E>(item)))
+                return;
+            wait_for(_popped, _push_waiters, [this]() {
+                return size() < low_mark() and tail_ready(); });
+        }
+    }
+
+public:
+    void push(const Element& item) { push_impl(item); }
+    void push(Element&& item) { push_impl(std::move(item)); }
+
+    /// Push the item, unless the queue is full (or at the high
+    /// watermark), or canceled. Never blocks.
+    bool try_push(const Element& item)
+    {
+        return not is_canceled and below_high_watermark() and push_cell(item);
+    }
+    bool try_push(Element&& item)
+    {
+        return not is_canceled and below_high_watermark() and
+               push_cell(std::move(item));
+    }
+
+    /// Return true if the queue is empty at this instant in time.
+    /// Since other threads may have pushed or popped immediately
+    /// after this call, the emptiness of the queue may have
+    /// changed by the time the caller looks at it.
+    bool is_empty() const
+    {
+        if (is_canceled) throw Canceled();
+        return 0 == size();
+    }
+
+    /// Return true if the queue is at/above high watermark or has
+    /// blocked pushers.
+    bool is_full() const
+    {
+        return not below_high_watermark() or 0 < _push_waiters.load();
+    }
+
+    /// Return the size of the queue at this instant in time. Pushes
+    /// and pops that are under way are counted as done.
+    size_t size() const
+    {
+        size_t head = _head.load(std::memory_order_acquire);
+        size_t tail = _tail.load(std::memory_order_acquire);
+        return (tail > head) ? tail - head : 0;
+    }
+
+    /// Try to get an element off the front of the queue. Return true
+    /// if success, else return false. This will work even on closed
+    /// queues, and so can be used to drain the queue. Another
+    /// alternative for closed queues is the wait_and_take_all()
+    /// method, which blocks on open queues, and empties closed ones.
+    bool try_get(Element& value) { return pop_cell(value); }
+    bool try_pop(Element& value) { return try_get(value); }
+
+    /// Pop an item off the queue. Block if the queue is empty.
+    void pop(Element& value)
+    {
+        while (true)
+        {
+            if (is_canceled) throw Canceled();
+            if (pop_cell(value)) return;
+            wait_for(_pushed, _pop_waiters,
+                     [this]() { return head_ready(); });
+        }
+    }
+    void wait_pop(Element& value) { pop(value); }
+
+    Element value_pop()
+    {
+        Element value;
+        pop(value);
+        return value;
+    }
+
+    std::queue<Element> wait_and_take_all()
+    {
+        std::queue<Element> retval;
+        Element value;
+        while (retval.empty())
+        {
+            while (pop_cell(value)) retval.push(std::move(value));
+            if (not retval.empty() or is_canceled) break;
+            wait_for(_pushed, _pop_waiters,
+                     [this]() { return head_ready(); });
+        }
+        return retval;
+    }
+
+    /// A weak barrier.  This will block as long as the queue is empty,
+    /// returning only when the queue isn't. Weak in the same way as
+    /// concurrent_queue::barrier().
+    void barrier()
+    {
+        wait_for(_pushed, _pop_waiters, [this]() { return head_ready(); });
+        if (is_canceled) throw Canceled();
+
+        // The wake-up may have been meant for a popper; pass it on.
+        if (0 < _pop_waiters.load())
+        {
+            _pushed.fetch_add(1, std::memory_order_release);
+            _pushed.notify_one();
+        }
+    }
+
+    /// Set the high and low watermarks for the queue; see
+    /// concurrent_queue::set_watermarks(). A high watermark above the
+    /// capacity is the capacity.
+    void set_watermarks(size_t high, size_t low)
+    {
+        _high_watermark = high;
+        _low_watermark = low;
+
+        // Pushers blocked on the old marks look again.
+        _popped.fetch_add(1, std::memory_order_release);
+        _popped.notify_all();
+    }
+
+    void cancel_reset()
+    {
+       // This doesn't lose data, but it instead allows new calls
+       // to not throw Canceled exceptions
+       is_canceled = false;
+    }
+    void open() { cancel_reset(); }
+
+    void cancel()
+    {
+       if (is_canceled.exchange(true)) throw Canceled();
+       _pushed.fetch_add(1, std::memory_order_release);
+       _pushed.notify_all();
+       _popped.fetch_add(1, std::memory_order_release);
+       _popped.notify_all();
+    }
+    void close() { cancel(); }
+
+    bool is_closed() const noexcept { return is_canceled; }
+
+    /// No locks are taken, except to sleep when empty or full.
+    static bool is_lock_free() noexcept { return true; }
+};
+/** @}*/
+
+#endif // _OC_MPMC_QUEUE_H
@@ -78,6 +78,7 @@ unsigned long long atoll(const char *str)
 // ==========================================================
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>   // for sbrk(), sysconf()
 
 // Return memory usage per sbrk system call.
@@ -94,6 +95,28 @@ size_t opencog::getMemUsage()
     return diff;
 }
 
+// The name of the calling thread, as last set by set_thread_name().
+// Both are trivially destructible, so they can still be read while
+// the thread exits.
+static thread_local char t_thread_name[16];
+static thread_local unsigned t_thread_name_changes;
+
+static void remember_thread_name(const char* name)
+{
+    strncpy(t_thread_name, name, sizeof(t_thread_name) - 1);
+    t_thread_name_changes++;
+}
+
+const char* opencog::get_thread_name()
+{
+    return t_thread_name;
+}
+
+unsigned opencog::thread_name_changes()
+{
+    return t_thread_name_changes;
+}
+
 #ifdef __APPLE__
 #include <sys/sysctl.h>
 #include <sys/types.h>
@@ -120,6 +143,7 @@ uint64_t opencog::getFreeRAM()
 void opencog::set_thread_name(const char* name)
 {
     pthread_setname_np(name);
+    remember_thread_name(name);
 }
 
 #else // __APPLE__
@@ -143,5 +167,6 @@ uint64_t opencog::getFreeRAM()
 void opencog::set_thread_name(const char* name)
 {
     prctl(PR_SET_NAME, name, 0, 0, 0);
+    remember_thread_name(name);
 }
 #endif // __APPLE__
@@ -70,6 +70,15 @@ uint64_t getFreeRAM();
 
 void set_thread_name(const char* name);
 
+//! The name last given to the calling thread with set_thread_name(),
+//! or "" if none. Names are cut short at 15 characters, as the kernel
+//! does.
+const char* get_thread_name();
+
+//! How many times set_thread_name() was called by the calling thread;
+//! a copy of its name is stale once this changes.
+unsigned thread_name_changes();
+
 /** @}*/
 } // namespace opencog
 
@@ -0,0 +1,362 @@
+/*
+ * opencog/util/spsc_queue.h
+ *
+ * Bounded single-producer, single-consumer queue; a variant of
+ * concurrent_queue for pipeline stages, with no locks and no
+ * read-modify-write operations on the fast path.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _OC_SPSC_QUEUE_H
+#define _OC_SPSC_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <queue>
+#include <thread>
+
+/** \addtogroup grp_cogutil
+ *  @{
+ */
+
+//! A first in-first out list, for one producer thread and one consumer.
+///
+/// Same API as mpmc_queue (and so, mostly, as concurrent_queue), but
+/// only one thread may push, and only one thread may pop (or call
+/// try_get(), wait_and_take_all() or barrier()), at any one time. The
+/// other calls (size(), cancel(), set_watermarks() and so on) may come
+/// from anywhere.
+///
+/// The ring is a plain array, with the producer's tail index and the
+/// consumer's head index on cache lines of their own. Each side keeps
+/// a copy of the other side's index, and reads the real one only when
+/// the copy says the ring is full (or empty); so in the steady state
+/// the two threads touch no cache line in common except the element
+/// being handed over. A push or a pop is a load and a store, and never
+/// waits for the other thread. Only when the ring is empty (or full,
+/// or at the high watermark) does a thread wait: it spins for a
+/// little while, then sleeps with std::atomic::wait(). The other side
+/// pays for a wake-up only when someone is sleeping.
+///
+/// Element must be default-constructible and move-assignable; popped
+/// slots are left holding a moved-from Element.
+
+template<typename Element>
+class spsc_queue
+{
+private:
+    const size_t _mask;
+    std::unique_ptr<Element[]> _buf;
+
+    // Producer-owned.
+    alignas(64) std::atomic<size_t> _tail;
+    size_t _cached_head;
+
+    // Consumer-owned.
+    alignas(64) std::atomic<size_t> _head;
+    size_t _cached_tail;
+
+    // Bumped to wake up the consumer waiting for an element, or the
+    // producer waiting for room.
+    alignas(64) std::atomic<uint32_t> _pushed;
+    std::atomic<bool> _pop_waiting;
+    alignas(64) std::atomic<uint32_t> _popped;
+    std::atomic<bool> _push_waiting;
+
+    std::atomic<bool> is_canceled;
+    std::atomic<size_t> _high_watermark;
+    std::atomic<size_t> _low_watermark;
+
+    spsc_queue(const spsc_queue&) = delete;  // disable copying
+    spsc_queue& operator=(const spsc_queue&) = delete; // no assign
+
+    static size_t round_up(size_t n)
+    {
+        size_t cap = 2;
+        while (cap < n) cap <<= 1;
+        return cap;
+    }
+
+    // How many times to look again before going to sleep.
+    static constexpr int SPIN_TRIES = 64;
+
+public:
+    // These limits seem ... reasonable ...
+    static constexpr size_t DEFAULT_CAPACITY = 65536;
+    static constexpr size_t DEFAULT_HIGH_WATER_MARK = INT32_MAX;
+    static constexpr size_t DEFAULT_LOW_WATER_MARK = INT32_MAX - 65536;
+
+    spsc_queue(size_t capacity = DEFAULT_CAPACITY)
+        : _mask(round_up(capacity) - 1),
+          _buf(new Element[_mask + 1]),
+          _tail(0), _cached_head(0), _head(0), _cached_tail(0),
+          _pushed(0), _pop_waiting(false), _popped(0), _push_waiting(false),
+          is_canceled(false),
+          _high_watermark(DEFAULT_HIGH_WATER_MARK),
+          _low_watermark(DEFAULT_LOW_WATER_MARK)
+    {}
+    ~spsc_queue()
+    { if (not is_canceled) cancel(); }
+
+    struct Canceled : public std::exception
+    {
+        const char * what() { return "Cancellation of wait on spsc_queue"; }
+    };
+
+    size_t capacity() const noexcept { return _mask + 1; }
+
+private:
+    size_t high_mark() const
+    {
+        return std::min(_high_watermark.load(std::memory_order_relaxed),
+                        capacity());
+    }
+
+    /// Blocked pushers go again below this many elements.
+    size_t low_mark() const
+    {
+        return std::min({_low_watermark.load(std::memory_order_relaxed),
+                         _high_watermark.load(std::memory_order_relaxed),
+                         capacity()});
+    }
+
+    /// Producer only: is there room below the high watermark? Looks
+    /// at the consumer's index only if the cached copy says no.
+    bool has_room(size_t tail)
+    {
+        size_t limit = high_mark();
+        if (tail - _cached_head < limit) return true;
+        _cached_head = _head.load(std::memory_order_acquire);
+        return tail - _cached_head < limit;
+    }
+
+    /// Consumer only: is there an element? Looks at the producer's
+    /// index only if the cached copy says no.
+    bool has_element(size_t head)
+    {
+        if (head != _cached_tail) return true;
+        _cached_tail = _tail.load(std::memory_order_acquire);
+        return head != _cached_tail;
+    }
+
+    template<typename E>
+    bool push_slot(E&& item)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (not has_room(tail)) return false;
+        _buf[tail & _mask] = std::forward<E>(item);
+        _tail.store(tail + 1, std::memory_order_release);
+
+        // Pairs with the fence in wait_for(): either the consumer
+        // sees the element, or we see that it is asleep.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_pop_waiting.load(std::memory_order_relaxed))
+        {
+            _pushed.fetch_add(1, std::memory_order_release);
+            _pushed.notify_one();
+        }
+        return true;
+    }
+
+    bool pop_slot(Element& value)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (not has_element(head)) return false;
+        value = std::move(_buf[head & _mask]);
+        _head.store(head + 1, std::memory_order_release);
+
+        // Wake up the waiting pusher when dropping below the low
+        // watermark. (hysteresis)
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_push_waiting.load(std::memory_order_relaxed) and
+            size() < low_mark())
+        {
+            _popped.fetch_add(1, std::memory_order_release);
+            _popped.notify_one();
+        }
+        return true;
+    }
+
+    /// Block until `ready()`, or until the queue is canceled: spin a
+    /// while, then sleep. The generation is read before the flag is
+    /// raised, and the flag is raised before ready() is looked at; so
+    /// a wake-up that comes in between is not lost.
+    template<typename Ready>
+    void wait_for(std::atomic<uint32_t>& gen, std::atomic<bool>& waiting,
+                  Ready&& ready)
+    {
+        for (int i = 0; i < SPIN_TRIES; i++)
+        {
+            if (ready() or is_canceled) return;
+            std::this_thread::yield();
+        }
+        while (true)
+        {
+            uint32_t g = gen.load(std::memory_order_acquire);
+            waiting.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ready() or is_canceled) break;
+            gen.wait(g, std::memory_order_acquire);
+        }
+        waiting.store(false);
+    }
+
+    template<typename E>
+    void push_impl(E&& item)
+    {
+        // Block if the queue is at or above the high watermark, or
+        // full; wait until it drops below the low watermark.
+        while (true)
+        {
+            if (is_canceled) throw Canceled();
+            if (push_slot(std::forward<E>(item))) return;
+            wait_for(_popped, _push_waiting, [this]() {
+                return size() < low_mark(); });
+        }
+    }
+
+    bool not_empty() const
+    {
+        return _head.load(std::memory_order_relaxed) !=
+               _tail.load(std::memory_order_acquire);
+    }
+
+public:
+    void push(const Element& item) { push_impl(item); }
+    void push(Element&& item) { push_impl(std::move(item)); }
+
+    /// Push the item, unless the queue is full (or at the high
+    /// watermark), or canceled. Never blocks.
+    bool try_push(const Element& item)
+    {
+        return not is_canceled and push_slot(item);
+    }
+    bool try_push(Element&& item)
+    {
+        return not is_canceled and push_slot(std::move(item));
+    }
+
+    /// Return true if the queue is empty at this instant in time.
+    bool is_empty() const
+    {
+        if (is_canceled) throw Canceled();
+        return 0 == size();
+    }
+
+    /// Return true if the queue is at/above high watermark or has
+    /// a blocked pusher.
+    bool is_full() const
+    {
+        return size() >= high_mark() or _push_waiting.load();
+    }
+
+    /// Return the size of the queue at this instant in time.
+    size_t size() const
+    {
+        size_t head = _head.load(std::memory_order_acquire);
+        size_t tail = _tail.load(std::memory_order_acquire);
+        return (tail > head) ? tail - head : 0;
+    }
+
+    /// Try to get an element off the front of the queue. Return true
+    /// if success, else return false. This will work even on closed
+    /// queues, and so can be used to drain the queue.
+    bool try_get(Element& value) { return pop_slot(value); }
+    bool try_pop(Element& value) { return try_get(value); }
+
+    /// Pop an item off the queue. Block if the queue is empty.
+    void pop(Element& value)
+    {
+        while (true)
+        {
+            if (is_canceled) throw Canceled();
+            if (pop_slot(value)) return;
+            wait_for(_pushed, _pop_waiting,
+                     [this]() { return not_empty(); });
+        }
+    }
+    void wait_pop(Element& value) { pop(value); }
+
+    Element value_pop()
+    {
+        Element value;
+        pop(value);
+        return value;
+    }
+
+    std::queue<Element> wait_and_take_all()
+    {
+        std::queue<Element> retval;
+        Element value;
+        while (retval.empty())
+        {
+            while (pop_slot(value)) retval.push(std::move(value));
+            if (not retval.empty() or is_canceled) break;
+            wait_for(_pushed, _pop_waiting,
+                     [this]() { return not_empty(); });
+        }
+        return retval;
+    }
+
+    /// Block as long as the queue is empty.
+    void barrier()
+    {
+        wait_for(_pushed, _pop_waiting, [this]() { return not_empty(); });
+        if (is_canceled) throw Canceled();
+    }
+
+    /// Set the high and low watermarks for the queue; see
+    /// concurrent_queue::set_watermarks(). A high watermark above the
+    /// capacity is the capacity.
+    void set_watermarks(size_t high, size_t low)
+    {
+        _high_watermark = high;
+        _low_watermark = low;
+
+        // A pusher blocked on the old marks looks again.
+        _popped.fetch_add(1, std::memory_order_release);
+        _popped.notify_all();
+    }
+
+    void cancel_reset()
+    {
+       // This doesn't lose data, but it instead allows new calls
+       // to not throw Canceled exceptions
+       is_canceled = false;
+    }
+    void open() { cancel_reset(); }
+
+    void cancel()
+    {
+       if (is_canceled.exchange(true)) throw Canceled();
+       _pushed.fetch_add(1, std::memory_order_release);
+       _pushed.notify_all();
+       _popped.fetch_add(1, std::memory_order_release);
+       _popped.notify_all();
+    }
+    void close() { cancel(); }
+
+    bool is_closed() const noexcept { return is_canceled; }
+
+    static bool is_lock_free() noexcept { return true; }
+};
+/** @}*/
+
+#endif // _OC_SPSC_QUEUE_H
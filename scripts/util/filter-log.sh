@@ -2,6 +2,9 @@
 #
 # Given a component and a log file, filter the log so that only the
 # messages from the component are output.
+#
+# For big logs, cogutil-logquery does the same, and more, from an
+# index, without reading the whole log each time.
 
 set -u
 
@@ -2,11 +2,15 @@
 
 # Sort a log according to some order (chronological or thread
 # cohesiveness for now).
+#
+# For big logs, cogutil-logquery does the same, and more, from an
+# index, without reading the whole log each time.
 
 import re
 import sys
 import datetime
 import argparse
+import fileinput
 import functools
 
 def datetime_from_str(time_str):
@@ -100,7 +104,8 @@ def thread_chrono_compare(x, y):
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description='Sort the given log according to a given order, such as chronological, thread cohesive, etc.')
-    parser.add_argument('logfile', help='Log file to sort')
+    parser.add_argument('logfile', nargs='+',
+                        help='Log file to sort. Several files, such as the lanes of a log written with Logger::set_lanes(), are merged into one.')
     parser.add_argument('-c', '--chrono', action='store_true', default=True,
                         help='Sort chronologically. Indeed, such order can be broken if the logger is asynchronous.')
     parser.add_argument('-t', '--thread', action='store_true', default=False,
@@ -130,7 +135,10 @@ if __name__ == "__main__":
     tln, dt, ln = None, None, None
     line_num = 0
     t2ln = {}
-    for l in open(args.logfile):
+    for l in fileinput.input(args.logfile):
+        # A message never continues into the next file
+        if fileinput.isfirstline():
+            dt = None
         # Parse timestamp, thread and fill the key2txt entry
         timestamp_m = timestamp_prog.match(l)
         thread_m = thread_prog.match(l)